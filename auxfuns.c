@@ -49,35 +49,62 @@ static Fiz_Code aux_puts(Fiz  *F, int argc, char **argv, void *data) {
     return FIZ_OK;
 }
 
+/* Looks up the variables of expressions for aux_expr() */
+struct expr_vars {
+    Fiz *F;
+    char msg[80];
+};
+
+static const char *expr_var(const char *name, Expr_Number *value, void *data) {
+    struct expr_vars *V = data;
+    if(!fiz_get_var_number(V->F, name, value))
+        return NULL;
+    if(!fiz_get_var(V->F, name))
+        snprintf(V->msg, sizeof V->msg, "unknown variable '%s'", name);
+    else
+        snprintf(V->msg, sizeof V->msg, "variable '%s' is not a number", name);
+    return V->msg;
+}
+
+/*
+ * Expressions that refer to variables, like `expr {$a < 100}`, are
+ * compiled once and kept in a cache, since their text stays the same
+ * as the values of the variables change. Other expressions usually
+ * had values substituted into them, so they are evaluated directly.
+ */
 static Fiz_Code aux_expr(Fiz *F, int argc, char **argv, void *data) {
     char *e;
     const char *err;
     int i;
     size_t len = 0;
+    Expr_Number result;
+    struct expr_vars V;
+    struct expr *x;
     if(argc < 2)
         return fiz_argc_error(F, argv[0], 2);
     for(i = 1; i < argc; i++)
         len += strlen(argv[i]);
-    e = malloc(len+1);
+    e = fiz_alloc_temp(F, len+1);
     if(!e)
         return fiz_oom_error(F);
     e[0] = '\0';
     for(i = 1; i < argc; i++)
         strcat(e, argv[i]);
     assert(strlen(e) == len);
-#ifdef FIZ_INTEGER_EXPR
-    int result = expr(e, &err);
-#else
-    double result = expr(e, &err);
-#endif
+    if(strchr(e, '$')) {
+        if(!F->expr_cache && !(F->expr_cache = expr_cache_create(0)))
+            return fiz_oom_error(F);
+        V.F = F;
+        x = expr_cache_get(F->expr_cache, e, &err);
+        result = x ? expr_eval(x, expr_var, &V, &err) : 0;
+    } else
+        result = expr(e, &err);
     if(err) {
         fiz_set_return_ex(F, "expr: %s in '%s'", err, e);
-        free(e);
         return FIZ_ERROR;
     }
-    free(e);
 #ifdef FIZ_INTEGER_EXPR
-    fiz_set_return_ex(F, "%d", result);
+    fiz_set_return_int(F, result);
 #else
     fiz_set_return_normalized_double(F, result);
 #endif
@@ -88,30 +115,50 @@ static Fiz_Code aux_eqne(Fiz *F, int argc, char **argv, void *data) {
     if(argc != 3)
         return fiz_argc_error(F, argv[0], 3);
     if(!strcmp(argv[0], "eq"))
-        fiz_set_return_ex(F, "%d", !strcmp(argv[1],argv[2]));
+        fiz_set_return_int(F, !strcmp(argv[1],argv[2]));
     else
-        fiz_set_return_ex(F, "%d", !!strcmp(argv[1],argv[2]));
+        fiz_set_return_int(F, !!strcmp(argv[1],argv[2]));
     return FIZ_OK;
 }
 
-static Fiz_Code aux_incr(Fiz *F, int argc, char **argv, void *data) {
-    const char *val;
-    int i;
-    if(argc != 2)
-        return fiz_argc_error(F, argv[0], 2);
-    val = fiz_get_var(F, argv[1]);
-    if(!val) {
-        fiz_set_return_ex(F, "%s not found", argv[1]);
+/* The variables and body of a loop over a dict */
+struct dict_loop {
+    const char *key, *val, *body;
+    const char *prefix;
+    size_t prefix_len;
+};
+
+static Fiz_Code dict_loop_body(Fiz *F, const char *key, const char *value, void *data) {
+    struct dict_loop *L = data;
+    Fiz_Code rc;
+    if(L->prefix && strncmp(key, L->prefix, L->prefix_len))
+        return FIZ_BREAK; /* Past the keys with the prefix */
+    fiz_set_var(F, L->key, key);
+    fiz_set_var(F, L->val, value);
+    rc = fiz_exec(F, L->body);
+    return rc == FIZ_CONTINUE ? FIZ_OK : rc;
+}
+
+/* Runs 'dict D foreach|range|prefix ... key val do {body}' */
+static Fiz_Code dict_loop(Fiz *F, int argc, char **argv, int nargs, const char *from, const char *to, const char *prefix) {
+    struct dict_loop L;
+    Fiz_Code rc;
+    if(argc < 7 + nargs)
+        return fiz_argc_error(F, argv[0], 7 + nargs);
+    if(strcmp(argv[5 + nargs], "do")) {
+        fiz_set_return_ex(F, "syntax is: %s %s %s%s key val do {body}", argv[0], argv[1], argv[2],
+            nargs == 2 ? " from to" : nargs == 1 ? " prefix" : "");
         return FIZ_ERROR;
     }
-    i = atoi(val);
-    if(!strcmp(argv[0], "decr"))
-        i--;
-    else
-        i++;
-    fiz_set_var_ex(F, argv[1], "%d", i);
-    fiz_set_return_ex(F, "%d", i);
-    return FIZ_OK;
+    L.key = argv[3 + nargs];
+    L.val = argv[4 + nargs];
+    L.body = argv[6 + nargs];
+    L.prefix = prefix;
+    L.prefix_len = prefix ? strlen(prefix) : 0;
+    rc = fiz_dict_range(F, argv[1], from, to, dict_loop_body, &L);
+    if(rc == FIZ_BREAK)
+        return FIZ_OK;
+    return rc == FIZ_OK ? FIZ_OK : FIZ_ERROR;
 }
 
 static Fiz_Code aux_dict(Fiz *F, int argc, char **argv, void *data) {
@@ -163,18 +210,26 @@ static Fiz_Code aux_dict(Fiz *F, int argc, char **argv, void *data) {
         fiz_dict_delete(F, argv[1], argv[3]);
         fiz_set_return(F, "");
     } else if(!strcmp(argv[2], "foreach")) {
-        if(argc < 7)
-            return fiz_argc_error(F, argv[0], 7);
-        if(strcmp(argv[5], "do")) {
-            fiz_set_return_ex(F, "syntax is: %s %s %s key val do {body}", argv[0], argv[1], argv[2]);
+        return dict_loop(F, argc, argv, 0, NULL, NULL, NULL);
+    } else if(!strcmp(argv[2], "ordered")) {
+        fiz_dict_ordered(F, argv[1]);
+        fiz_set_return(F, "");
+    } else if(!fiz_dict_is_ordered(F, argv[1]) && (!strcmp(argv[2], "min") || !strcmp(argv[2], "max")
+            || !strcmp(argv[2], "range") || !strcmp(argv[2], "prefix"))) {
+        fiz_set_return_ex(F, "dict %s is not ordered", argv[1]);
+        return FIZ_ERROR;
+    } else if(!strcmp(argv[2], "min") || !strcmp(argv[2], "max")) {
+        v = strcmp(argv[2], "min") ? fiz_dict_max(F, argv[1]) : fiz_dict_min(F, argv[1]);
+        if(!v) {
+            fiz_set_return_ex(F, "dict %s is empty", argv[1]);
             return FIZ_ERROR;
         }
-        while((v = fiz_dict_next(F, argv[1], v)) != NULL) {
-            fiz_set_var(F, argv[3], v);
-            fiz_set_var(F, argv[4], fiz_dict_find(F, argv[1], v));
-            if(fiz_exec(F, argv[6]) != FIZ_OK)
-                return FIZ_ERROR;
-        }
+        fiz_set_return(F, v);
+    } else if(!strcmp(argv[2], "range")) {
+        /* An empty bound leaves the range open on that side */
+        return dict_loop(F, argc, argv, 2, argv[3][0] ? argv[3] : NULL, argv[4][0] ? argv[4] : NULL, NULL);
+    } else if(!strcmp(argv[2], "prefix")) {
+        return dict_loop(F, argc, argv, 1, argv[3], NULL, argv[3]);
     } else {
         fiz_set_return_ex(F, "unknown command %s to %s", argv[2], argv[0]);
         return FIZ_ERROR;
@@ -213,7 +268,7 @@ static Fiz_Code aux_assert(Fiz* F, int argc, char** argv, void* data)
         return fiz_argc_error(F, argv[0], 2);
     if (fiz_exec(F, argv[1]) != FIZ_OK) //< code returned an error
         return FIZ_ERROR;
-    if (atoi(fiz_get_return(F))) //< code returned a truthy value, assertion passed
+    if (fiz_get_return_int(F)) //< code returned a truthy value, assertion passed
         return FIZ_OK;
     fiz_set_return_ex(F, "Assertion failed: %s", argv[1]);
     return FIZ_ERROR;
@@ -246,7 +301,7 @@ static Fiz_Code aux_catch(Fiz* F, int argc, char** argv, void* data)
             fiz_set_var(F, messageVar, fiz_get_return(F));
         }
     }
-    fiz_set_return_ex(F, "%d", result);
+    fiz_set_return_int(F, result);
     return FIZ_OK;
 }
 
@@ -255,8 +310,6 @@ void fiz_add_aux(Fiz *F) {
     fiz_add_func(F, "expr", aux_expr, NULL);
     fiz_add_func(F, "eq", aux_eqne, NULL);
     fiz_add_func(F, "ne", aux_eqne, NULL);
-    fiz_add_func(F, "incr", aux_incr, NULL);
-    fiz_add_func(F, "decr", aux_incr, NULL);
     fiz_add_func(F, "dict", aux_dict, NULL);
 #ifndef FIZ_DISABLE_INCLUDE_FILES
     fiz_add_func(F, "include", aux_include, NULL);
@@ -287,38 +340,6 @@ char *fiz_get_last_statement(Fiz *F, const char* body) {
     return last_statement;
 }
 
-void fiz_set_return_normalized_double(Fiz* F, const double result)
-{
-    const int numsize = 30;
-    char numstr[30];
-    snprintf(numstr, numsize, "%.9f", result);
-
-    // trim trailing zeros and dot
-    char hasDot = 0;
-    for (int c = strlen(numstr) - 1; c > 0; c--) {
-        if (numstr[c] == '.') {
-            hasDot = 1;
-            break;
-        }
-    }
-    if (hasDot) {
-        for (int c = strlen(numstr) - 1; c > 0; c--)
-        {
-            if (numstr[c] == '0') {    //< trim trailing zeroes only after dot 
-                numstr[c] = '\0';
-            }
-            else if (numstr[c] == '.') { //< if dot found as last char remove it and stop trimming
-                numstr[c] = '\0';
-                break;
-            }
-            else { //< if non dot, non zero value found stop trimming
-                break;
-            }
-        }
-    }
-
-    fiz_set_return(F, numstr);
-}
 
 void fiz_abort(Fiz* F) {
     F->abort = 1;
@@ -1,18 +1,27 @@
 /*
- * A simple recursive descent expression evaluator.
+ * A simple recursive descent expression compiler and evaluator.
+ *
+ * Expressions are compiled to a list of operations in reverse Polish
+ * notation, which can be evaluated any number of times. References
+ * to variables, written as $name, are looked up every time the
+ * expression is evaluated, so a compiled expression can be reused
+ * while the values of its variables change.
  *
  * Compile the test program like so:
- * $ gcc -o expr -Wall -Werror -pedantic -O3 -DTEST expr.c
+ * $ gcc -o expr -Wall -Werror -pedantic -O3 -DTEST expr.c hash.c -lm
  *
  * This is free and unencumbered software released into the public domain.
  * http://unlicense.org/
  */
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include <setjmp.h>
 #include <assert.h>
 #include <stdint.h>
 
+#include "hash.h"
+
 /* 
  * For integer based math, define FIZ_INTEGER_EXPR symbol in the whole project or
  * use add MATH=int flag when running make. If not defined, double based math is used.
@@ -25,7 +34,7 @@
     typedef int number;
     inline static number operator_modulo(const number a, const number b) { return a % b; }
     inline static char operator_equals(const number a, const number b) { return a == b; }
-    inline static char operator_gt(const number a, const number b) { return a == b; }
+    inline static char operator_gt(const number a, const number b) { return a > b; }
 #else
     #include <math.h>
     typedef double number;
@@ -47,10 +56,50 @@
     }
 #endif
 
+/* Number of cached expressions if expr_cache_create() is given 0 */
+#ifdef FIZ_EXPR_CACHE_SIZE
+#define EXPR_CACHE_SIZE FIZ_EXPR_CACHE_SIZE
+#else
+#define EXPR_CACHE_SIZE 64
+#endif
+
+/* Operations and stack entries that are kept on the C stack
+ * before malloc() is needed */
+#define EXPR_LOCAL_OPS   32
+#define EXPR_LOCAL_NAMES 64
+#define EXPR_LOCAL_STACK 32
+
+typedef const char *(*expr_lookup)(const char *name, number *value, void *data);
+
+enum expr_opcode {
+    EX_NUM, EX_VAR, EX_NEG, EX_NOT,
+    EX_OR, EX_AND, EX_EQ, EX_NE, EX_GT, EX_LT, EX_GE, EX_LE,
+    EX_ADD, EX_SUB, EX_MUL, EX_DIV, EX_MOD
+};
+
+struct expr_op {
+    enum expr_opcode op;
+    number n;   /* The value of EX_NUM */
+    int name;   /* Offset of the name of EX_VAR */
+};
+
+/* A compiled expression. The names of the variables follow the ops */
+struct expr {
+    int nops, depth;
+    const char *names;
+    struct expr_op ops[];
+};
+
 struct expr_handler {
     const char *str, *prev;
     jmp_buf on_err;
     const char **err;
+
+    /* The compiled code, and the stack depth it needs */
+    struct expr_op *ops, lops[EXPR_LOCAL_OPS];
+    int nops, aops, sp, depth;
+    char *names, lnames[EXPR_LOCAL_NAMES];
+    int nnames, anames;
 };
 
 static void do_error(struct expr_handler *eh, const char *msg) {
@@ -79,15 +128,138 @@ static void reset(struct expr_handler *h) {
     h->prev = NULL;
 }
 
+static void init_handler(struct expr_handler *h, const char *str, const char **err) {
+    h->str = str;
+    h->prev = NULL;
+    h->err = err;
+    h->ops = h->lops;
+    h->nops = 0;
+    h->aops = EXPR_LOCAL_OPS;
+    h->sp = 0;
+    h->depth = 0;
+    h->names = h->lnames;
+    h->nnames = 0;
+    h->anames = EXPR_LOCAL_NAMES;
+}
+
+static void free_handler(struct expr_handler *h) {
+    if(h->ops != h->lops)
+        free(h->ops);
+    if(h->names != h->lnames)
+        free(h->names);
+}
+
+/* Grows a buffer that starts out in the handler's local storage */
+static void *grow(struct expr_handler *h, void *buf, void *local, int *a, size_t size) {
+    void *nbuf;
+    if(buf == local) {
+        nbuf = malloc(2 * *a * size);
+        if(nbuf)
+            memcpy(nbuf, buf, *a * size);
+    } else
+        nbuf = realloc(buf, 2 * *a * size);
+    if(!nbuf)
+        do_error(h, "out of memory");
+    *a *= 2;
+    return nbuf;
+}
+
+/* Appends an operation, keeping track of the stack depth it needs */
+static struct expr_op *emit(struct expr_handler *h, enum expr_opcode op) {
+    struct expr_op *o;
+    if(h->nops == h->aops)
+        h->ops = grow(h, h->ops, h->lops, &h->aops, sizeof *h->ops);
+    o = &h->ops[h->nops++];
+    o->op = op;
+    if(op == EX_NUM || op == EX_VAR) {
+        if(++h->sp > h->depth)
+            h->depth = h->sp;
+    } else if(op != EX_NEG && op != EX_NOT)
+        h->sp--;
+    return o;
+}
+
 /* Prototypes for the recursive descent parser's functions defined below */
-static number or(struct expr_handler *h);
-static number and(struct expr_handler *h);
-static number not(struct expr_handler *h);
-static number comp(struct expr_handler *h);
-static number term(struct expr_handler *h);
-static number factor(struct expr_handler *h);
-static number unary(struct expr_handler *h);
-static number atom(struct expr_handler *h);
+static void or(struct expr_handler *h);
+static void and(struct expr_handler *h);
+static void not(struct expr_handler *h);
+static void comp(struct expr_handler *h);
+static void term(struct expr_handler *h);
+static void factor(struct expr_handler *h);
+static void unary(struct expr_handler *h);
+static void atom(struct expr_handler *h);
+static number parse_number(struct expr_handler *h);
+
+/* Parses the expression in 'h', returning 0 on an error */
+static int parse(struct expr_handler *h) {
+    if(setjmp(h->on_err))
+        return 0;
+    or(h);
+    if(getnext(h) != '\0')
+        do_error(h, "end of expression expected");
+    return 1;
+}
+
+/* Evaluates compiled code */
+static number run(const struct expr_op *ops, int nops, int depth, const char *names,
+                  expr_lookup lookup, void *data, const char **err) {
+    number lstack[EXPR_LOCAL_STACK], *stack = lstack, a, b;
+    int i, sp = 0;
+    const char *msg = NULL;
+
+    if(depth > EXPR_LOCAL_STACK && !(stack = malloc(depth * sizeof *stack))) {
+        *err = "out of memory";
+        return 0;
+    }
+
+    for(i = 0; i < nops && !msg; i++) {
+        const struct expr_op *o = &ops[i];
+        switch(o->op) {
+        case EX_NUM: stack[sp++] = o->n; continue;
+        case EX_VAR:
+            if(!lookup)
+                msg = "unknown variable";
+            else
+                msg = lookup(names + o->name, &stack[sp++], data);
+            continue;
+        case EX_NEG: stack[sp - 1] = -stack[sp - 1]; continue;
+        case EX_NOT: stack[sp - 1] = !stack[sp - 1]; continue;
+        default: break;
+        }
+        b = stack[--sp];
+        a = stack[sp - 1];
+        switch(o->op) {
+        case EX_OR: a = a || b; break;
+        case EX_AND: a = a && b; break;
+        case EX_EQ: a = operator_equals(a, b); break;
+        case EX_NE: a = !operator_equals(a, b); break;
+        case EX_GT: a = operator_gt(a, b); break;
+        case EX_LT: a = operator_gt(b, a); break;
+        case EX_GE: a = !operator_gt(b, a); break;
+        case EX_LE: a = !operator_gt(a, b); break;
+        case EX_ADD: a += b; break;
+        case EX_SUB: a -= b; break;
+        case EX_MUL: a *= b; break;
+        case EX_DIV:
+        case EX_MOD:
+            if(b == 0)
+                msg = "divide by zero";
+            else if(o->op == EX_DIV)
+                a /= b;
+            else
+                a = operator_modulo(a, b);
+            break;
+        default: assert(0);
+        }
+        stack[sp - 1] = a;
+    }
+
+    a = msg ? 0 : stack[0];
+    *err = msg;
+    if(stack != lstack)
+        free(stack);
+    return a;
+}
 
 /* Entry point for the expression evaluator.
  * - 'str' contains the expression to be parsed.
@@ -95,143 +267,207 @@ static number atom(struct expr_handler *h);
  *   function returns, if the pointer pointed to by 'err' is NULL
  *   the expression was parsed successfully, otherwise *err will
  *   point to a string containing an error message.
+ * Expressions evaluated this way can't refer to variables.
  */
 number expr(const char *str, const char **err) {
-    number n;
+    number n = 0;
     const char *dummy;
     struct expr_handler eh;
-    if(err) {
-        *err = NULL;
-        eh.err = err;
-    } else
-        eh.err = &dummy;
-    eh.str = str;
-    eh.prev = NULL;
+    if(!err)
+        err = &dummy;
+    *err = NULL;
+    init_handler(&eh, str, err);
+    if(parse(&eh))
+        n = run(eh.ops, eh.nops, eh.depth, eh.names, NULL, NULL, err);
+    free_handler(&eh);
+    return n;
+}
+
+/* Compiles 'str' so that it can be evaluated with expr_eval().
+ * Returns NULL and sets *err on an error.
+ * The result should be deallocated with expr_free()
+ */
+struct expr *expr_compile(const char *str, const char **err) {
+    struct expr *e = NULL;
+    const char *dummy;
+    struct expr_handler eh;
+    if(!err)
+        err = &dummy;
+    *err = NULL;
+    init_handler(&eh, str, err);
+    if(parse(&eh)) {
+        e = malloc(sizeof *e + eh.nops * sizeof *e->ops + eh.nnames);
+        if(e) {
+            e->nops = eh.nops;
+            e->depth = eh.depth;
+            memcpy(e->ops, eh.ops, eh.nops * sizeof *e->ops);
+            e->names = (const char *)&e->ops[e->nops];
+            memcpy((char *)e->names, eh.names, eh.nnames);
+        } else
+            *err = "out of memory";
+    }
+    free_handler(&eh);
+    return e;
+}
+
+/* Evaluates a compiled expression.
+ * 'lookup' is called with 'data' to get the value of each variable
+ * the expression refers to. It returns NULL on success, or an error
+ * message which is passed on through 'err'.
+ */
+number expr_eval(struct expr *e, expr_lookup lookup, void *data, const char **err) {
+    const char *dummy;
+    if(!err)
+        err = &dummy;
+    return run(e->ops, e->nops, e->depth, e->names, lookup, data, err);
+}
+
+void expr_free(struct expr *e) {
+    free(e);
+}
 
+/* Converts the string of a variable's value to a number.
+ * Returns NULL on success, or an error message otherwise.
+ */
+const char *expr_to_number(const char *str, number *n) {
+    const char *err = NULL;
+    struct expr_handler eh;
+    char c;
+    init_handler(&eh, str, &err);
     if(setjmp(eh.on_err))
-        return 0;
-    n = or(&eh);
+        return err;
+    c = getnext(&eh);
+    if(c != '-' && c != '+')
+        reset(&eh);
+    *n = parse_number(&eh);
+    if(c == '-')
+        *n = -*n;
     if(getnext(&eh) != '\0')
-        do_error(&eh, "end of expression expected");
-    return n;
+        return "not a number";
+    return NULL;
 }
 
 /*
  * Recursive descent starts here.
+ * Note that both sides of || and && are always evaluated.
  */
-static number or(struct expr_handler *h) {
-    number n = and(h), r;
+static void or(struct expr_handler *h) {
+    and(h);
     while(getnext(h) == '|' && peeknext(h) == '|') {
         gobblenext(h);
-        /* Short-circuit caught me here:
-         * If you try to write this as n = n || and(h);
-         * and n is "true", then the and(h) won't get called,
-         * meaning the pointer h->str won't be moved along, causing
-         * problems down the road.
-         * I just hope a smart optimiser doesn't cause problems
-         * (so far I've checked GCC, and it doesn't), so test with
-         * something like "1||0" or "0&&1" to check for problems
-         */
-        r = and(h);
-        n = n || r;
+        and(h);
+        emit(h, EX_OR);
     }
     reset(h);
-    return n;
 }
 
-static number and(struct expr_handler *h) {
-    number n = not(h), r;
+static void and(struct expr_handler *h) {
+    not(h);
     while(getnext(h) == '&' && peeknext(h) == '&') {
         gobblenext(h);
-        /* potential short-circuit problem; see or() above */
-        r = not(h);
-        n = n && r;
+        not(h);
+        emit(h, EX_AND);
     }
     reset(h);
-    return n;
 }
 
-static number not(struct expr_handler *h) {
-    if(getnext(h) == '!')
-        return !comp(h);
+static void not(struct expr_handler *h) {
+    if(getnext(h) == '!') {
+        comp(h);
+        emit(h, EX_NOT);
+        return;
+    }
     reset(h);
-    return comp(h);
+    comp(h);
 }
 
-static number comp(struct expr_handler *h) {
-    number n = term(h);
-    char c = getnext(h);
+static void comp(struct expr_handler *h) {
+    char c;
+    term(h);
+    c = getnext(h);
     if(c == '=' || c == '>' || c == '<' || (c == '!' && peeknext(h) == '=')) {
         if(h->str[0] == '=') {
             gobblenext(h);
+            term(h);
             switch(c) {
-                case '=' : return operator_equals(n, term(h));
-                case '>' : return !operator_gt(term(h), n); //n >= term(h);
-                case '<' : return !operator_gt(n, term(h)); //n <= term(h);
-                case '!' : return !operator_equals(n, term(h));
+                case '=' : emit(h, EX_EQ); break;
+                case '>' : emit(h, EX_GE); break;
+                case '<' : emit(h, EX_LE); break;
+                case '!' : emit(h, EX_NE); break;
             }
         } else {
+            term(h);
             switch(c) {
-                case '=' : return operator_equals(n, term(h));
-                case '>' : return operator_gt(n, term(h)); // n > term(h);
-                case '<' : return operator_gt(term(h), n); //n < term(h);
+                case '=' : emit(h, EX_EQ); break;
+                case '>' : emit(h, EX_GT); break;
+                case '<' : emit(h, EX_LT); break;
             }
         }
     } else
         reset(h);
-    return n;
 }
 
-static number term(struct expr_handler *h) {
-    number n = factor(h), c;
+static void term(struct expr_handler *h) {
+    char c;
+    factor(h);
     while((c=getnext(h)) == '+' || c == '-') {
-        if(c == '+')
-            n += factor(h);
-        else
-            n -= factor(h);
+        factor(h);
+        emit(h, c == '+' ? EX_ADD : EX_SUB);
     }
     reset(h);
-    return n;
 }
 
-static number factor(struct expr_handler *h) {
-    number n = unary(h), c;
+static void factor(struct expr_handler *h) {
+    char c;
+    unary(h);
     while((c=getnext(h)) == '*' || c == '/' || c == '%') {
-        number x = unary(h);
-        if(c == '*')
-            n *= x;
-        else {
-            if(x == 0) do_error(h, "divide by zero");
-            if(c == '/')
-                n /= x;
-            else
-                n = operator_modulo(n, x);
-        }
+        unary(h);
+        emit(h, c == '*' ? EX_MUL : c == '/' ? EX_DIV : EX_MOD);
     }
     reset(h);
-    return n;
 }
 
-static number unary(struct expr_handler *h) {
-    number c = getnext(h);
+static void unary(struct expr_handler *h) {
+    char c = getnext(h);
     if(c == '-' || c == '+') {
+        atom(h);
         if(c == '-')
-            return -atom(h);
-        return atom(h);
+            emit(h, EX_NEG);
+        return;
     }
     reset(h);
-    return atom(h);
+    atom(h);
 }
 
-static number atom(struct expr_handler *h) {
+static void atom(struct expr_handler *h) {
     if(getnext(h) == '(') {
-        number n = or(h);
+        or(h);
         if(getnext(h) != ')')
             do_error(h, "missing ')'");
-        return n;
+        return;
     }
     reset(h);
     while(isspace((int)h->str[0])) h->str++;
+    if(h->str[0] == '$') {
+        const char *name = ++h->str;
+        int len;
+        while(isalnum((int)h->str[0]) || h->str[0] == '_')
+            h->str++;
+        len = h->str - name;
+        if(!len)
+            do_error(h, "variable name expected");
+        while(h->nnames + len + 1 > h->anames)
+            h->names = grow(h, h->names, h->lnames, &h->anames, 1);
+        memcpy(h->names + h->nnames, name, len);
+        h->names[h->nnames + len] = '\0';
+        emit(h, EX_VAR)->name = h->nnames;
+        h->nnames += len + 1;
+        return;
+    }
+    emit(h, EX_NUM)->n = parse_number(h);
+}
+
+static number parse_number(struct expr_handler *h) {
     if(!isdigit((int)h->str[0]))
         do_error(h, "number expected");
     uint64_t n = 0;
@@ -261,6 +497,125 @@ static number atom(struct expr_handler *h) {
     return (number)n;
 }
 
+/**********************************************************************
+ * Cache of compiled expressions
+ **********************************************************************/
+
+/*
+ * The cache keeps the most recently used expressions, up to a maximum.
+ * Entries are found through a hash table on their text, and kept in a
+ * list from most to least recently used, so that the last one in the
+ * list is evicted when the cache is full.
+ */
+struct expr_entry {
+    struct expr_entry *prev, *next;
+    struct expr *e;
+    char text[];
+};
+
+struct expr_cache {
+    struct hash_tbl *tbl;
+    struct expr_entry *first, *last;
+    int count, size;
+};
+
+struct expr_cache *expr_cache_create(int size) {
+    struct expr_cache *c = malloc(sizeof *c);
+    if(!c)
+        return NULL;
+    if(size <= 0)
+        size = EXPR_CACHE_SIZE;
+    c->tbl = ht_create(16);
+    if(!c->tbl) {
+        free(c);
+        return NULL;
+    }
+    c->first = c->last = NULL;
+    c->count = 0;
+    c->size = size;
+    return c;
+}
+
+static void unlink_entry(struct expr_cache *c, struct expr_entry *n) {
+    if(n->prev)
+        n->prev->next = n->next;
+    else
+        c->first = n->next;
+    if(n->next)
+        n->next->prev = n->prev;
+    else
+        c->last = n->prev;
+}
+
+static void push_entry(struct expr_cache *c, struct expr_entry *n) {
+    n->prev = NULL;
+    n->next = c->first;
+    if(c->first)
+        c->first->prev = n;
+    else
+        c->last = n;
+    c->first = n;
+}
+
+/* Returns the compiled form of 'str', compiling it if it isn't cached.
+ * The compiled expression belongs to the cache and remains valid until
+ * the next call to expr_cache_get().
+ * Returns NULL and sets *err if 'str' could not be compiled.
+ */
+struct expr *expr_cache_get(struct expr_cache *c, const char *str, const char **err) {
+    struct expr_entry *n = ht_find(c->tbl, str);
+    struct expr *e;
+    size_t len;
+
+    if(n) {
+        if(n != c->first) {
+            unlink_entry(c, n);
+            push_entry(c, n);
+        }
+        *err = NULL;
+        return n->e;
+    }
+
+    if(!(e = expr_compile(str, err)))
+        return NULL;
+
+    if(c->count == c->size) {
+        n = c->last;
+        unlink_entry(c, n);
+        ht_delete(c->tbl, n->text);
+        expr_free(n->e);
+        free(n);
+        c->count--;
+    }
+
+    len = strlen(str);
+    n = malloc(sizeof *n + len + 1);
+    if(!n || !ht_insert(c->tbl, str, n)) {
+        free(n);
+        expr_free(e);
+        *err = "out of memory";
+        return NULL;
+    }
+    memcpy(n->text, str, len + 1);
+    n->e = e;
+    push_entry(c, n);
+    c->count++;
+    return e;
+}
+
+void expr_cache_free(struct expr_cache *c) {
+    struct expr_entry *n, *next;
+    if(!c)
+        return;
+    for(n = c->first; n; n = next) {
+        next = n->next;
+        expr_free(n->e);
+        free(n);
+    }
+    ht_free(c->tbl, NULL);
+    free(c);
+}
+
 /**********************************************************************
  * Test program
  **********************************************************************/
@@ -273,7 +628,7 @@ int main(int argc, char *argv[]) {
     for(i = 1; i < argc; i++) {
         r = expr(argv[i], &err);
         if(!err)
-            printf("%s = %d\n", argv[i], r);
+            printf("%s = %g\n", argv[i], (double)r);
         else
             fprintf(stderr, "error: %s: %s\n", argv[i], err);
     }
@@ -9,9 +9,11 @@
 #include <ctype.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <limits.h>
 
 #include "fiz.h"
 #include "hash.h"
+#include "skiplist.h"
 
 /* Size of the internal buffer used for the *_ex() functions */
 #define EX_BUFFER_SIZE 128
@@ -22,6 +24,20 @@
 /* Initial number of arguments (but it gets resized as needed) */
 #define INITIAL_NUM_ARGS 5
 
+/* Marks the places where values are substituted in the text of a
+ * speculatively compiled [command substitution]; see speculate() */
+#define HOLE_CHAR '\001'
+
+/* How deeply procs can call each other, and commands implemented in C
+ * can run scripts, unless fiz_set_max_depth() changes it */
+#ifdef FIZ_MAX_DEPTH
+#define MAX_DEPTH FIZ_MAX_DEPTH
+#else
+#define MAX_DEPTH 10000
+#endif
+
+struct fiz_bytecode;
+
 /*
  * Internal structure to store C-functions and procs
  */
@@ -29,38 +45,442 @@ struct proc {
     enum {FIZ_PROC, FIZ_CFUN} type;
     union {
         struct {fiz_func fun; void *data;} cfun;
-        struct {char *params; char *body;} proc;
+        struct {
+            char **params;
+            int nparams;
+            char *body;
+            /* Compiled body; created when the proc is defined */
+            struct fiz_bytecode *code;
+        } proc;
     } fun;
 };
 
+/*
+ * Dicts are hash tables, unless they were made ordered, in which case
+ * the keys are kept sorted in a skip list instead. One of 'hash' and
+ * 'list' is NULL.
+ */
+struct dict {
+    struct hash_tbl *hash;
+    struct skiplist *list;
+};
+
+/* Initial size of the hash table for variables that aren't in slots */
+#define VARS_HASH_SIZE 16
+
 /*
  * Manages the "stack" (and variable scope) when calling procedures.
+ * The local variables of a proc are kept in 'slots', which the compiler
+ * assigns to the names in 'code->locals' when the proc is defined.
+ * Variables with other names (and all the variables in the global
+ * callframe) are kept in 'vars', which is only created when needed.
  */
 struct fiz_callframe {
     struct fiz_callframe *parent;
     struct hash_tbl *vars;
+    struct fiz_bytecode *code;
+    /* Number of callframes under this one */
+    int depth;
+    int nslots;
+    struct fiz_value *slots[];
+};
+
+/*======================================================================
+ * Values
+======================================================================*/
+
+/*
+ * Variables, dict entries and the return value are stored as values
+ * that hold a string along with the number it represents. The number
+ * is computed from the string the first time it is needed, and the
+ * string of a value created from a number is only formatted when
+ * someone asks for it, so arithmetic in a loop doesn't have to
+ * convert between text and numbers all the time.
+ *
+ * Values are reference counted and never change once they're created,
+ * so the same value can be stored in any number of variables and
+ * passed around without copying its string. Only the cached forms get
+ * filled in later. The exception is a list or string that is only
+ * referenced by the variable that holds it: Commands like lappend and
+ * append change it in place, so that a list or string can be built up
+ * without being copied every time.
+ */
+enum {
+    VAL_INT = 1,        /* 'i' is valid */
+    VAL_DOUBLE = 2,     /* 'd' is valid */
+    VAL_PLAIN_KNOWN = 4, /* VAL_PLAIN is valid; see is_plain() */
+    VAL_PLAIN = 8,
+    VAL_LIST = 16,      /* 'list' is valid */
+    VAL_BUFFER = 32     /* 'str' is a buffer of 'cap' bytes that holds 'len' characters */
 };
 
+/* The elements of a list, in an array that grows by doubling */
+struct fiz_list {
+    int len, cap;
+    struct fiz_value **items;
+};
+
+struct fiz_value {
+    int refs;
+    char *str; /* NULL until it is needed, if the value was created from a number or list */
+    int flags;
+    int i;
+    double d;
+    struct fiz_list *list;
+    size_t len, cap;
+    char num[24]; /* Holds the string of a number if it fits */
+};
+
+static char *list_format(const struct fiz_list *l);
+static void list_free(struct fiz_list *l);
+
 /**
  * Special object whose address is used to mark a variable as a global.
  */
-static char global_var_marker = '\0';
+static struct fiz_value global_var_marker;
+
+/* The string of a value created from a string is stored right after it */
+static struct fiz_value *val_alloc(size_t len) {
+    struct fiz_value *v = malloc(sizeof *v + len + 1);
+    v->refs = 1;
+    v->str = (char *)(v + 1);
+    v->str[len] = '\0';
+    v->flags = 0;
+    return v;
+}
+
+static struct fiz_value *val_new(const char *s) {
+    size_t len = strlen(s);
+    struct fiz_value *v = val_alloc(len);
+    memcpy(v->str, s, len);
+    return v;
+}
+
+static struct fiz_value *val_new_int(int i) {
+    struct fiz_value *v = malloc(sizeof *v);
+    v->refs = 1;
+    v->str = NULL;
+    v->flags = VAL_INT;
+    v->i = i;
+    return v;
+}
+
+static struct fiz_value *val_new_double(double d) {
+    struct fiz_value *v = malloc(sizeof *v);
+    v->refs = 1;
+    v->str = NULL;
+    v->flags = VAL_DOUBLE;
+    v->d = d;
+    /* Whole numbers format without a fraction, so atoi() of the
+     * string would give the same integer */
+    if(d >= INT_MIN && d <= INT_MAX && d == (int)d) {
+        v->flags |= VAL_INT;
+        v->i = (int)d;
+    }
+    return v;
+}
+
+static struct fiz_value *val_ref(struct fiz_value *v) {
+    v->refs++;
+    return v;
+}
+
+static struct fiz_value *val_new_list(struct fiz_list *l) {
+    struct fiz_value *v = malloc(sizeof *v);
+    v->refs = 1;
+    v->str = NULL;
+    v->flags = VAL_LIST;
+    v->list = l;
+    return v;
+}
+
+static void val_release(struct fiz_value *v) {
+    if(--v->refs > 0)
+        return;
+    if(v->str != (char *)(v + 1) && v->str != v->num)
+        free(v->str);
+    if(v->flags & VAL_LIST)
+        list_free(v->list);
+    free(v);
+}
+
+/* Formats a double, removing trailing zeroes after the decimal point */
+static void format_double(char *numstr, size_t numsize, double d) {
+    int c;
+    snprintf(numstr, numsize, "%.9f", d);
+    if(!strchr(numstr + 1, '.'))
+        return;
+    for(c = strlen(numstr) - 1; c > 0; c--) {
+        if(numstr[c] == '0') {
+            numstr[c] = '\0';
+        } else {
+            if(numstr[c] == '.')
+                numstr[c] = '\0';
+            break;
+        }
+    }
+}
+
+static const char *val_str(struct fiz_value *v) {
+    if(!v->str && (v->flags & VAL_LIST)) {
+        v->str = list_format(v->list);
+    } else if(!v->str) {
+        char buffer[EX_BUFFER_SIZE];
+        if(v->flags & VAL_DOUBLE)
+            format_double(buffer, sizeof buffer, v->d);
+        else
+            snprintf(buffer, sizeof buffer, "%d", v->i);
+        v->str = (strlen(buffer) < sizeof v->num) ? strcpy(v->num, buffer) : strdup(buffer);
+    }
+    return v->str;
+}
+
+/* The value as an integer, the same as atoi() of its string */
+static int val_int(struct fiz_value *v) {
+    if(!(v->flags & VAL_INT)) {
+        v->i = atoi(val_str(v));
+        v->flags |= VAL_INT;
+    }
+    return v->i;
+}
+
+/*
+ * Appends 'len' characters from 's' to the string of 'v'. The string is
+ * changed in place if nothing else refers to 'v', otherwise the result
+ * is a new value and 'v' is left alone. Strings that are appended to are
+ * kept in a buffer that doubles in size when it fills up, so a string
+ * that is built up from many pieces is only copied a few times.
+ */
+static struct fiz_value *val_append(struct fiz_value *v, const char *s, size_t len) {
+    int in_place = v->refs == 1 && (v->flags & VAL_BUFFER);
+    struct fiz_value *n = v;
+    const char *str;
+    size_t cap, n_len;
+    char *buf;
+    if(in_place && v->len + len < v->cap) {
+        memcpy(v->str + v->len, s, len);
+    } else {
+        /* Copying to a new buffer, since 's' may point into the old one */
+        str = val_str(v);
+        n_len = in_place ? v->len : strlen(str);
+        for(cap = 32; cap <= n_len + len; cap *= 2);
+        buf = malloc(cap);
+        memcpy(buf, str, n_len);
+        memcpy(buf + n_len, s, len);
+        if(in_place) {
+            free(v->str);
+        } else {
+            n = malloc(sizeof *n);
+            n->refs = 1;
+            n->flags = 0;
+        }
+        n->str = buf;
+        n->len = n_len;
+        n->cap = cap;
+    }
+    n->len += len;
+    n->str[n->len] = '\0';
+    /* The cached forms of the old string no longer apply */
+    if(n->flags & VAL_LIST)
+        list_free(n->list);
+    n->flags = VAL_BUFFER;
+    return n;
+}
+
+/*======================================================================
+ * Temporary memory
+======================================================================*/
+
+/*
+ * Memory that is only needed while a command executes is taken from an
+ * arena: Allocations are taken from the end of a block and the arena is
+ * reset to where it was when the command returns, so that the blocks
+ * can be reused without calling malloc() and free() all the time.
+ *
+ * If FIZ_DISABLE_ARENA is defined, every allocation gets its own block
+ * and blocks are freed when they're released, which is useful for
+ * finding memory errors with tools like valgrind.
+ */
+
+/* Size of the blocks allocated for the arena */
+#define ARENA_BLOCK_SIZE 4096
+
+/* Alignment of temporary allocations */
+#define ARENA_ALIGN sizeof(double)
+
+struct fiz_arena_block {
+    struct fiz_arena_block *next;
+    size_t size, used;
+};
+
+struct fiz_arena {
+    struct fiz_arena_block *top;   /* Block being allocated from; 'next' points to the ones before it */
+    struct fiz_arena_block *spare; /* Blocks that can be reused */
+    unsigned long allocs, mallocs;
+};
+
+/* Where the arena was, so that it can be reset to it */
+struct arena_mark {
+    struct fiz_arena_block *block;
+    size_t used;
+};
+
+static struct arena_mark arena_mark(struct fiz_arena *A) {
+    struct arena_mark m;
+    m.block = A->top;
+    m.used = A->top ? A->top->used : 0;
+    return m;
+}
+
+static void *arena_alloc(struct fiz_arena *A, size_t size) {
+    struct fiz_arena_block *b = A->top;
+    void *p;
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    A->allocs++;
+    if(!b || b->used + size > b->size) {
+#ifndef FIZ_DISABLE_ARENA
+        if(A->spare && A->spare->size >= size) {
+            b = A->spare;
+            A->spare = b->next;
+        } else
+#endif
+        {
+            size_t bsize = size;
+#ifndef FIZ_DISABLE_ARENA
+            if(bsize < ARENA_BLOCK_SIZE)
+                bsize = ARENA_BLOCK_SIZE;
+#endif
+            b = malloc(sizeof *b + bsize);
+            if(!b)
+                return NULL;
+            b->size = bsize;
+            A->mallocs++;
+        }
+        b->used = 0;
+        b->next = A->top;
+        A->top = b;
+    }
+    p = (char *)(b + 1) + b->used;
+    b->used += size;
+    return p;
+}
+
+static void arena_release(struct fiz_arena *A, struct arena_mark m) {
+    while(A->top != m.block) {
+        struct fiz_arena_block *b = A->top;
+        A->top = b->next;
+#ifdef FIZ_DISABLE_ARENA
+        free(b);
+#else
+        b->next = A->spare;
+        A->spare = b;
+#endif
+    }
+    if(A->top)
+        A->top->used = m.used;
+}
+
+static void arena_free(struct fiz_arena *A) {
+    arena_release(A, (struct arena_mark){NULL, 0});
+    while(A->spare) {
+        struct fiz_arena_block *b = A->spare;
+        A->spare = b->next;
+        free(b);
+    }
+    free(A);
+}
+
+/*======================================================================
+ * Compiled scripts
+======================================================================*/
+
+/*
+ * Scripts are compiled into a list of commands. Each command is a list
+ * of words and each word is a list of parts: literal text, $variables
+ * and [command substitutions]. A script is compiled once and the
+ * compiled form can then be executed any number of times without
+ * looking at the text again.
+ */
+enum part_type {
+    PART_LIT,  /* Literal text */
+    PART_VAR,  /* $variable reference */
+    PART_CMD,  /* [command substitution] */
+    PART_HOLE, /* Value in a speculatively compiled substitution */
+    PART_ERR   /* Syntax error, reported when execution reaches it */
+};
+
+struct fiz_part {
+    enum part_type type;
+    char *text; /* The text for PART_LIT, name for PART_VAR, message for PART_ERR */
+    int hole;
+    struct fiz_subst *subst;
+    const char *src; /* Where the text of a {braced} word is in the source */
+};
+
+struct fiz_word {
+    struct fiz_part *parts;
+    int nparts, aparts;
+};
+
+struct fiz_cmd {
+    struct fiz_word *words;
+    int nwords, awords;
+    /* Where the command appears in the source, for fiz_get_last_statement() */
+    const char *begin, *end;
+};
+
+struct fiz_script {
+    struct fiz_cmd *cmds;
+    int ncmds, acmds;
+    char *text; /* Source text, if the script owns it */
+};
+
+/*
+ * The text between the [brackets] of a command substitution is first
+ * substituted and the result is then executed as a script.
+ * 'tmpl' holds the parts of the text between the brackets.
+ * 'spec' is that text compiled ahead of time, with PART_HOLEs in the place
+ * of the 'nvals' values that are not literal. It can be used instead of
+ * compiling the substituted text as long as none of the values contain
+ * characters that would change the way the text is parsed.
+ */
+struct fiz_subst {
+    struct fiz_word tmpl;
+    struct fiz_script *spec;
+    int nvals;
+};
 
 /*======================================================================
  * Data structure for the parser used internally.
 ======================================================================*/
 
+/*
+ * State shared by all the parsers that compile a piece of text.
+ * When compiling the text of a command substitution speculatively, 'spec'
+ * is set, 'holes' counts the HOLE_CHARs and 'fail' is set if the holes
+ * appear in places where the speculatively compiled script may not have
+ * the same meaning as the substituted text.
+ */
+struct compile_ctx {
+    int spec, holes, fail;
+};
+
 /*
  * On a high level, the parser works by reading a character from
- * 'FooParser.txt'. If it is a '"', '$' quote or a '[', substitution
- * is performed and the result added to 'FooParser.word', otherwise the
- * character is added to 'FooParser.word' directly.
- * 'FooParser.word' is dynamically resized as the need arises.
+ * 'FizParser.txt'. If it is a '"', '$' quote or a '[', the parts
+ * for the substitution are added to 'FizParser.w', otherwise the
+ * character is added to the literal text in 'FizParser.word'.
+ * 'FizParser.word' is dynamically resized as the need arises.
+ *
+ * The word buffer is also used on its own to build strings while
+ * executing.
  */
 typedef struct fiz_parser {
     const char *txt;
     char *word;
     size_t w_size, a_size;
+    struct fiz_word *w;
+    struct compile_ctx *ctx;
 } FizParser;
 
 enum FI_CODE {
@@ -70,21 +490,55 @@ enum FI_CODE {
     FI_ERR    /* Internal error */
 };
 
-static int init_parser(FizParser *FI, const char *txt) {
+static int init_parser(FizParser *FI, const char *txt, struct fiz_word *w, struct compile_ctx *ctx) {
     FI->a_size = INITIAL_WORD_SIZE;
     FI->word = malloc(FI->a_size);
     FI->w_size = 0;
     FI->txt = txt;
-    return (FI->word) ? 1 : 0;
+    FI->w = w;
+    FI->ctx = ctx;
+    if(!FI->word)
+        return 0;
+    FI->word[0] = '\0';
+    return 1;
 }
 
 static void destroy_parser(FizParser *FI) {
     free(FI->word);
 }
 
+static struct fiz_part *new_part(struct fiz_word *w, enum part_type type) {
+    struct fiz_part *p;
+    if(w->nparts == w->aparts) {
+        w->aparts = w->aparts ? w->aparts << 1 : 2;
+        w->parts = realloc(w->parts, w->aparts * sizeof *w->parts);
+    }
+    p = &w->parts[w->nparts++];
+    p->type = type;
+    p->text = NULL;
+    p->hole = 0;
+    p->subst = NULL;
+    p->src = NULL;
+    return p;
+}
+
+/* Moves the literal text read so far into a part of the word */
+static void flush_lit(FizParser *FI) {
+    if(!FI->w_size)
+        return;
+    new_part(FI->w, PART_LIT)->text = strdup(FI->word);
+    FI->w_size = 0;
+    FI->word[0] = '\0';
+}
+
 /* Adds a single character to the word being parsed */
 static void add_char(FizParser *FI, char c) {
-    if(FI->w_size + 1 == FI->a_size - 1) {
+    if(c == HOLE_CHAR && FI->ctx && FI->ctx->spec) {
+        flush_lit(FI);
+        new_part(FI->w, PART_HOLE)->hole = FI->ctx->holes++;
+        return;
+    }
+    if(FI->w_size + 1 >= FI->a_size - 1) {
         FI->a_size <<= 1;
         FI->word = realloc(FI->word, FI->a_size);
     }
@@ -104,9 +558,8 @@ static void add_word(FizParser *FI, const char *w)
         FI->word = realloc(FI->word, FI->a_size);
     }
 
-    strcat(FI->word, w);
+    memcpy(FI->word + FI->w_size, w, wlen + 1);
     FI->w_size += wlen;
-    FI->word[FI->w_size] = '\0';
     assert(strlen(FI->word) < FI->a_size);
     assert(strlen(FI->word) == FI->w_size);
 }
@@ -121,61 +574,348 @@ static char get_escape(char c) {
     }
 }
 
+/*====================================================================
+ * Lists
+ *====================================================================*/
+
+/*
+ * A list value keeps its elements in an array, and only makes its string
+ * when someone asks for it. In the string the elements are separated by
+ * spaces. Elements that are empty or contain special characters are put
+ * in braces, or have the special characters escaped with backslashes if
+ * braces won't do, so that the string can be split into the same elements
+ * again, either by list_parse() or as the words of a command.
+ */
+
+static struct fiz_list *list_new(int cap) {
+    struct fiz_list *l = malloc(sizeof *l);
+    l->len = 0;
+    l->cap = cap;
+    l->items = cap ? malloc(cap * sizeof *l->items) : NULL;
+    return l;
+}
+
+static void list_free(struct fiz_list *l) {
+    int i;
+    for(i = 0; i < l->len; i++)
+        val_release(l->items[i]);
+    free(l->items);
+    free(l);
+}
+
+/* Appends 'v' to the list, which takes over the reference */
+static void list_append(struct fiz_list *l, struct fiz_value *v) {
+    if(l->len == l->cap) {
+        l->cap = l->cap ? l->cap << 1 : 8;
+        l->items = realloc(l->items, l->cap * sizeof *l->items);
+    }
+    l->items[l->len++] = v;
+}
+
+/* Characters that can't appear in an element as they are */
+#define LIST_SPECIAL " \t\n\r\f\v{}[]\"$;\\"
+
+/* How an element has to be written: 0 as it is, 1 in braces or 2 with backslashes */
+static int list_quoting(const char *s) {
+    int level = 0;
+    const char *p;
+    if(!*s)
+        return 1;
+    if(!s[strcspn(s, LIST_SPECIAL)] && *s != '#')
+        return 0;
+    for(p = s; *p; p++) {
+        if(*p == '{')
+            level++;
+        else if(*p == '}' && --level < 0)
+            return 2;
+        else if(*p == '[' || *p == ']' || *p == '"' || *p == '\\')
+            return 2;
+    }
+    return level ? 2 : 1;
+}
+
+/* Writes an element to 'out', if it isn't NULL, and returns its length */
+static size_t list_quote(const char *s, char *out) {
+    size_t len = 0;
+    const char *p;
+    switch(list_quoting(s)) {
+    case 0:
+        len = strlen(s);
+        if(out)
+            memcpy(out, s, len);
+        return len;
+    case 1:
+        len = strlen(s);
+        if(out) {
+            out[0] = '{';
+            memcpy(out + 1, s, len);
+            out[len + 1] = '}';
+        }
+        return len + 2;
+    }
+    for(p = s; *p; p++) {
+        char c = *p;
+        if(strchr(LIST_SPECIAL, c) || (p == s && c == '#')) {
+            if(out)
+                out[len] = '\\';
+            len++;
+            c = (c == '\n') ? 'n' : (c == '\r') ? 'r' : (c == '\t') ? 't' : c;
+        }
+        if(out)
+            out[len] = c;
+        len++;
+    }
+    return len;
+}
+
+static char *list_format(const struct fiz_list *l) {
+    size_t len = 0;
+    char *s, *p;
+    int i;
+    for(i = 0; i < l->len; i++)
+        len += list_quote(val_str(l->items[i]), NULL) + 1;
+    p = s = malloc(len + 1);
+    for(i = 0; i < l->len; i++) {
+        if(i > 0)
+            *p++ = ' ';
+        p += list_quote(l->items[i]->str, p);
+    }
+    *p = '\0';
+    return s;
+}
+
+/* Splits a string into a list. Returns NULL if the braces or quotes don't match */
+static struct fiz_list *list_parse(const char *s) {
+    struct fiz_list *l = list_new(0);
+    char *buf = malloc(strlen(s) + 1);
+    for(;;) {
+        const char *start;
+        size_t len = 0;
+        int level;
+        while(isspace((int)*s))
+            s++;
+        if(!*s)
+            break;
+        if(*s == '{') {
+            start = ++s;
+            for(level = 1; *s; s++) {
+                if(*s == '\\' && s[1])
+                    s++;
+                else if(*s == '{')
+                    level++;
+                else if(*s == '}' && --level == 0)
+                    break;
+            }
+            if(level)
+                goto error;
+            len = s - start;
+            memcpy(buf, start, len);
+            s++;
+        } else if(*s == '"') {
+            for(s++; *s != '"'; s++) {
+                if(!*s)
+                    goto error;
+                if(*s == '\\' && s[1])
+                    buf[len++] = get_escape(*++s);
+                else
+                    buf[len++] = *s;
+            }
+            s++;
+        } else {
+            for(; *s && !isspace((int)*s); s++) {
+                if(*s == '\\' && s[1])
+                    buf[len++] = get_escape(*++s);
+                else
+                    buf[len++] = *s;
+            }
+        }
+        if(*s && !isspace((int)*s))
+            goto error;
+        buf[len] = '\0';
+        list_append(l, val_new(buf));
+    }
+    free(buf);
+    return l;
+error:
+    free(buf);
+    list_free(l);
+    return NULL;
+}
+
+/* The elements of a value, or NULL if its string isn't a valid list */
+static struct fiz_list *val_list(struct fiz_value *v) {
+    if(!(v->flags & VAL_LIST)) {
+        if(!(v->list = list_parse(val_str(v))))
+            return NULL;
+        v->flags |= VAL_LIST;
+    }
+    return v->list;
+}
+
+/* Forgets the string and numbers of a list value that was changed in place */
+static void val_list_changed(struct fiz_value *v) {
+    if(v->str != (char *)(v + 1) && v->str != v->num)
+        free(v->str);
+    v->str = NULL;
+    v->flags = VAL_LIST;
+}
+
+/* Parses a list index: a number, "end" or "end-N". Returns 0 if it's not an index */
+static int list_index(const char *s, int len, int *index) {
+    char *end;
+    long n;
+    if(!strncmp(s, "end", 3)) {
+        if(!s[3]) {
+            *index = len - 1;
+            return 1;
+        }
+        if(s[3] != '-')
+            return 0;
+        n = strtol(s + 4, &end, 10);
+        if(end == s + 4 || *end)
+            return 0;
+        *index = len - 1 - (int)n;
+        return 1;
+    }
+    n = strtol(s, &end, 10);
+    if(end == s || *end)
+        return 0;
+    *index = (int)n;
+    return 1;
+}
+
 /*====================================================================
  * The parser
  *====================================================================*/
 
+static void free_script(struct fiz_script *S);
+static struct fiz_script *compile_text(const char *txt, struct compile_ctx *ctx);
+
+/* Syntax errors are compiled into the word, so that they're
+ * reported only when (and if) execution reaches them */
+static enum FI_CODE compile_error(FizParser *FI, const char *fmt, char term) {
+    char buffer[EX_BUFFER_SIZE];
+    snprintf(buffer, sizeof buffer, fmt, term);
+    flush_lit(FI);
+    new_part(FI->w, PART_ERR)->text = strdup(buffer);
+    return FI_ERR;
+}
+
+static void free_word(struct fiz_word *w) {
+    int i;
+    for(i = 0; i < w->nparts; i++) {
+        struct fiz_part *p = &w->parts[i];
+        free(p->text);
+        if(p->subst) {
+            free_word(&p->subst->tmpl);
+            if(p->subst->spec)
+                free_script(p->subst->spec);
+            free(p->subst);
+        }
+    }
+    free(w->parts);
+}
+
+/*
+ * Compiles the text of a command substitution ahead of time.
+ * This is only possible if the substituted values can't change the
+ * way the text is parsed, so the values are replaced by HOLE_CHARs
+ * that the parser compiles into PART_HOLEs. See is_plain() below.
+ */
+static void speculate(struct fiz_subst *s) {
+    FizParser FI;
+    struct compile_ctx ctx = {1, 0, 0};
+    int i;
+    init_parser(&FI, NULL, NULL, NULL);
+    for(i = 0; i < s->tmpl.nparts; i++) {
+        const struct fiz_part *p = &s->tmpl.parts[i];
+        if(p->type == PART_LIT) {
+            if(strchr(p->text, HOLE_CHAR))
+                ctx.fail = 1;
+            add_word(&FI, p->text);
+        } else {
+            add_char(&FI, HOLE_CHAR);
+            s->nvals++;
+        }
+    }
+    if(ctx.fail) {
+        destroy_parser(&FI);
+        return;
+    }
+    s->spec = compile_text(FI.word, &ctx);
+    s->spec->text = FI.word;
+    if(ctx.fail || ctx.holes != s->nvals) {
+        free_script(s->spec);
+        s->spec = NULL;
+    }
+}
+
+static enum FI_CODE compile_quote(FizParser *FI, char term);
+
+/*
+ * Used to parse [a b c] command substitutions.
+ * FI->txt points just past the '['.
+ */
+static enum FI_CODE compile_subst(FizParser *FI) {
+    enum FI_CODE fic;
+    FizParser FIi;
+    struct fiz_subst *s = calloc(1, sizeof *s);
+    init_parser(&FIi, FI->txt, &s->tmpl, FI->ctx);
+    fic = compile_quote(&FIi, ']');
+    flush_lit(&FIi);
+    FI->txt = FIi.txt;
+    destroy_parser(&FIi);
+    if(fic == FI_WORD)
+        speculate(s);
+    flush_lit(FI);
+    new_part(FI->w, PART_CMD)->subst = s;
+    return fic;
+}
+
+/*
+ * Used to parse $variable references.
+ * FI->txt points just past the '$'.
+ */
+static enum FI_CODE compile_var(FizParser *FI) {
+    const char *p = FI->txt;
+    while(isalnum((int)*FI->txt)) FI->txt++;
+    if(*FI->txt == HOLE_CHAR && FI->ctx)
+        FI->ctx->fail = 1;
+    if(FI->txt == p)
+        return compile_error(FI, "Identifier expected after $", 0);
+    flush_lit(FI);
+    new_part(FI->w, PART_VAR)->text = strndup(p, FI->txt - p);
+    return FI_WORD;
+}
+
 /*
  * Used to parse [a b c] and "Hello, $x" words.
  * 'term' specifies the terminating character ']' or '"'
  */
-static enum FI_CODE parse_quote(Fiz *F, FizParser *FI, char term) {
+static enum FI_CODE compile_quote(FizParser *FI, char term) {
     while(FI->txt[0] != term) {
         char c = FI->txt[0];
-        if(!c) {
-            fiz_set_return_ex(F, "Missing \'%c\'", term);
-            return FI_ERR;
-        }
+        if(!c)
+            return compile_error(FI, "Missing \'%c\'", term);
 
         if(c == '[') {
             enum FI_CODE fic;
-            FizParser FIi;
-            init_parser(&FIi, ++FI->txt);
-            fic = parse_quote(F, &FIi, ']');
-            if(fic == FI_WORD) {
-                /* Evaluate the [expression]*/
-                if(fiz_exec(F, FIi.word) != FIZ_OK)
-                    fic = FI_ERR;
-                add_word(FI, fiz_get_return(F));
-            }
-            FI->txt = FIi.txt;
-            destroy_parser(&FIi);
+            FI->txt++;
+            fic = compile_subst(FI);
             if(fic != FI_WORD) return fic;
             continue;
         } else if(c == '$') {
             /* Variable substitution, like $foo */
-            const char *p, *val;
-            char *name;
-            p = ++FI->txt;
-            while(isalnum((int)*FI->txt)) FI->txt++;
-            if(FI->txt == p) {
-                fiz_set_return(F, "Identifier expected after $");
-                return FI_ERR;
-            }
-            name = malloc(FI->txt - p + 1);
-            strncpy(name, p, FI->txt-p);
-            name[FI->txt-p] = '\0';
-            val = fiz_get_var(F, name);
-            if(!val) {
-                fiz_set_return_ex(F, "Unknown variable '%s'", name);
-                free(name);
+            FI->txt++;
+            if(compile_var(FI) != FI_WORD)
                 return FI_ERR;
-            }
-            free(name);
-            add_word(FI, val);
             continue; /* Skip the add_char() below */
         } else if(c == '\\') {
             FI->txt++;
+            if(FI->txt[0] == HOLE_CHAR && FI->ctx)
+                FI->ctx->fail = 1;
+            if(!FI->txt[0])
+                continue;
             c = get_escape(FI->txt[0]);
         }
 
@@ -183,24 +923,26 @@ static enum FI_CODE parse_quote(Fiz *F, FizParser *FI, char term) {
         FI->txt++;
     }
     assert(FI->txt[0] == term);
-    FI->txt++;
+    if(term)
+        FI->txt++;
     return FI_WORD;
 }
 
 /* This handles complex cases like quotes within braces, eg: {["foo"]}
  */
-static enum FI_CODE gobble_quote(Fiz *F, FizParser *FI, char term) {
+static enum FI_CODE gobble_quote(FizParser *FI, char term) {
     add_char(FI, *(FI->txt++));
     while(FI->txt[0] != term) {
         char c = FI->txt[0];
         if(!c) {
-            fiz_set_return_ex(F, "Missing \'%c\'", term, FI->word);
-            return FI_ERR;
+            return compile_error(FI, "Missing \'%c\'", term);
         } else if(c == '\\') {
             add_char(FI, c);
             c = *(++FI->txt);
+            if(!c)
+                continue;
         } else if(c == '[' || c == '"') {
-            enum FI_CODE fic = gobble_quote(F, FI, (c == '[')?']':'"');
+            enum FI_CODE fic = gobble_quote(FI, (c == '[')?']':'"');
             if(fic != FI_WORD)
                 return fic;
             continue;
@@ -215,23 +957,21 @@ static enum FI_CODE gobble_quote(Fiz *F, FizParser *FI, char term) {
 /*
  * Parses words in braces, like {puts "hello"}
  */
-static enum FI_CODE parse_brace(Fiz *F, FizParser *FI) {
+static enum FI_CODE compile_brace(FizParser *FI) {
     int level = 1;
     for(;;) {
         char c = FI->txt[0];
 
         if(c == '[' || c == '"') {
-            enum FI_CODE fic = gobble_quote(F, FI, (c == '[')?']':'"');
+            enum FI_CODE fic = gobble_quote(FI, (c == '[')?']':'"');
             if(fic != FI_WORD)
                 return fic;
             continue;
         }
 
         switch(c) {
-        case '\0': {
-                fiz_set_return(F, "Missing \'}\'");
-                return FI_ERR;
-            }
+        case '\0':
+            return compile_error(FI, "Missing \'}\'", 0);
         case '{': level++; break;
         case '}':{
                 if(--level == 0)
@@ -243,6 +983,8 @@ static enum FI_CODE parse_brace(Fiz *F, FizParser *FI) {
         case '\\':
             add_char(FI, c);
             c = *(++FI->txt);
+            if(!c)
+                continue;
             break;
         }
         add_char(FI, c);
@@ -252,18 +994,11 @@ static enum FI_CODE parse_brace(Fiz *F, FizParser *FI) {
 
 /*
  * Entry point for the parser: It chooses the type of word
- * read depending on the next character read and returns that
- * word in the FooParser structure, skipping any whitespace and
+ * read depending on the next character read and compiles that
+ * word into FI->w, skipping any whitespace and
  * comments in the process.
  */
-static enum FI_CODE get_word(Fiz *F, FizParser *FI) {
-    if(F->abort)
-        return FI_EOI;
-
-    /* Reset the interpreter's word tracker */
-    FI->word[0] = '\0';
-    FI->w_size = 0;
-
+static enum FI_CODE compile_word(FizParser *FI) {
 restart:
     /* Remove whitespace */
     while(isspace((int)FI->txt[0])) {
@@ -283,60 +1018,42 @@ restart:
     } else if(FI->txt[0] == '#') { /* Comment */
         while(FI->txt[0] != '\n') {
             if(!FI->txt[0]) return FI_EOS;
+            if(FI->txt[0] == HOLE_CHAR && FI->ctx)
+                FI->ctx->holes++;
             FI->txt++;
         }
         assert(FI->txt[0] == '\n');
-        /*FI->txt++;*/
         goto restart;
     }
 
     if(FI->txt[0] == '\"') {
         FI->txt++;
-        return parse_quote(F, FI, '\"');
+        return compile_quote(FI, '\"');
     } else if(FI->txt[0] == '[') {
-        enum FI_CODE fic;
-        FizParser FIi;
-        init_parser(&FIi, ++FI->txt);
-        fic = parse_quote(F, &FIi, ']');
-        if(fic == FI_WORD) {
-            /* Evaluate the [expression]*/
-            if(fiz_exec(F, FIi.word) != FIZ_OK)
-                fic = FI_ERR;
-            add_word(FI, fiz_get_return(F));
-        }
-        FI->txt = FIi.txt;
-        destroy_parser(&FIi);
-        return fic;
-    } else if(FI->txt[0] == '{') {
         FI->txt++;
-        return parse_brace(F, FI);
+        return compile_subst(FI);
+    } else if(FI->txt[0] == '{') {
+        const char *src = ++FI->txt;
+        enum FI_CODE fic = compile_brace(FI);
+        flush_lit(FI);
+        if(FI->w->nparts == 1)
+            FI->w->parts[0].src = src;
+        return fic;
     } else { /* Must be a printable character */
         do {
             char c = FI->txt[0];
             if(c == '$') {
                 /* Variable substitution, like $foo */
-                const char *p, *val;
-                char *name;
-                p = ++FI->txt;
-                while(isalnum((int)*FI->txt)) FI->txt++;
-                if(FI->txt == p) {
-                    fiz_set_return(F, "Identifier expected after $");
-                    return FI_ERR;
-                }
-                name = malloc(FI->txt - p + 1);
-                strncpy(name, p, FI->txt-p);
-                name[FI->txt-p] = '\0';
-                val = fiz_get_var(F, name);
-                if(!val) {
-                    fiz_set_return_ex(F, "Unknown variable '%s'", name);
-                    free(name);
+                FI->txt++;
+                if(compile_var(FI) != FI_WORD)
                     return FI_ERR;
-                }
-                free(name);
-                add_word(FI, val);
                 continue; /* Skip the add_char() below */
             } else if(c == '\\') {
                 FI->txt++;
+                if(FI->txt[0] == HOLE_CHAR && FI->ctx)
+                    FI->ctx->fail = 1;
+                if(!FI->txt[0])
+                    break;
                 c = get_escape(FI->txt[0]);
             } else if(c == ';' || c == '[') /* Handle cases like bar; or b[d e]*/
                 break;
@@ -349,46 +1066,1119 @@ restart:
     return FI_ERR; /* keeps some compilers happy */
 }
 
-/*====================================================================
- * The interpreter
- *====================================================================*/
+/*
+ * Compiles a script. The returned script refers to 'txt' for
+ * error reporting, so it must remain valid while the script is used.
+ */
+static struct fiz_script *compile_text(const char *txt, struct compile_ctx *ctx) {
+    struct fiz_script *S = calloc(1, sizeof *S);
+    FizParser FI;
+    struct fiz_word w;
 
-static void add_callframe(Fiz *F)  {
-    struct fiz_callframe *cf = malloc(sizeof *cf);
-    cf->vars = ht_create(0);
-    cf->parent = F->callframe;
-    F->callframe = cf;
-}
+    init_parser(&FI, txt, &w, ctx);
+    for(;;) { /* For all the statements in the input */
+        enum FI_CODE fic;
+        struct fiz_cmd *cmd;
+        const char *begin = FI.txt;
 
-static void free_var(const char *key, void *val) {
-    if(val == &global_var_marker) return;
-	free(val);
-}
+        memset(&w, 0, sizeof w);
+        fic = compile_word(&FI); /* get the command */
+        if(fic == FI_EOI) break;
+        if(fic == FI_EOS) continue;
 
-static void delete_callframe(Fiz *F) {
-    struct fiz_callframe *cf = F->callframe;
-    assert(F->callframe);
-    F->callframe = cf->parent;
-    ht_free(cf->vars, free_var);
+        if(S->ncmds == S->acmds) {
+            S->acmds = S->acmds ? S->acmds << 1 : 4;
+            S->cmds = realloc(S->cmds, S->acmds * sizeof *S->cmds);
+        }
+        cmd = &S->cmds[S->ncmds++];
+        memset(cmd, 0, sizeof *cmd);
+        cmd->begin = begin;
+
+        /* Get the parameters */
+        for(;;) {
+            flush_lit(&FI);
+            if(cmd->nwords == cmd->awords) {
+                cmd->awords += INITIAL_NUM_ARGS;
+                cmd->words = realloc(cmd->words, cmd->awords * sizeof *cmd->words);
+            }
+            cmd->words[cmd->nwords++] = w;
+            if(fic != FI_WORD) break;
+            memset(&w, 0, sizeof w);
+            fic = compile_word(&FI);
+            if(fic == FI_EOS || fic == FI_EOI) break;
+        }
+
+        cmd->end = FI.txt;
+        if(fic == FI_ERR) break;
+    }
+    destroy_parser(&FI);
+    return S;
+}
+
+static struct fiz_script *compile(const char *txt) {
+    struct compile_ctx ctx = {0, 0, 0};
+    return compile_text(txt, &ctx);
+}
+
+static void free_script(struct fiz_script *S) {
+    int i, j;
+    for(i = 0; i < S->ncmds; i++) {
+        for(j = 0; j < S->cmds[i].nwords; j++)
+            free_word(&S->cmds[i].words[j]);
+        free(S->cmds[i].words);
+    }
+    free(S->cmds);
+    free(S->text);
+    free(S);
+}
+
+/*====================================================================
+ * The bytecode compiler
+ *====================================================================*/
+
+/*
+ * Compiled scripts are turned into bytecode for a simple stack machine
+ * whose stack holds strings. A command pushes its words onto the stack
+ * and then OP_INVOKE calls it with those words as its arguments.
+ *
+ * 'while', 'if', 'for', 'foreach' and 'switch' with literal {bodies} are
+ * compiled inline into jumps, and some of the simpler built-in commands are executed directly by
+ * OP_BIF. Any command can be redefined, though, so OP_GUARD and OP_BIF
+ * check that the command is still the built-in one and otherwise fall
+ * back to an ordinary call.
+ */
+enum opcode {
+    OP_PUSH,       /* lit: Push literal 'lit' */
+    OP_LOAD,       /* lit: Push the value of the variable named 'lit' */
+    OP_LOAD_LOCAL, /* slot: Push the value of the local variable in 'slot' */
+    OP_PICK,       /* n: Push the value at position 'n' in the stack */
+    OP_CONCAT,     /* n: Replace the top 'n' values with their concatenation */
+    OP_DROP,       /* n: Pop 'n' values */
+    OP_RESULT,     /* Push the return value */
+    OP_STMT,       /* stmt: Start of statement 'stmt' */
+    OP_INVOKE,     /* argc stmt h site: Call the command in the top 'argc' values */
+    OP_BIF,        /* bif argc stmt h site slot: OP_INVOKE that executes built-in 'bif' directly;
+                    * 'slot' is the local variable named by the first argument, or -1 */
+    OP_GUARD,      /* bif lit target site: Jump to 'target' if command 'lit' isn't built-in 'bif' */
+    OP_JUMP,       /* target: Jump to 'target' */
+    OP_JUMP_FALSE, /* target: Jump to 'target' if the return value is false */
+    OP_FOR,        /* pos lit slot target: Jump to 'target' if the counter at 'pos' in the stack
+                    * is past the limit after it, otherwise set variable 'lit' to the counter */
+    OP_EACH,       /* pos lit slot target: Jump to 'target' if the index after the list at 'pos'
+                    * is past its end, otherwise set variable 'lit' to the element */
+    OP_NEXT,       /* pos target: Add one to the counter at 'pos' and jump to 'target' */
+    OP_SWITCH,     /* sw: Pop a value and jump to the arm of switch 'sw' that it matches */
+    OP_PLAIN,      /* n target: Jump to 'target' unless the top 'n' values are plain */
+    OP_TEMPLATE,   /* n parts...: Execute the text made from literals and values on the stack */
+    OP_EVAL,       /* Pop a value and execute it as a script */
+    OP_ERROR       /* lit: Fail with error message 'lit' */
+};
+
+/* Number of operands of each opcode; OP_TEMPLATE has 'n' more */
+static const int op_size[] = {1, 1, 1, 1, 1, 1, 0, 1, 4, 6, 4, 1, 1, 4, 4, 2, 1, 2, 1, 0, 1};
+
+/*
+ * Handlers determine what happens when a command returns something other
+ * than FIZ_OK: HANDLER_LOOP handles FIZ_BREAK and FIZ_CONTINUE in an inlined
+ * loop, and HANDLER_STRICT turns anything into an error, as in the
+ * conditions of 'if' and 'while' and in [command substitutions].
+ * Anything that isn't handled causes the code to return.
+ */
+enum handler_type {HANDLER_LOOP, HANDLER_STRICT};
+
+/*
+ * Call sites remember the command that their literal command name
+ * referred to, so that it doesn't have to be looked up every time.
+ * The interpreter's 'commands_epoch' changes whenever a command is
+ * added or replaced, which invalidates all the remembered commands.
+ * 'site' operands are -1 if the command name isn't literal.
+ */
+struct fiz_callsite {
+    Fiz *F;
+    unsigned int epoch;
+    struct proc *p;
+};
+
+struct fiz_handler {
+    enum handler_type type;
+    int parent;
+    int brk, cont; /* Where to jump on FIZ_BREAK and FIZ_CONTINUE */
+    int depth;     /* Stack depth in the loop */
+};
+
+struct fiz_stmt {
+    const char *begin, *end;
+};
+
+enum switch_mode {SWITCH_EXACT, SWITCH_GLOB, SWITCH_PREFIX};
+
+/*
+ * The arms of a switch with a literal list of patterns and bodies, so
+ * that OP_SWITCH doesn't have to compare the value with every pattern.
+ * 'exact' maps the patterns that only match one string to their entry
+ * in 'targets'. Glob patterns with wildcards are listed in 'wild', and
+ * only have to be tried if they come before the arm found in 'exact'.
+ * In prefix mode, 'lens' are the different lengths of the patterns, so
+ * that the prefixes of the value can be looked up in 'exact'.
+ */
+struct fiz_switch {
+    enum switch_mode mode;
+    struct hash_tbl *exact;
+    char **patterns;
+    int *targets; /* Where the code of each arm starts */
+    int narms;
+    int *wild, nwild;
+    int *lens, nlens;
+    int dflt;     /* The default arm, or -1 */
+    int end;      /* Where the code continues if no arm matches */
+};
+
+struct fiz_bytecode {
+    int *ops;
+    int nops, aops;
+    struct fiz_value **lits;
+    int nlits, alits;
+    struct fiz_stmt *stmts;
+    int nstmts, astmts;
+    struct fiz_handler *handlers;
+    int nhandlers, ahandlers;
+    struct fiz_callsite *sites;
+    int nsites, asites;
+    struct fiz_switch *switches;
+    int nswitches, aswitches;
+    /* Names of the local variables of a proc; see struct fiz_callframe */
+    char **locals;
+    int nlocals, alocals;
+    int has_locals;
+    int max_stack;
+    int refs;
+    char *text; /* The source, if the code keeps its own copy */
+};
+
+static Fiz_Code bif_set(Fiz *F, int argc, char **argv, void *data);
+static Fiz_Code bif_incr(Fiz *F, int argc, char **argv, void *data);
+static Fiz_Code incr_var(Fiz *F, const char *name, int slot, int by);
+static Fiz_Code bif_return(Fiz *F, int argc, char **argv, void *data);
+static Fiz_Code bif_cntrl(Fiz *F, int argc, char **argv, void *data);
+static Fiz_Code bif_while(Fiz *F, int argc, char **argv, void *data);
+static Fiz_Code bif_for(Fiz *F, int argc, char **argv, void *data);
+static int for_bound_value(Fiz *F, struct fiz_value **v);
+static Fiz_Code bif_switch(Fiz *F, int argc, char **argv, void *data);
+static Fiz_Code bif_if(Fiz *F, int argc, char **argv, void *data);
+static Fiz_Code bif_values(Fiz *F, int argc, char **argv, void *data);
+
+/*
+ * Built-in commands that work on the values of their arguments rather than
+ * their strings. 'slot' is the slot of the variable named by the first
+ * argument, or -1.
+ */
+typedef Fiz_Code (*fiz_vfunc)(Fiz *F, int argc, struct fiz_value **argv, int slot);
+static Fiz_Code vbif_list(Fiz *F, int argc, struct fiz_value **argv, int slot);
+static Fiz_Code vbif_lappend(Fiz *F, int argc, struct fiz_value **argv, int slot);
+static Fiz_Code vbif_lindex(Fiz *F, int argc, struct fiz_value **argv, int slot);
+static Fiz_Code vbif_llength(Fiz *F, int argc, struct fiz_value **argv, int slot);
+static Fiz_Code vbif_lrange(Fiz *F, int argc, struct fiz_value **argv, int slot);
+static Fiz_Code vbif_lset(Fiz *F, int argc, struct fiz_value **argv, int slot);
+static Fiz_Code vbif_foreach(Fiz *F, int argc, struct fiz_value **argv, int slot);
+static Fiz_Code vbif_append(Fiz *F, int argc, struct fiz_value **argv, int slot);
+
+/* The built-in commands known to the compiler */
+enum bif_id {BIF_SET, BIF_INCR, BIF_DECR, BIF_RETURN, BIF_BREAK, BIF_CONTINUE, BIF_WHILE, BIF_IF,
+    BIF_FOR, BIF_SWITCH, BIF_LIST, BIF_LAPPEND, BIF_LINDEX, BIF_LLENGTH, BIF_LRANGE, BIF_LSET, BIF_FOREACH,
+    BIF_APPEND};
+
+/*
+ * 'fun' is the C-function that is added to the interpreter for the
+ * command. Commands with a 'vfun' are added as bif_values(), which
+ * calls 'vfun' with values made from the strings it is given, but
+ * the VM calls 'vfun' with the values of the arguments directly.
+ */
+static const struct bif {
+    const char *name;
+    fiz_func fun;
+    fiz_vfunc vfun;
+} bifs[] = {
+    {"set", bif_set, NULL},
+    {"incr", bif_incr, NULL},
+    {"decr", bif_incr, NULL},
+    {"return", bif_return, NULL},
+    {"break", bif_cntrl, NULL},
+    {"continue", bif_cntrl, NULL},
+    {"while", bif_while, NULL},
+    {"if", bif_if, NULL},
+    {"for", bif_for, NULL},
+    {"switch", bif_switch, NULL},
+    {"list", bif_values, vbif_list},
+    {"lappend", bif_values, vbif_lappend},
+    {"lindex", bif_values, vbif_lindex},
+    {"llength", bif_values, vbif_llength},
+    {"lrange", bif_values, vbif_lrange},
+    {"lset", bif_values, vbif_lset},
+    {"foreach", bif_values, vbif_foreach},
+    {"append", bif_values, vbif_append},
+    {NULL, NULL, NULL}
+};
+
+/* Returns the text of a word that doesn't need substitution, or NULL */
+static char *literal_word(const struct fiz_word *w) {
+    if(w->nparts == 0)
+        return "";
+    if(w->nparts == 1 && w->parts[0].type == PART_LIT)
+        return w->parts[0].text;
+    return NULL;
+}
+
+struct codegen {
+    struct fiz_bytecode *C;
+    int depth;     /* Number of values on the stack */
+    int handler;   /* Current handler, or -1 */
+    int hole_base; /* Stack position of the first hole in speculative code */
+    /* Maps positions in the text being compiled to the source, if known */
+    const char *text, *src;
+    /* The command being compiled, for code without a known source */
+    const char *begin, *end;
+};
+
+static int emit(struct codegen *G, int x) {
+    struct fiz_bytecode *C = G->C;
+    if(C->nops == C->aops) {
+        C->aops = C->aops ? C->aops << 1 : 32;
+        C->ops = realloc(C->ops, C->aops * sizeof *C->ops);
+    }
+    C->ops[C->nops] = x;
+    return C->nops++;
+}
+
+static int add_lit(struct codegen *G, const char *s) {
+    struct fiz_bytecode *C = G->C;
+    if(C->nlits == C->alits) {
+        C->alits = C->alits ? C->alits << 1 : 8;
+        C->lits = realloc(C->lits, C->alits * sizeof *C->lits);
+    }
+    C->lits[C->nlits] = val_new(s);
+    return C->nlits++;
+}
+
+static int add_stmt(struct codegen *G, const char *begin, const char *end) {
+    struct fiz_bytecode *C = G->C;
+    if(C->nstmts == C->astmts) {
+        C->astmts = C->astmts ? C->astmts << 1 : 8;
+        C->stmts = realloc(C->stmts, C->astmts * sizeof *C->stmts);
+    }
+    C->stmts[C->nstmts].begin = begin;
+    C->stmts[C->nstmts].end = end;
+    return C->nstmts++;
+}
+
+static int add_site(struct codegen *G) {
+    struct fiz_bytecode *C = G->C;
+    if(C->nsites == C->asites) {
+        C->asites = C->asites ? C->asites << 1 : 8;
+        C->sites = realloc(C->sites, C->asites * sizeof *C->sites);
+    }
+    memset(&C->sites[C->nsites], 0, sizeof *C->sites);
+    return C->nsites++;
+}
+
+static int add_handler(struct codegen *G, enum handler_type type) {
+    struct fiz_bytecode *C = G->C;
+    struct fiz_handler *H;
+    if(C->nhandlers == C->ahandlers) {
+        C->ahandlers = C->ahandlers ? C->ahandlers << 1 : 4;
+        C->handlers = realloc(C->handlers, C->ahandlers * sizeof *C->handlers);
+    }
+    H = &C->handlers[C->nhandlers];
+    H->type = type;
+    H->parent = G->handler;
+    H->brk = H->cont = 0;
+    H->depth = G->depth;
+    return C->nhandlers++;
+}
+
+/* Returns the slot of local variable 'name', or -1 if
+ * the code being compiled isn't the body of a proc */
+static int gen_local(struct codegen *G, const char *name) {
+    struct fiz_bytecode *C = G->C;
+    int i;
+    if(!C->has_locals)
+        return -1;
+    /* The last parameter wins if a proc has two with the same name */
+    for(i = C->nlocals - 1; i >= 0; i--)
+        if(!strcmp(C->locals[i], name))
+            return i;
+    if(C->nlocals == C->alocals) {
+        C->alocals = C->alocals ? C->alocals << 1 : 8;
+        C->locals = realloc(C->locals, C->alocals * sizeof *C->locals);
+    }
+    C->locals[C->nlocals] = strdup(name);
+    return C->nlocals++;
+}
+
+static void push(struct codegen *G, int n) {
+    G->depth += n;
+    if(G->depth > G->C->max_stack)
+        G->C->max_stack = G->depth;
+}
+
+static const char *gen_source(const struct codegen *G, const char *p) {
+    if(!p || !G->src)
+        return NULL;
+    return G->src + (p - G->text);
+}
+
+static void gen_script(struct codegen *G, const struct fiz_script *S);
+static void gen_subst(struct codegen *G, const struct fiz_subst *s);
+
+static void gen_part(struct codegen *G, const struct fiz_part *p) {
+    switch(p->type) {
+    case PART_LIT:
+        emit(G, OP_PUSH);
+        emit(G, add_lit(G, p->text));
+        push(G, 1);
+        break;
+    case PART_VAR: {
+            int slot = gen_local(G, p->text);
+            if(slot >= 0) {
+                emit(G, OP_LOAD_LOCAL);
+                emit(G, slot);
+            } else {
+                emit(G, OP_LOAD);
+                emit(G, add_lit(G, p->text));
+            }
+            push(G, 1);
+        } break;
+    case PART_HOLE:
+        emit(G, OP_PICK);
+        emit(G, G->hole_base + p->hole);
+        push(G, 1);
+        break;
+    case PART_CMD:
+        gen_subst(G, p->subst);
+        break;
+    case PART_ERR:
+        emit(G, OP_ERROR);
+        emit(G, add_lit(G, p->text));
+        push(G, 1);
+        break;
+    }
+}
+
+/* Leaves the value of the word on the stack */
+static void gen_word(struct codegen *G, const struct fiz_word *w) {
+    int i;
+    if(w->nparts == 0) {
+        emit(G, OP_PUSH);
+        emit(G, add_lit(G, ""));
+        push(G, 1);
+        return;
+    }
+    for(i = 0; i < w->nparts; i++)
+        gen_part(G, &w->parts[i]);
+    if(w->nparts > 1) {
+        emit(G, OP_CONCAT);
+        emit(G, w->nparts);
+        G->depth -= w->nparts - 1;
+    }
+}
+
+/* Leaves the result of the [command substitution] on the stack */
+static void gen_subst(struct codegen *G, const struct fiz_subst *s) {
+    int i, base = G->depth, handler = G->handler, hole_base = G->hole_base;
+    int plain, join;
+    const char *text = G->text, *src = G->src;
+
+    if(!s->spec) {
+        gen_word(G, &s->tmpl);
+        emit(G, OP_EVAL);
+        emit(G, OP_RESULT);
+        return;
+    }
+
+    for(i = 0; i < s->tmpl.nparts; i++)
+        if(s->tmpl.parts[i].type != PART_LIT)
+            gen_part(G, &s->tmpl.parts[i]);
+    assert(G->depth == base + s->nvals);
+
+    emit(G, OP_PLAIN);
+    emit(G, s->nvals);
+    plain = emit(G, 0);
+
+    G->handler = add_handler(G, HANDLER_STRICT);
+    G->hole_base = base;
+    G->text = s->spec->text;
+    G->src = NULL;
+    gen_script(G, s->spec);
+    G->handler = handler;
+    G->hole_base = hole_base;
+    G->text = text;
+    G->src = src;
+    emit(G, OP_JUMP);
+    join = emit(G, 0);
+
+    /* If a value isn't plain, substitute the text and parse it */
+    G->C->ops[plain] = G->C->nops;
+    emit(G, OP_TEMPLATE);
+    emit(G, s->tmpl.nparts);
+    for(i = 0; i < s->tmpl.nparts; i++)
+        emit(G, s->tmpl.parts[i].type == PART_LIT ? add_lit(G, s->tmpl.parts[i].text) : -1);
+
+    G->C->ops[join] = G->C->nops;
+    emit(G, OP_DROP);
+    emit(G, s->nvals);
+    emit(G, OP_RESULT);
+    G->depth = base;
+    push(G, 1);
+}
+
+/* Compiles 'text' inline; 'src' is where it is in the source, if known */
+static void gen_text(struct codegen *G, const char *text, const char *src, int handler) {
+    const char *save_text = G->text, *save_src = G->src;
+    int save_handler = G->handler;
+    struct fiz_script *S;
+
+    S = compile(text);
+    G->text = text;
+    G->src = src;
+    G->handler = handler;
+    gen_script(G, S);
+    G->text = save_text;
+    G->src = save_src;
+    G->handler = save_handler;
+    free_script(S);
+}
+
+/* Compiles a literal {body} inline */
+static void gen_body(struct codegen *G, const struct fiz_word *w, int handler) {
+    const char *src = NULL;
+    if(w->nparts == 1)
+        src = gen_source(G, w->parts[0].src);
+    gen_text(G, literal_word(w), src, handler);
+}
+
+/*
+ * Code for when an inlined command turns out to have been redefined.
+ * 'picks' has the stack positions of the words that were evaluated
+ * before the check, and -1 for the literal words. It can be NULL if
+ * all the words are literal.
+ */
+static void gen_fallback(struct codegen *G, const struct fiz_cmd *cmd, int stmt, const int *picks) {
+    int i;
+    for(i = 0; i < cmd->nwords; i++) {
+        if(picks && picks[i] >= 0) {
+            emit(G, OP_PICK);
+            emit(G, picks[i]);
+        } else {
+            emit(G, OP_PUSH);
+            emit(G, add_lit(G, literal_word(&cmd->words[i])));
+        }
+        push(G, 1);
+    }
+    emit(G, OP_INVOKE);
+    emit(G, cmd->nwords);
+    emit(G, stmt);
+    emit(G, G->handler);
+    emit(G, add_site(G));
+    G->depth -= cmd->nwords;
+}
+
+static void gen_while(struct codegen *G, const struct fiz_cmd *cmd, int stmt) {
+    int guard, loop, top, jump, past;
+
+    emit(G, OP_GUARD);
+    emit(G, BIF_WHILE);
+    emit(G, add_lit(G, "while"));
+    guard = emit(G, 0);
+    emit(G, add_site(G));
+
+    loop = add_handler(G, HANDLER_LOOP);
+    top = G->C->nops;
+    gen_body(G, &cmd->words[1], add_handler(G, HANDLER_STRICT));
+    emit(G, OP_JUMP_FALSE);
+    jump = emit(G, 0);
+    gen_body(G, &cmd->words[2], loop);
+    emit(G, OP_JUMP);
+    emit(G, top);
+    G->C->ops[jump] = G->C->nops;
+    G->C->handlers[loop].brk = G->C->nops;
+    G->C->handlers[loop].cont = top;
+    emit(G, OP_JUMP);
+    past = emit(G, 0);
+
+    G->C->ops[guard] = G->C->nops;
+    gen_fallback(G, cmd, stmt, NULL);
+    G->C->ops[past] = G->C->nops;
+}
+
+static void gen_if(struct codegen *G, const struct fiz_cmd *cmd, int stmt) {
+    int guard, jump, end = -1, past;
+
+    emit(G, OP_GUARD);
+    emit(G, BIF_IF);
+    emit(G, add_lit(G, "if"));
+    guard = emit(G, 0);
+    emit(G, add_site(G));
+
+    gen_body(G, &cmd->words[1], add_handler(G, HANDLER_STRICT));
+    emit(G, OP_JUMP_FALSE);
+    jump = emit(G, 0);
+    gen_body(G, &cmd->words[2], G->handler);
+    if(cmd->nwords == 5) {
+        emit(G, OP_JUMP);
+        end = emit(G, 0);
+    }
+    G->C->ops[jump] = G->C->nops;
+    if(cmd->nwords == 5) {
+        gen_body(G, &cmd->words[4], G->handler);
+        G->C->ops[end] = G->C->nops;
+    }
+    emit(G, OP_JUMP);
+    past = emit(G, 0);
+
+    G->C->ops[guard] = G->C->nops;
+    gen_fallback(G, cmd, stmt, NULL);
+    G->C->ops[past] = G->C->nops;
+}
+
+/* for {init} {cond} {step} {body} */
+static void gen_for(struct codegen *G, const struct fiz_cmd *cmd, int stmt) {
+    int guard, loop, top, jump, past;
+
+    emit(G, OP_GUARD);
+    emit(G, BIF_FOR);
+    emit(G, add_lit(G, "for"));
+    guard = emit(G, 0);
+    emit(G, add_site(G));
+
+    gen_body(G, &cmd->words[1], G->handler);
+    loop = add_handler(G, HANDLER_LOOP);
+    top = G->C->nops;
+    gen_body(G, &cmd->words[2], add_handler(G, HANDLER_STRICT));
+    emit(G, OP_JUMP_FALSE);
+    jump = emit(G, 0);
+    gen_body(G, &cmd->words[4], loop);
+    G->C->handlers[loop].cont = G->C->nops;
+    gen_body(G, &cmd->words[3], G->handler);
+    emit(G, OP_JUMP);
+    emit(G, top);
+    G->C->ops[jump] = G->C->nops;
+    G->C->handlers[loop].brk = G->C->nops;
+    emit(G, OP_JUMP);
+    past = emit(G, 0);
+
+    G->C->ops[guard] = G->C->nops;
+    gen_fallback(G, cmd, stmt, NULL);
+    G->C->ops[past] = G->C->nops;
+}
+
+/*
+ * for var from A to B {body} and foreach var list {body}
+ * Two values stay on the stack while the loop runs: The counter and
+ * its limit, or the list and the index of the next element. The counter
+ * is an integer value, so it never has to be parsed, and the variable
+ * only gets a string if the body asks for one.
+ */
+static void gen_counted(struct codegen *G, const struct fiz_cmd *cmd, int stmt, int bif) {
+    const char *var = literal_word(&cmd->words[1]);
+    int picks[7] = {-1, -1, -1, -1, -1, -1, -1};
+    int pos = G->depth, guard, loop, top, jump, past;
+
+    if(bif == BIF_FOR) {
+        gen_word(G, &cmd->words[3]);
+        gen_word(G, &cmd->words[5]);
+        picks[3] = pos;
+        picks[5] = pos + 1;
+    } else {
+        gen_word(G, &cmd->words[2]);
+        emit(G, OP_PUSH);
+        emit(G, add_lit(G, "0"));
+        push(G, 1);
+        picks[2] = pos;
+    }
+
+    emit(G, OP_GUARD);
+    emit(G, bif);
+    emit(G, add_lit(G, bifs[bif].name));
+    guard = emit(G, 0);
+    emit(G, add_site(G));
+
+    loop = add_handler(G, HANDLER_LOOP);
+    top = emit(G, bif == BIF_FOR ? OP_FOR : OP_EACH);
+    emit(G, pos);
+    emit(G, add_lit(G, var));
+    emit(G, gen_local(G, var));
+    jump = emit(G, 0);
+    gen_body(G, &cmd->words[cmd->nwords - 1], loop);
+    G->C->handlers[loop].cont = emit(G, OP_NEXT);
+    emit(G, bif == BIF_FOR ? pos : pos + 1);
+    emit(G, top);
+    G->C->ops[jump] = G->C->nops;
+    G->C->handlers[loop].brk = G->C->nops;
+    emit(G, OP_JUMP);
+    past = emit(G, 0);
+
+    G->C->ops[guard] = G->C->nops;
+    gen_fallback(G, cmd, stmt, picks);
+    G->C->ops[past] = G->C->nops;
+    emit(G, OP_DROP);
+    emit(G, 2);
+    G->depth -= 2;
+}
+
+/* Matches one character 'c' against the start of glob pattern 'p'.
+ * Returns the rest of the pattern, or NULL if it doesn't match */
+static const char *glob_char(const char *p, char c) {
+    int match = 0;
+    switch(*p) {
+    case '\0':
+        return NULL;
+    case '?':
+        return p + 1;
+    case '[':
+        for(p++; *p && *p != ']'; p++) {
+            if(p[1] == '-' && p[2] && p[2] != ']') {
+                if((unsigned char)c >= (unsigned char)p[0] && (unsigned char)c <= (unsigned char)p[2])
+                    match = 1;
+                p += 2;
+            } else if(*p == c)
+                match = 1;
+        }
+        return (match && *p) ? p + 1 : NULL;
+    case '\\':
+        if(p[1])
+            p++;
+        /* fall through */
+    default:
+        return (*p == c) ? p + 1 : NULL;
+    }
+}
+
+/* Matches 's' against a glob pattern with *, ?, [chars] and \escapes */
+static int glob_match(const char *p, const char *s) {
+    const char *star_p = NULL, *star_s = NULL, *q;
+    while(*s) {
+        if(*p == '*') {
+            star_p = ++p;
+            star_s = s;
+        } else if((q = glob_char(p, *s)) != NULL) {
+            p = q;
+            s++;
+        } else if(star_p) {
+            /* Let the last * take one more character */
+            p = star_p;
+            s = ++star_s;
+        } else
+            return 0;
+    }
+    while(*p == '*')
+        p++;
+    return !*p;
+}
+
+static int switch_match(enum switch_mode mode, const char *pattern, const char *s) {
+    switch(mode) {
+    case SWITCH_GLOB:
+        return glob_match(pattern, s);
+    case SWITCH_PREFIX:
+        return !strncmp(s, pattern, strlen(pattern));
+    default:
+        return !strcmp(s, pattern);
+    }
+}
+
+/* Returns 1 if 'opt' is an option of switch, 2 for "--" and 0 otherwise */
+static int switch_option(const char *opt, enum switch_mode *mode) {
+    if(!strcmp(opt, "-exact"))
+        *mode = SWITCH_EXACT;
+    else if(!strcmp(opt, "-glob"))
+        *mode = SWITCH_GLOB;
+    else if(!strcmp(opt, "-prefix"))
+        *mode = SWITCH_PREFIX;
+    else
+        return !strcmp(opt, "--") ? 2 : 0;
+    return 1;
+}
+
+/* The first arm of 'sw' that matches 's', or -1 */
+static int switch_arm(const struct fiz_switch *sw, const char *s) {
+    char buffer[64], *prefix;
+    int *t, arm, i;
+    size_t len;
+
+    t = ht_find(sw->exact, s);
+    arm = t ? t - sw->targets : sw->narms;
+    if(sw->mode == SWITCH_GLOB) {
+        for(i = 0; i < sw->nwild && sw->wild[i] < arm; i++)
+            if(glob_match(sw->patterns[sw->wild[i]], s))
+                return sw->wild[i];
+    } else if(sw->mode == SWITCH_PREFIX) {
+        len = strlen(s);
+        prefix = len < sizeof buffer ? buffer : malloc(len + 1);
+        for(i = 0; i < sw->nlens && sw->lens[i] <= len; i++) {
+            memcpy(prefix, s, sw->lens[i]);
+            prefix[sw->lens[i]] = '\0';
+            if((t = ht_find(sw->exact, prefix)) && t - sw->targets < arm)
+                arm = t - sw->targets;
+        }
+        if(prefix != buffer)
+            free(prefix);
+    }
+    return arm < sw->narms ? arm : -1;
+}
+
+/* Builds the table for a switch over the patterns in 'l' */
+static int add_switch(struct codegen *G, enum switch_mode mode, const struct fiz_list *l) {
+    struct fiz_bytecode *C = G->C;
+    struct fiz_switch *sw;
+    const char *pattern;
+    int i, j, len;
+
+    if(C->nswitches == C->aswitches) {
+        C->aswitches = C->aswitches ? C->aswitches << 1 : 4;
+        C->switches = realloc(C->switches, C->aswitches * sizeof *C->switches);
+    }
+    sw = &C->switches[C->nswitches];
+    sw->mode = mode;
+    sw->exact = ht_create(16);
+    sw->narms = l->len / 2;
+    sw->patterns = malloc(sw->narms * sizeof *sw->patterns);
+    sw->targets = calloc(sw->narms, sizeof *sw->targets);
+    sw->wild = malloc(sw->narms * sizeof *sw->wild);
+    sw->lens = malloc(sw->narms * sizeof *sw->lens);
+    sw->nwild = sw->nlens = 0;
+    sw->dflt = -1;
+    sw->end = 0;
+    for(i = 0; i < sw->narms; i++) {
+        pattern = sw->patterns[i] = strdup(val_str(l->items[2 * i]));
+        if(i == sw->narms - 1 && !strcmp(pattern, "default")) {
+            sw->dflt = i;
+        } else if(mode == SWITCH_GLOB && strpbrk(pattern, "*?[\\")) {
+            sw->wild[sw->nwild++] = i;
+        } else if(!ht_find(sw->exact, pattern)) {
+            ht_insert(sw->exact, pattern, &sw->targets[i]);
+            if(mode == SWITCH_PREFIX) {
+                /* Keep the lengths sorted, without duplicates */
+                len = strlen(pattern);
+                for(j = sw->nlens; j > 0 && sw->lens[j - 1] > len; j--);
+                if(j == 0 || sw->lens[j - 1] != len) {
+                    memmove(&sw->lens[j + 1], &sw->lens[j], (sw->nlens - j) * sizeof *sw->lens);
+                    sw->lens[j] = len;
+                    sw->nlens++;
+                }
+            }
+        }
+    }
+    return C->nswitches++;
+}
+
+/*
+ * switch ?options? value {pattern body ...}
+ * The value is looked up in a table made from the patterns when the
+ * code is compiled, and the bodies are compiled inline. A body of "-"
+ * means that the arm uses the body of the arm after it.
+ */
+static void gen_switch(struct codegen *G, const struct fiz_cmd *cmd, int stmt,
+        enum switch_mode mode, const struct fiz_list *l) {
+    int narms = l->len / 2, pos = G->depth, guard, idx, i;
+    int *picks = malloc(cmd->nwords * sizeof *picks);
+    int *targets = malloc(narms * sizeof *targets);
+    int *jumps = malloc(narms * sizeof *jumps);
+    const char *body;
+
+    gen_word(G, &cmd->words[cmd->nwords - 2]);
+
+    emit(G, OP_GUARD);
+    emit(G, BIF_SWITCH);
+    emit(G, add_lit(G, "switch"));
+    guard = emit(G, 0);
+    emit(G, add_site(G));
+
+    idx = add_switch(G, mode, l);
+    emit(G, OP_SWITCH);
+    emit(G, idx);
+    G->depth--;
+    for(i = 0; i < narms; i++) {
+        body = val_str(l->items[2 * i + 1]);
+        if(!strcmp(body, "-")) {
+            targets[i] = jumps[i] = -1;
+            continue;
+        }
+        targets[i] = G->C->nops;
+        gen_text(G, body, NULL, G->handler);
+        emit(G, OP_JUMP);
+        jumps[i] = emit(G, 0);
+    }
+    for(i = narms - 2; i >= 0; i--)
+        if(targets[i] < 0)
+            targets[i] = targets[i + 1];
+
+    G->C->ops[guard] = G->C->nops;
+    push(G, 1);
+    for(i = 0; i < cmd->nwords; i++)
+        picks[i] = (i == cmd->nwords - 2) ? pos : -1;
+    gen_fallback(G, cmd, stmt, picks);
+    emit(G, OP_DROP);
+    emit(G, 1);
+    G->depth--;
+
+    for(i = 0; i < narms; i++)
+        if(jumps[i] >= 0)
+            G->C->ops[jumps[i]] = G->C->nops;
+    /* The bodies may have added switches of their own */
+    memcpy(G->C->switches[idx].targets, targets, narms * sizeof *targets);
+    G->C->switches[idx].end = G->C->nops;
+    free(picks);
+    free(targets);
+    free(jumps);
+}
+
+/* The patterns and bodies of a switch that can be compiled inline, or NULL */
+static struct fiz_list *switch_arms(const struct fiz_cmd *cmd, enum switch_mode *mode) {
+    const char *word;
+    struct fiz_list *l;
+    int i;
+    *mode = SWITCH_EXACT;
+    if(cmd->nwords < 3)
+        return NULL;
+    for(i = 1; i < cmd->nwords - 2; i++) {
+        if(!(word = literal_word(&cmd->words[i])) || !switch_option(word, mode))
+            return NULL;
+        if(!strcmp(word, "--") && i != cmd->nwords - 3)
+            return NULL;
+    }
+    if(!(word = literal_word(&cmd->words[cmd->nwords - 1])) || !(l = list_parse(word)))
+        return NULL;
+    /* Leave the errors to bif_switch() */
+    if(l->len % 2 || (l->len && !strcmp(val_str(l->items[l->len - 1]), "-"))) {
+        list_free(l);
+        return NULL;
+    }
+    return l;
+}
+
+static int all_literal(const struct fiz_cmd *cmd) {
+    int i;
+    for(i = 0; i < cmd->nwords; i++)
+        if(!literal_word(&cmd->words[i]))
+            return 0;
+    return 1;
+}
+
+static void gen_cmd(struct codegen *G, const struct fiz_cmd *cmd) {
+    const char *name = literal_word(&cmd->words[0]), *var;
+    int i, stmt, bif = -1, slot = -1;
+    struct fiz_list *arms;
+    enum switch_mode mode;
+
+    if(G->src) {
+        G->begin = gen_source(G, cmd->begin);
+        G->end = gen_source(G, cmd->end);
+    }
+    stmt = add_stmt(G, G->begin, G->end);
+    emit(G, OP_STMT);
+    emit(G, stmt);
+
+    if(name) {
+        for(i = 0; bifs[i].name; i++)
+            if(!strcmp(name, bifs[i].name)) {
+                bif = i;
+                break;
+            }
+        if(bif == BIF_WHILE && cmd->nwords == 3 && all_literal(cmd)) {
+            gen_while(G, cmd, stmt);
+            return;
+        } else if(bif == BIF_IF && all_literal(cmd) && (cmd->nwords == 3 ||
+                (cmd->nwords == 5 && !strcmp(literal_word(&cmd->words[3]), "else")))) {
+            gen_if(G, cmd, stmt);
+            return;
+        } else if(bif == BIF_FOR && cmd->nwords == 5 && all_literal(cmd)) {
+            gen_for(G, cmd, stmt);
+            return;
+        } else if(bif == BIF_FOR && cmd->nwords == 7 && literal_word(&cmd->words[1])
+                && literal_word(&cmd->words[6]) && literal_word(&cmd->words[2])
+                && !strcmp(literal_word(&cmd->words[2]), "from") && literal_word(&cmd->words[4])
+                && !strcmp(literal_word(&cmd->words[4]), "to")) {
+            gen_counted(G, cmd, stmt, bif);
+            return;
+        } else if(bif == BIF_FOREACH && cmd->nwords == 4 && literal_word(&cmd->words[1])
+                && literal_word(&cmd->words[3])) {
+            gen_counted(G, cmd, stmt, bif);
+            return;
+        } else if(bif == BIF_SWITCH && (arms = switch_arms(cmd, &mode)) != NULL) {
+            gen_switch(G, cmd, stmt, mode, arms);
+            list_free(arms);
+            return;
+        }
+    }
+
+    for(i = 0; i < cmd->nwords; i++)
+        gen_word(G, &cmd->words[i]);
+    if(bif >= 0 && bif != BIF_WHILE && bif != BIF_IF && bif != BIF_FOR && bif != BIF_SWITCH) {
+        if((bif == BIF_SET || bif == BIF_INCR || bif == BIF_DECR || bif == BIF_LAPPEND
+                || bif == BIF_LSET || bif == BIF_FOREACH || bif == BIF_APPEND) && cmd->nwords > 1
+                && (var = literal_word(&cmd->words[1])) != NULL)
+            slot = gen_local(G, var);
+        emit(G, OP_BIF);
+        emit(G, bif);
+        emit(G, cmd->nwords);
+        emit(G, stmt);
+        emit(G, G->handler);
+        emit(G, add_site(G));
+        emit(G, slot);
+    } else {
+        emit(G, OP_INVOKE);
+        emit(G, cmd->nwords);
+        emit(G, stmt);
+        emit(G, G->handler);
+        emit(G, name ? add_site(G) : -1);
+    }
+    G->depth -= cmd->nwords;
+}
+
+static void gen_script(struct codegen *G, const struct fiz_script *S) {
+    int i;
+    for(i = 0; i < S->ncmds; i++)
+        gen_cmd(G, &S->cmds[i]);
+}
+
+static struct fiz_bytecode *new_code(struct codegen *G, const char *text) {
+    struct fiz_bytecode *C = calloc(1, sizeof *C);
+    C->refs = 1;
+    G->C = C;
+    G->depth = 0;
+    G->handler = -1;
+    G->hole_base = 0;
+    G->text = text;
+    G->src = text;
+    G->begin = NULL;
+    G->end = NULL;
+    return C;
+}
+
+/*
+ * Compiles a script into bytecode. The code refers to 'txt' for
+ * error reporting, so it must remain valid while the code is used.
+ */
+static struct fiz_bytecode *compile_code(const char *txt) {
+    struct codegen G;
+    struct fiz_bytecode *C = new_code(&G, txt);
+    struct fiz_script *S = compile(txt);
+    gen_script(&G, S);
+    free_script(S);
+    return C;
+}
+
+/*
+ * Compiles the body of a proc. Its parameters are put in the
+ * first slots, in the order that they're declared.
+ */
+static struct fiz_bytecode *compile_proc(struct proc *p) {
+    struct codegen G;
+    struct fiz_bytecode *C = new_code(&G, p->fun.proc.body);
+    struct fiz_script *S = compile(p->fun.proc.body);
+    int i;
+    C->has_locals = 1;
+    for(i = 0; i < p->fun.proc.nparams; i++) {
+        C->locals = realloc(C->locals, (i + 1) * sizeof *C->locals);
+        C->locals[i] = strdup(p->fun.proc.params[i]);
+    }
+    C->nlocals = C->alocals = p->fun.proc.nparams;
+    gen_script(&G, S);
+    free_script(S);
+    return C;
+}
+
+static void free_code(struct fiz_bytecode *C) {
+    int i;
+    if(--C->refs > 0)
+        return;
+    for(i = 0; i < C->nlits; i++)
+        val_release(C->lits[i]);
+    free(C->lits);
+    for(i = 0; i < C->nlocals; i++)
+        free(C->locals[i]);
+    free(C->locals);
+    free(C->ops);
+    free(C->stmts);
+    free(C->handlers);
+    free(C->sites);
+    for(i = 0; i < C->nswitches; i++) {
+        struct fiz_switch *sw = &C->switches[i];
+        int j;
+        ht_free(sw->exact, NULL);
+        for(j = 0; j < sw->narms; j++)
+            free(sw->patterns[j]);
+        free(sw->patterns);
+        free(sw->targets);
+        free(sw->wild);
+        free(sw->lens);
+    }
+    free(C->switches);
+    free(C->text);
+    free(C);
+}
+
+/*====================================================================
+ * The interpreter
+ *====================================================================*/
+
+/* 'code' is the body of the proc being called, or NULL */
+static void add_callframe(Fiz *F, struct fiz_bytecode *code)  {
+    int n = code ? code->nlocals : 0;
+    struct fiz_callframe *cf = malloc(sizeof *cf + n * sizeof *cf->slots);
+    cf->vars = NULL;
+    cf->code = code;
+    cf->depth = F->callframe ? F->callframe->depth + 1 : 0;
+    cf->nslots = n;
+    memset(cf->slots, 0, n * sizeof *cf->slots);
+    cf->parent = F->callframe;
+    F->callframe = cf;
+}
+
+static void free_var(const char *key, void *val) {
+    if(val == &global_var_marker) return;
+	val_release(val);
+}
+
+static void delete_callframe(Fiz *F) {
+    struct fiz_callframe *cf = F->callframe;
+    int i;
+    assert(F->callframe);
+    F->callframe = cf->parent;
+    for(i = 0; i < cf->nslots; i++)
+        if(cf->slots[i])
+            free_var(NULL, cf->slots[i]);
+    if(cf->vars)
+        ht_free(cf->vars, free_var);
     free(cf);
 }
 
 static void add_bifs(Fiz *F);
+static void free_coroutines(Fiz *F);
+static void free_vms(Fiz *F);
 
 Fiz *fiz_create() {
     Fiz *F = malloc(sizeof *F);
-    if(!F) 
+    if(!F)
         return NULL;
     F->callframe = NULL;
-    add_callframe(F);
+    add_callframe(F, NULL);
     F->commands = ht_create(0);
     F->dicts = ht_create(16);
-    F->return_val = strdup("");
+    F->return_val = val_new("");
     F->last_statement_begin = NULL;
     F->last_statement_end = NULL;
     F->abort = 0;
     F->abort_func = NULL;
     F->abort_func_data = NULL;
+    F->commands_epoch = 0;
+    F->max_depth = MAX_DEPTH;
+    F->nesting = 0;
+    F->arena = calloc(1, sizeof *F->arena);
+    F->expr_cache = NULL;
+    F->vm = NULL;
+    F->free_vms = NULL;
+    F->coroutines = NULL;
+    F->suspended = NULL;
     add_bifs(F);
     return F;
 }
@@ -396,150 +2186,928 @@ Fiz *fiz_create() {
 static void free_proc(const char *key, void *vp) {
     struct proc *p = vp;
     if(p->type == FIZ_PROC) {
+        int i;
+        for(i = 0; i < p->fun.proc.nparams; i++)
+            free(p->fun.proc.params[i]);
         free(p->fun.proc.params);
         free(p->fun.proc.body);
+        if(p->fun.proc.code)
+            free_code(p->fun.proc.code);
     }
     free(p);
 }
 
 static void free_dict(const char *key, void *vp) {
-    struct hash_tbl *d = vp;
-    ht_free(d, free_var);
+    struct dict *d = vp;
+    if(d->list)
+        sl_free(d->list, free_var);
+    else
+        ht_free(d->hash, free_var);
+    free(d);
 }
 
 void fiz_destroy(Fiz *F) {
     if(!F) return;
+    free_coroutines(F);
+    free_vms(F);
     ht_free(F->commands, free_proc);
     ht_free(F->dicts, free_dict);
-    free(F->return_val);
+    val_release(F->return_val);
     delete_callframe(F);
+    arena_free(F->arena);
+    expr_cache_free(F->expr_cache);
     free(F);
 }
 
-static void clear_argv(int argc, char **argv) {
+/* Values that can't change the way substituted text is parsed */
+static int is_plain(const char *s) {
+    if(!s[0])
+        return 0;
+    for(; s[0]; s++)
+        if(isspace((int)s[0]) || strchr(";\"[]{}$\\#\001", s[0]))
+            return 0;
+    return 1;
+}
+
+static int val_plain(struct fiz_value *v) {
+    if(!(v->flags & VAL_PLAIN_KNOWN))
+        v->flags |= VAL_PLAIN_KNOWN | (is_plain(val_str(v)) ? VAL_PLAIN : 0);
+    return v->flags & VAL_PLAIN;
+}
+
+static struct fiz_value *get_var_value(Fiz *F, const char *name, int slot);
+static void set_var_value(Fiz *F, const char *name, int slot, struct fiz_value *value);
+static void set_return_value(Fiz *F, struct fiz_value *v);
+static Fiz_Code vm_run(Fiz *F, struct fiz_bytecode *C, char **result);
+static Fiz_Code call_proc(Fiz *F, struct proc *p, int argc, struct fiz_value **argv);
+
+/* Binds the arguments of a call of proc 'p' to the slots of a new callframe */
+static Fiz_Code bind_args(Fiz *F, struct proc *p, int argc, struct fiz_value **argv) {
     int i;
-    for(i = 0; i < argc; i++) {
-        free(argv[i]);
-        argv[i] = NULL;
+
+    if(argc != p->fun.proc.nparams + 1) {
+        fiz_set_return_ex(F, "'%s' wanted %d parameters, but got %d", val_str(argv[0]), p->fun.proc.nparams, argc - 1);
+        return FIZ_ERROR;
     }
+    if(F->callframe->depth >= F->max_depth) {
+        fiz_set_return_ex(F, "too many nested calls (the limit is %d)", F->max_depth);
+        return FIZ_ERROR;
+    }
+    add_callframe(F, p->fun.proc.code);
+    for(i = 1; i < argc; i++) {
+        struct fiz_value **slot = &F->callframe->slots[i - 1];
+        if(*slot)
+            val_release(*slot);
+        *slot = val_ref(argv[i]);
+    }
+    return FIZ_OK;
 }
 
-Fiz_Code fiz_exec(Fiz *F, const char *str) {
-    if(F->abort) {
-        fiz_set_return(F, "Interpreter aborted");
+/* Takes the callframe under the one on top away, for a tail call */
+static void drop_callframe(Fiz *F) {
+    struct fiz_callframe *cf = F->callframe;
+    F->callframe = cf->parent;
+    delete_callframe(F);
+    cf->parent = F->callframe;
+    cf->depth = cf->parent->depth + 1;
+    F->callframe = cf;
+}
+
+/*
+ * Calls a command with the values in 'argv'. C-functions get the
+ * strings of the values in 'strs', which must have space for them.
+ */
+static Fiz_Code call_command(Fiz *F, struct proc *p, int argc, struct fiz_value **argv, char **strs) {
+    int i;
+    if(!p) {
+        fiz_set_return_ex(F, "undefined command '%s'", val_str(argv[0]));
         return FIZ_ERROR;
     }
+    if(p->type == FIZ_CFUN) {
+        /* External C-function; its temporary memory is released when it returns */
+        struct arena_mark m = arena_mark(F->arena);
+        Fiz_Code rc;
+        for(i = 0; i < argc; i++)
+            strs[i] = (char *)val_str(argv[i]);
+        rc = p->fun.cfun.fun(F, argc, strs, p->fun.cfun.data);
+        arena_release(F->arena, m);
+        return rc;
+    }
+    /* Script defined procedure */
+    return call_proc(F, p, argc, argv);
+}
 
-    enum FI_CODE fic;
-    FizParser FI;
-    Fiz_Code rc = FIZ_OK;
+/* Looks up the command 'name', unless call site 's' remembers it */
+static struct proc *site_command(Fiz *F, struct fiz_callsite *s, const char *name) {
+    if(s->F != F || s->epoch != F->commands_epoch) {
+        s->p = ht_find(F->commands, name);
+        s->F = F;
+        s->epoch = F->commands_epoch;
+    }
+    return s->p;
+}
 
-    /* Where to store the parameters */
-    char **argv;
-    int a_argc = INITIAL_NUM_ARGS, argc;
+/* Looks up the command 'name' called from call site 'site' of 'C' */
+static struct proc *find_command(Fiz *F, struct fiz_bytecode *C, int site, const char *name) {
+    if(site < 0)
+        return ht_find(F->commands, name);
+    return site_command(F, &C->sites[site], name);
+}
 
-    init_parser(&FI, str);
-    argv = calloc(a_argc, sizeof *argv);
+/* Is the command 'name' still the built-in command 'bif'? */
+static struct proc *find_bif(Fiz *F, struct fiz_bytecode *C, int site, const char *name, int bif, int *is_bif) {
+    struct proc *p = find_command(F, C, site, name);
+    *is_bif = p && p->type == FIZ_CFUN && p->fun.cfun.fun == bifs[bif].fun
+        && (!bifs[bif].vfun || p->fun.cfun.data == &bifs[bif]);
+    return p;
+}
 
-    F->last_statement_begin = NULL;
-    F->last_statement_end = NULL;
+/*
+ * The VM keeps the bytecode that is running in a stack of frames on
+ * the heap, rather than on the C stack: Calling a proc or evaluating
+ * text that was substituted at run time pushes a frame, and the frame
+ * is popped when the code is done. Because of that, a VM can stop in
+ * the middle of a proc and carry on later, which is what coroutines do.
+ *
+ * Commands implemented in C still run on the C stack. If they execute
+ * scripts, they do so in a VM of their own.
+ */
+enum frame_kind {
+    FRAME_TOP,          /* Code run with vm_run() */
+    FRAME_PROC,         /* The body of a proc; owns a callframe */
+    FRAME_EVAL          /* Text substituted at run time; owns the code */
+};
 
-    for(;;) { /* For all the statements in the input */
-        struct proc *p;
+struct vm_frame {
+    struct fiz_bytecode *C;
+    int pc;
+    /* The frame's stack starts at vals[base] */
+    int base;
+    enum frame_kind kind;
+    /* Set if a PROC frame took the place of its caller's */
+    int tail;
+    /* The statement that an EVAL frame was started from */
+    const char *stmt_begin, *stmt_end;
+};
 
-        F->last_statement_begin = FI.txt;
-        F->last_statement_end = NULL;
+struct fiz_vm {
+    struct fiz_value **vals;
+    /* 'strs' is where the strings of the arguments are put when a
+     * C-function is called */
+    char **strs;
+    int sp, asp;
+    struct vm_frame *frames;
+    int nframes, aframes;
+    /* The coroutine that runs in this VM, if any */
+    struct fiz_coroutine *co;
+    /* If 'budget' is set, the VM stops when it has run 'steps' commands */
+    int budget, steps;
+    /* The VM with a budget that this VM's commands count against, if any */
+    struct fiz_vm *meter;
+    /* The innermost callframe of the VM's procs, while it is stopped */
+    struct fiz_callframe *callframe;
+    /* Next VM in the interpreter's list of free or suspended VMs */
+    struct fiz_vm *next;
+};
 
-        fic = get_word(F, &FI); /* get the command */
-        if(fic == FI_EOI) break;
-        if(fic == FI_EOS) continue;
+static struct fiz_vm *vm_get(Fiz *F) {
+    struct fiz_vm *vm = F->free_vms;
+    if(vm)
+        F->free_vms = vm->next;
+    else
+        vm = calloc(1, sizeof *vm);
+    vm->co = NULL;
+    vm->budget = 0;
+    vm->meter = NULL;
+    return vm;
+}
 
-        /* Get the parameters */
-        argc = 0;
-        argv[argc++] = strdup(FI.word);
-        while((fic = get_word(F, &FI)) == FI_WORD) {
-            if(argc == a_argc) {
-                a_argc += INITIAL_NUM_ARGS;
-                argv = realloc(argv, a_argc * sizeof *argv);
-            }
-            argv[argc++] = strdup(FI.word);
-        }
+static void vm_put(Fiz *F, struct fiz_vm *vm) {
+    assert(vm->nframes == 0 && vm->sp == 0);
+    vm->next = F->free_vms;
+    F->free_vms = vm;
+}
 
-        F->last_statement_end = FI.txt;
+/* Pushes a frame that runs 'C' on top of the values on the stack */
+static void vm_push(struct fiz_vm *vm, struct fiz_bytecode *C, enum frame_kind kind) {
+    struct vm_frame *f;
+    if(vm->nframes == vm->aframes) {
+        vm->aframes = vm->aframes ? vm->aframes << 1 : 8;
+        vm->frames = realloc(vm->frames, vm->aframes * sizeof *vm->frames);
+    }
+    if(vm->sp + C->max_stack > vm->asp) {
+        vm->asp = vm->asp ? vm->asp << 1 : 16;
+        if(vm->asp < vm->sp + C->max_stack)
+            vm->asp = vm->sp + C->max_stack;
+        vm->vals = realloc(vm->vals, vm->asp * sizeof *vm->vals);
+        vm->strs = realloc(vm->strs, vm->asp * sizeof *vm->strs);
+    }
+    /* Hold on to the code in case a proc gets redefined while it runs */
+    C->refs++;
+    f = &vm->frames[vm->nframes++];
+    f->C = C;
+    f->pc = 0;
+    f->base = vm->sp;
+    f->kind = kind;
+    f->tail = 0;
+}
 
-        if(fic == FI_ERR)
-            goto clean_error;
+/* Pops the top frame, which finished with 'rc', and releases its values */
+static Fiz_Code vm_pop(Fiz *F, struct fiz_vm *vm, Fiz_Code rc) {
+    struct vm_frame *f = &vm->frames[--vm->nframes];
+    while(vm->sp > f->base)
+        val_release(vm->vals[--vm->sp]);
+    switch(f->kind) {
+    case FRAME_PROC:
+        delete_callframe(F);
+        if(rc == FIZ_RETURN)
+            rc = FIZ_OK;
+        else if(f->tail && (rc == FIZ_BREAK || rc == FIZ_CONTINUE))
+            rc = FIZ_ERROR;
+        break;
+    case FRAME_EVAL:
+        /* The code's text is about to go */
+        F->last_statement_begin = f->stmt_begin;
+        F->last_statement_end = f->stmt_end;
+        if(rc != FIZ_OK)
+            rc = FIZ_ERROR;
+        break;
+    default:
+        break;
+    }
+    free_code(f->C);
+    return rc;
+}
 
-        /* Evaluate! */
-        p = ht_find(F->commands, argv[0]);
-        if(!p) {
-            fiz_set_return_ex(F, "undefined command '%s'", argv[0]);
-            goto clean_error;
-        }
+/* Pops the frames of a VM that stopped and isn't going to carry on */
+static void vm_discard(Fiz *F, struct fiz_vm *vm) {
+    struct fiz_callframe *cf = F->callframe;
+    F->callframe = vm->callframe;
+    while(vm->nframes)
+        vm_pop(F, vm, FIZ_ERROR);
+    F->callframe = cf;
+    vm_put(F, vm);
+}
 
-        const char* last_begin = F->last_statement_begin;
-        const char* last_end = F->last_statement_end;
-        if(p->type == FIZ_CFUN) {
-            /* External C-function */
-            rc = p->fun.cfun.fun(F, argc, argv, p->fun.cfun.data);
-        } else {
-            /* Script defined procedure */
-            char *pars = strdup(p->fun.proc.params), *c, *n;
-            int i = 1, brk = 0;
-            add_callframe(F);
-            for(n=pars; !brk && *n; n++, i++) {
-                while(n[0] && isspace((int)n[0])) n++;
-                if(!n[0]) break;
-                c = n;
-                while(n[0] && !isspace((int)n[0])) n++;
-                if(!n[0]) brk = 1;
-                n[0] = '\0';
-                if(i < argc)
-                    fiz_set_var(F, c, argv[i]);
+/* Frees the VMs of the interpreter, suspended or not */
+static void free_vms(Fiz *F) {
+    while(F->suspended) {
+        struct fiz_vm *vm = F->suspended;
+        F->suspended = vm->next;
+        vm_discard(F, vm);
+    }
+    while(F->free_vms) {
+        struct fiz_vm *vm = F->free_vms;
+        F->free_vms = vm->next;
+        free(vm->vals);
+        free(vm->strs);
+        free(vm->frames);
+        free(vm);
+    }
+}
+
+/* Compiles 'text' and pushes a frame that runs it */
+static void vm_eval(Fiz *F, struct fiz_vm *vm, char *text) {
+    struct fiz_bytecode *C = compile_code(text);
+    struct vm_frame *f;
+    C->text = text;
+    vm_push(vm, C, FRAME_EVAL);
+    free_code(C);
+    f = &vm->frames[vm->nframes - 1];
+    f->stmt_begin = F->last_statement_begin;
+    f->stmt_end = F->last_statement_end;
+}
+
+/*
+ * Is the call at 'pc' in 'C' a tail call, as in "return [f x]"?
+ * That's when the code after it only takes the result and returns it
+ * with the built-in return.
+ */
+static int tail_call(Fiz *F, struct fiz_bytecode *C, int pc) {
+    const int *ops = C->ops;
+    int is_bif;
+    pc += 1 + op_size[ops[pc]];
+    while(pc < C->nops && ops[pc] == OP_JUMP && ops[pc + 1] > pc)
+        pc = ops[pc + 1];
+    if(pc < C->nops && ops[pc] == OP_DROP)
+        pc += 2;
+    if(pc + 2 >= C->nops || ops[pc] != OP_RESULT || ops[pc + 1] != OP_BIF
+            || ops[pc + 2] != BIF_RETURN || ops[pc + 3] != 2)
+        return 0;
+    find_bif(F, C, ops[pc + 6], bifs[BIF_RETURN].name, BIF_RETURN, &is_bif);
+    return is_bif;
+}
+
+/*
+ * Runs the frames of 'vm' until its bottom frame is done, and returns
+ * how it finished. The bottom frame is left for the caller to pop, so
+ * that it can take the result from the stack first.
+ *
+ * In a coroutine's VM, a call of yield returns FIZ_YIELDED, and so
+ * does a VM with a budget that has run out of steps. The next call of
+ * vm_exec() carries on where it stopped.
+ *
+ * The stack holds references to values, so values of variables and
+ * literals are pushed without copying them.
+ */
+static Fiz_Code vm_exec(Fiz *F, struct fiz_vm *vm) {
+    struct vm_frame *f;
+    struct fiz_bytecode *C;
+    struct fiz_value **vals;
+    char **strs;
+    const int *ops, *op;
+    int pc, sp, i, n, h;
+    Fiz_Code rc = FIZ_OK;
+
+#define PUSH(v)     (vals[sp++] = (v))
+#define POP(n)      do { int pop_n = (n); while(pop_n-- > 0) val_release(vals[--sp]); } while(0)
+#define STR(i)      ((char *)val_str(vals[i]))
+/* Saves the state of the running frame, before another one is pushed */
+#define SAVE()      (f->pc = pc, vm->sp = f->base + sp)
+/* Counts a step against the budget, and stops the VM here if it has run
+ * out of steps. A VM started by a C command can't stop, so it only counts,
+ * and the VM with the budget stops when the command returns */
+#define STEP()      do { if(vm->meter && --vm->meter->steps < 0) { vm->meter->steps = -1; \
+                        if(vm->budget) { SAVE(); return FIZ_YIELDED; } } } while(0)
+/* Switches to the frame on top */
+#define LOAD()      (f = &vm->frames[vm->nframes - 1], C = f->C, ops = C->ops, pc = f->pc, \
+                        vals = vm->vals + f->base, strs = vm->strs + f->base, sp = vm->sp - f->base)
+
+    LOAD();
+    for(;;) {
+        if(pc >= C->nops) {
+            rc = FIZ_OK;
+            goto done;
+        }
+        switch(ops[pc]) {
+        case OP_PUSH:
+            PUSH(val_ref(C->lits[ops[pc + 1]]));
+            break;
+        case OP_LOAD: {
+                struct fiz_value *val = get_var_value(F, val_str(C->lits[ops[pc + 1]]), -1);
+                if(!val) {
+                    fiz_set_return_ex(F, "Unknown variable '%s'", val_str(C->lits[ops[pc + 1]]));
+                    rc = FIZ_ERROR;
+                    goto done;
+                }
+                PUSH(val_ref(val));
+            } break;
+        case OP_LOAD_LOCAL: {
+                struct fiz_value *val = F->callframe->slots[ops[pc + 1]];
+                const char *name = C->locals[ops[pc + 1]];
+                if(val == &global_var_marker)
+                    val = get_var_value(F, name, ops[pc + 1]);
+                if(!val) {
+                    fiz_set_return_ex(F, "Unknown variable '%s'", name);
+                    rc = FIZ_ERROR;
+                    goto done;
+                }
+                PUSH(val_ref(val));
+            } break;
+        case OP_PICK:
+            PUSH(val_ref(vals[ops[pc + 1]]));
+            break;
+        case OP_CONCAT: {
+                struct fiz_value *val;
+                size_t len = 0;
+                char *s;
+                n = ops[pc + 1];
+                for(i = sp - n; i < sp; i++)
+                    len += strlen(STR(i));
+                s = (val = val_alloc(len))->str;
+                for(i = sp - n; i < sp; i++) {
+                    size_t l = strlen(vals[i]->str);
+                    memcpy(s, vals[i]->str, l);
+                    s += l;
+                }
+                POP(n);
+                PUSH(val);
+            } break;
+        case OP_DROP:
+            POP(ops[pc + 1]);
+            break;
+        case OP_RESULT:
+            PUSH(val_ref(F->return_val));
+            break;
+        case OP_STMT:
+            if(F->abort) {
+                fiz_set_return(F, "Interpreter aborted");
+                rc = FIZ_ERROR;
+                goto done;
             }
-            free(pars);
-            if(i != argc) {
-                fiz_set_return_ex(F, "'%s' wanted %d parameters, but got %d", argv[0], i-1, argc - 1);
-                delete_callframe(F);
-                goto clean_error;
+            STEP();
+            F->last_statement_begin = C->stmts[ops[pc + 1]].begin;
+            F->last_statement_end = C->stmts[ops[pc + 1]].end;
+            break;
+        case OP_INVOKE:
+        case OP_BIF: {
+                int argc, is_bif = 0, base;
+                struct fiz_value **argv;
+                struct proc *p;
+                op = (ops[pc] == OP_BIF) ? &ops[pc + 1] : &ops[pc];
+                argc = op[1];
+                base = sp - argc;
+                argv = &vals[base];
+                if(ops[pc] == OP_BIF)
+                    p = find_bif(F, C, op[4], val_str(argv[0]), ops[pc + 1], &is_bif);
+                else
+                    p = find_command(F, C, op[4], val_str(argv[0]));
+                if(!is_bif) {
+                    if(p && p->type == FIZ_PROC) {
+                        /* The proc's body runs in a frame of its own */
+                        rc = bind_args(F, p, argc, argv);
+                        if(rc == FIZ_OK) {
+                            struct fiz_bytecode *code = p->fun.proc.code;
+                            POP(argc);
+                            if(f->kind == FRAME_PROC && tail_call(F, C, pc)) {
+                                /* The proc takes the place of the one that calls it */
+                                code->refs++;
+                                POP(sp);
+                                drop_callframe(F);
+                                vm->nframes--;
+                                vm->sp = f->base;
+                                free_code(C);
+                                vm_push(vm, code, FRAME_PROC);
+                                vm->frames[vm->nframes - 1].tail = 1;
+                                free_code(code);
+                            } else {
+                                SAVE();
+                                vm_push(vm, code, FRAME_PROC);
+                            }
+                            LOAD();
+                            continue;
+                        }
+                    } else
+                        rc = call_command(F, p, argc, argv, &strs[base]);
+                } else switch(ops[pc + 1]) {
+                    case BIF_SET:
+                        if(argc == 3) {
+                            set_var_value(F, val_str(argv[1]), op[5], val_ref(argv[2]));
+                            set_return_value(F, val_ref(argv[2]));
+                            rc = FIZ_OK;
+                        } else
+                            rc = call_command(F, p, argc, argv, &strs[base]);
+                        break;
+                    case BIF_INCR:
+                    case BIF_DECR:
+                        if(argc == 2)
+                            rc = incr_var(F, val_str(argv[1]), op[5], ops[pc + 1] == BIF_DECR ? -1 : 1);
+                        else
+                            rc = call_command(F, p, argc, argv, &strs[base]);
+                        break;
+                    case BIF_RETURN:
+                        if(argc == 2) {
+                            set_return_value(F, val_ref(argv[1]));
+                            rc = FIZ_RETURN;
+                        } else
+                            rc = call_command(F, p, argc, argv, &strs[base]);
+                        break;
+                    case BIF_BREAK:
+                    case BIF_CONTINUE:
+                        if(argc == 1)
+                            rc = (ops[pc + 1] == BIF_BREAK) ? FIZ_BREAK : FIZ_CONTINUE;
+                        else
+                            rc = call_command(F, p, argc, argv, &strs[base]);
+                        break;
+                    default:
+                        if(bifs[ops[pc + 1]].vfun)
+                            rc = bifs[ops[pc + 1]].vfun(F, argc, argv, op[5]);
+                        else
+                            rc = call_command(F, p, argc, argv, &strs[base]);
+                        break;
+                }
+                POP(argc);
             }
-            rc = fiz_exec(F, p->fun.proc.body);
-            if(rc == FIZ_RETURN) rc = FIZ_OK;
-            delete_callframe(F);
+        after_call:
+            /* 'rc' is what the command at 'pc' returned */
+            op = (ops[pc] == OP_BIF) ? &ops[pc + 1] : &ops[pc];
+            h = op[3];
+            if(rc == FIZ_YIELDED) {
+                if(vm->co) {
+                    pc += 1 + op_size[ops[pc]];
+                    SAVE();
+                    return FIZ_YIELDED;
+                }
+                fiz_set_return(F, "can't yield from inside a command implemented in C");
+                rc = FIZ_ERROR;
+            }
+            if(rc != FIZ_ERROR && rc != FIZ_OOM) {
+                F->last_statement_begin = C->stmts[op[2]].begin;
+                F->last_statement_end = C->stmts[op[2]].end;
+                if(rc == FIZ_OK) {
+                    pc += 1 + op_size[ops[pc]];
+                    continue;
+                }
+            }
+            /* Find a handler for the return code */
+            for(; h >= 0; h = C->handlers[h].parent) {
+                const struct fiz_handler *H = &C->handlers[h];
+                if(rc == FIZ_ERROR || rc == FIZ_OOM)
+                    break;
+                if(H->type == HANDLER_STRICT) {
+                    rc = FIZ_ERROR;
+                    break;
+                }
+                if(rc == FIZ_BREAK || rc == FIZ_CONTINUE) {
+                    POP(sp - H->depth);
+                    pc = (rc == FIZ_BREAK) ? H->brk : H->cont;
+                    rc = FIZ_OK;
+                    break;
+                }
+            }
+            if(rc != FIZ_OK)
+                goto done;
+            continue;
+        case OP_GUARD: {
+                int is_bif;
+                find_bif(F, C, ops[pc + 4], val_str(C->lits[ops[pc + 2]]), ops[pc + 1], &is_bif);
+                if(!is_bif) {
+                    pc = ops[pc + 3];
+                    continue;
+                }
+            } break;
+        case OP_JUMP:
+            pc = ops[pc + 1];
+            continue;
+        case OP_JUMP_FALSE:
+            if(!val_int(F->return_val)) {
+                pc = ops[pc + 1];
+                continue;
+            }
+            break;
+        case OP_FOR: {
+                struct fiz_value **count = &vals[ops[pc + 1]];
+                if(!for_bound_value(F, &count[0]) || !for_bound_value(F, &count[1])) {
+                    rc = FIZ_ERROR;
+                    goto done;
+                }
+                n = count[0]->i;
+                if(n > count[1]->i) {
+                    pc = ops[pc + 4];
+                    continue;
+                }
+                set_var_value(F, val_str(C->lits[ops[pc + 2]]), ops[pc + 3], val_ref(count[0]));
+            } break;
+        case OP_EACH: {
+                struct fiz_list *l = val_list(vals[ops[pc + 1]]);
+                if(!l) {
+                    fiz_set_return_ex(F, "malformed list '%s'", STR(ops[pc + 1]));
+                    rc = FIZ_ERROR;
+                    goto done;
+                }
+                n = val_int(vals[ops[pc + 1] + 1]);
+                if(n >= l->len) {
+                    pc = ops[pc + 4];
+                    continue;
+                }
+                set_var_value(F, val_str(C->lits[ops[pc + 2]]), ops[pc + 3], val_ref(l->items[n]));
+            } break;
+        case OP_SWITCH: {
+                const struct fiz_switch *sw = &C->switches[ops[pc + 1]];
+                n = switch_arm(sw, STR(sp - 1));
+                POP(1);
+                if(n < 0)
+                    n = sw->dflt;
+                if(n < 0) {
+                    set_return_value(F, val_new(""));
+                    pc = sw->end;
+                } else
+                    pc = sw->targets[n];
+            } continue;
+        case OP_NEXT: {
+                struct fiz_value **count = &vals[ops[pc + 1]];
+                /* A loop with an empty body has no statements to count */
+                STEP();
+                n = val_int(*count);
+                /* Stops the loop rather than overflow */
+                if(n == INT_MAX)
+                    break;
+                val_release(*count);
+                *count = val_new_int(n + 1);
+                pc = ops[pc + 2];
+            } continue;
+        case OP_PLAIN:
+            n = ops[pc + 1];
+            for(i = sp - n; i < sp; i++)
+                if(!val_plain(vals[i])) {
+                    pc = ops[pc + 2];
+                    break;
+                }
+            if(i < sp)
+                continue;
+            break;
+        case OP_TEMPLATE: {
+                int v = sp, v0;
+                size_t len = 0;
+                char *text, *s;
+                n = ops[pc + 1];
+                for(i = 0; i < n; i++)
+                    if(ops[pc + 2 + i] < 0)
+                        v--;
+                for(i = 0, v0 = v; i < n; i++)
+                    len += strlen(ops[pc + 2 + i] < 0 ? STR(v0++) : val_str(C->lits[ops[pc + 2 + i]]));
+                s = text = malloc(len + 1);
+                for(i = 0; i < n; i++) {
+                    const char *t = ops[pc + 2 + i] < 0 ? vals[v++]->str : C->lits[ops[pc + 2 + i]]->str;
+                    size_t l = strlen(t);
+                    memcpy(s, t, l);
+                    s += l;
+                }
+                *s = '\0';
+                SAVE();
+                vm_eval(F, vm, text);
+                LOAD();
+            } continue;
+        case OP_EVAL: {
+                char *text = strdup(STR(sp - 1));
+                POP(1);
+                SAVE();
+                vm_eval(F, vm, text);
+                LOAD();
+            } continue;
+        case OP_ERROR:
+            fiz_set_return(F, val_str(C->lits[ops[pc + 1]]));
+            rc = FIZ_ERROR;
+            goto done;
+        default:
+            assert(0);
         }
+        pc += 1 + op_size[ops[pc]];
+        continue;
 
-        if (rc != FIZ_ERROR && rc != FIZ_OOM)
-        {
-            F->last_statement_begin = last_begin;
-            F->last_statement_end = last_end;
-        }
-        clear_argv(argc, argv);
-        if(rc != FIZ_OK) break;
+    done:
+        /* The frame on top finished with 'rc' */
+        SAVE();
+        if(vm->nframes == 1)
+            return rc;
+        n = f->kind;
+        rc = vm_pop(F, vm, rc);
+        LOAD();
+        if(n == FRAME_PROC)
+            goto after_call;
+        /* Carry on after the instruction that started the EVAL frame */
+        if(rc != FIZ_OK)
+            goto done;
+        pc += (ops[pc] == OP_TEMPLATE) ? 2 + ops[pc + 1] : 1 + op_size[ops[pc]];
     }
+#undef PUSH
+#undef POP
+#undef STR
+#undef SAVE
+#undef STEP
+#undef LOAD
+}
 
-    free(argv);
-    destroy_parser(&FI);
+/* Runs 'C' in a frame of type 'kind' in a VM of its own */
+static Fiz_Code vm_start(Fiz *F, struct fiz_bytecode *C, enum frame_kind kind, char **result) {
+    struct fiz_vm *vm, *outer = F->vm;
+    Fiz_Code rc;
+
+    /* Each VM that is started uses the C stack */
+    if(F->nesting >= F->max_depth) {
+        if(kind == FRAME_PROC)
+            delete_callframe(F);
+        fiz_set_return_ex(F, "too many nested calls (the limit is %d)", F->max_depth);
+        return FIZ_ERROR;
+    }
+    vm = vm_get(F);
+    vm_push(vm, C, kind);
+    vm->meter = outer ? outer->meter : NULL;
+    F->vm = vm;
+    F->nesting++;
+    rc = vm_exec(F, vm);
+    F->nesting--;
+    F->vm = outer;
+    if(result && rc == FIZ_OK) {
+        assert(vm->sp == 1);
+        *result = strdup(val_str(vm->vals[0]));
+    }
+    rc = vm_pop(F, vm, rc);
+    vm_put(F, vm);
     return rc;
-clean_error:
-    clear_argv(argc, argv);
-    free(argv);
-    destroy_parser(&FI);
-    return FIZ_ERROR;
+}
+
+/*
+ * Executes bytecode. If 'result' is not NULL, the value left on top of
+ * the stack is stored in it.
+ */
+static Fiz_Code vm_run(Fiz *F, struct fiz_bytecode *C, char **result) {
+    return vm_start(F, C, FRAME_TOP, result);
+}
+
+static Fiz_Code call_proc(Fiz *F, struct proc *p, int argc, struct fiz_value **argv) {
+    Fiz_Code rc = bind_args(F, p, argc, argv);
+    if(rc != FIZ_OK)
+        return rc;
+    return vm_start(F, p->fun.proc.code, FRAME_PROC, NULL);
+}
+
+Fiz_Code fiz_exec(Fiz *F, const char *str) {
+    struct fiz_bytecode *C;
+    Fiz_Code rc;
+
+    if(F->abort) {
+        fiz_set_return(F, "Interpreter aborted");
+        return FIZ_ERROR;
+    }
+
+    F->last_statement_begin = NULL;
+    F->last_statement_end = NULL;
+
+    C = compile_code(str);
+    rc = vm_run(F, C, NULL);
+    free_code(C);
+    return rc;
+}
+
+/* A command that C code calls with fiz_call_command() */
+struct fiz_command {
+    struct fiz_callsite site;
+    struct fiz_value *name;
+};
+
+/* Calls command 'p' named 'name' with the strings in 'argv' as its arguments */
+static Fiz_Code call_strings(Fiz *F, struct proc *p, struct fiz_value *name, int argc, const char **argv) {
+    struct arena_mark m;
+    struct fiz_value **vals;
+    char **strs;
+    Fiz_Code rc;
+    int i;
+
+    if(F->abort) {
+        fiz_set_return(F, "Interpreter aborted");
+        return FIZ_ERROR;
+    }
+    m = arena_mark(F->arena);
+    vals = arena_alloc(F->arena, (argc + 1) * sizeof *vals);
+    strs = arena_alloc(F->arena, (argc + 1) * sizeof *strs);
+    vals[0] = val_ref(name);
+    for(i = 0; i < argc; i++)
+        vals[i + 1] = val_new(argv[i]);
+    rc = call_command(F, p, argc + 1, vals, strs);
+    for(i = 0; i <= argc; i++)
+        val_release(vals[i]);
+    arena_release(F->arena, m);
+    return rc;
+}
+
+Fiz_Code fiz_call(Fiz *F, const char *name, int argc, const char **argv) {
+    struct fiz_value *v = val_new(name);
+    Fiz_Code rc = call_strings(F, ht_find(F->commands, name), v, argc, argv);
+    val_release(v);
+    return rc;
+}
+
+Fiz_Command *fiz_command(Fiz *F, const char *name) {
+    struct fiz_command *cmd = calloc(1, sizeof *cmd);
+    cmd->name = val_new(name);
+    /* Looked up now, so the first call doesn't have to */
+    site_command(F, &cmd->site, name);
+    return cmd;
+}
+
+Fiz_Code fiz_call_command(Fiz *F, Fiz_Command *cmd, int argc, const char **argv) {
+    struct proc *p = site_command(F, &cmd->site, val_str(cmd->name));
+    return call_strings(F, p, cmd->name, argc, argv);
+}
+
+void fiz_free_command(Fiz_Command *cmd) {
+    if(!cmd)
+        return;
+    val_release(cmd->name);
+    free(cmd);
+}
+
+Fiz_Compiled *fiz_compile(Fiz *F, const char *str) {
+    /* The statements refer to the text to report where errors are */
+    char *text = strdup(str);
+    struct fiz_bytecode *C = compile_code(text);
+    C->text = text;
+    return C;
+}
+
+Fiz_Code fiz_run(Fiz *F, Fiz_Compiled *code) {
+    if(F->abort) {
+        fiz_set_return(F, "Interpreter aborted");
+        return FIZ_ERROR;
+    }
+    F->last_statement_begin = NULL;
+    F->last_statement_end = NULL;
+    return vm_run(F, code, NULL);
+}
+
+void fiz_free_compiled(Fiz_Compiled *code) {
+    if(code)
+        free_code(code);
+}
+
+/* The VM of the run of 'code' that fiz_exec_budget() suspended, taken
+ * out of the list */
+static struct fiz_vm *take_suspended(Fiz *F, Fiz_Compiled *code) {
+    struct fiz_vm **s, *vm;
+    for(s = &F->suspended; *s && (*s)->frames[0].C != code; s = &(*s)->next)
+        ;
+    if((vm = *s))
+        *s = vm->next;
+    return vm;
+}
+
+Fiz_Code fiz_exec_budget(Fiz *F, Fiz_Compiled *code, int max_steps) {
+    struct fiz_vm *vm = take_suspended(F, code), *outer = F->vm;
+    struct fiz_callframe *cf = F->callframe;
+    Fiz_Code rc;
+
+    if(vm)
+        F->callframe = vm->callframe;
+    else {
+        if(F->abort) {
+            fiz_set_return(F, "Interpreter aborted");
+            return FIZ_ERROR;
+        }
+        F->last_statement_begin = NULL;
+        F->last_statement_end = NULL;
+        vm = vm_get(F);
+        vm->budget = 1;
+        vm->meter = vm;
+        vm_push(vm, code, FRAME_TOP);
+    }
+    /* Always make some progress */
+    vm->steps = max_steps > 0 ? max_steps : 1;
+    F->vm = vm;
+    F->nesting++;
+    rc = vm_exec(F, vm);
+    F->nesting--;
+    F->vm = outer;
+    if(rc == FIZ_YIELDED) {
+        vm->callframe = F->callframe;
+        F->callframe = cf;
+        vm->next = F->suspended;
+        F->suspended = vm;
+        return rc;
+    }
+    rc = vm_pop(F, vm, rc);
+    F->callframe = cf;
+    vm_put(F, vm);
+    return rc;
+}
+
+void fiz_cancel(Fiz *F, Fiz_Compiled *code) {
+    struct fiz_vm *vm = take_suspended(F, code);
+    if(vm)
+        vm_discard(F, vm);
+}
+
+void fiz_set_max_depth(Fiz *F, int depth) {
+    F->max_depth = depth;
 }
 
 /*====================================================================
  * Support API Functions
  *====================================================================*/
 
+void *fiz_alloc_temp(Fiz *F, size_t size) {
+    return arena_alloc(F->arena, size);
+}
+
+void fiz_temp_stats(Fiz *F, unsigned long *allocs, unsigned long *mallocs) {
+    if(allocs)
+        *allocs = F->arena->allocs;
+    if(mallocs)
+        *mallocs = F->arena->mallocs;
+}
+
 const char *fiz_get_return(Fiz *F) {
     assert(F->return_val);
-    return F->return_val;
+    return val_str(F->return_val);
 }
 
-void fiz_set_return(Fiz *F, const char *s) {
+int fiz_get_return_int(Fiz *F) {
+    assert(F->return_val);
+    return val_int(F->return_val);
+}
+
+static void set_return_value(Fiz *F, struct fiz_value *v) {
     assert(F->return_val);
-    free(F->return_val);
-    F->return_val = strdup(s);
+    val_release(F->return_val);
+    F->return_val = v;
+}
+
+void fiz_set_return(Fiz *F, const char *s) {
+    set_return_value(F, val_new(s));
+}
+
+void fiz_append_return(Fiz *F, const char *s) {
+    struct fiz_value *v = val_append(F->return_val, s, strlen(s));
+    if(v != F->return_val)
+        set_return_value(F, v);
+}
+
+void fiz_set_return_int(Fiz *F, int i) {
+    set_return_value(F, val_new_int(i));
+}
+
+void fiz_set_return_normalized_double(Fiz *F, const double result) {
+    set_return_value(F, val_new_double(result));
 }
 
 void fiz_set_return_ex(Fiz *F, const char *fmt, ...) {
@@ -558,32 +3126,113 @@ static struct fiz_callframe* fiz_global_callframe(Fiz *F) {
     return cf;
 }
 
-const char *fiz_get_var(Fiz *F, const char *name) {
+/* Finds the slot of the local variable 'name' if the compiler didn't */
+static int find_slot(struct fiz_callframe *cf, const char *name, int slot) {
+    if(slot < 0 && cf->code) {
+        for(slot = cf->nslots - 1; slot >= 0; slot--)
+            if(!strcmp(cf->code->locals[slot], name))
+                break;
+    }
+    return slot;
+}
+
+static struct fiz_value *frame_get(struct fiz_callframe *cf, const char *name, int slot) {
+    slot = find_slot(cf, name, slot);
+    if(slot >= 0)
+        return cf->slots[slot];
+    return cf->vars ? ht_find(cf->vars, name) : NULL;
+}
+
+static void frame_set(struct fiz_callframe *cf, const char *name, int slot, struct fiz_value *value) {
+    void* v;
+    slot = find_slot(cf, name, slot);
+    if(slot >= 0) {
+        if(cf->slots[slot])
+            free_var(name, cf->slots[slot]);
+        cf->slots[slot] = value;
+        return;
+    }
+    if(!cf->vars)
+        cf->vars = ht_create(VARS_HASH_SIZE);
+    /* Delete the var if it's already defined */
+    v = ht_delete(cf->vars, name);
+    if(v) free_var(name, v);
+    /* Insert the value into the variable list */
+    ht_insert(cf->vars, name, value);
+}
+
+/* 'slot' is the slot of the variable in the current callframe, or -1 if unknown */
+static struct fiz_value *get_var_value(Fiz *F, const char *name, int slot) {
     assert(F->callframe);
-    const char* found = ht_find(F->callframe->vars, name);
+    struct fiz_value* found = frame_get(F->callframe, name, slot);
     if (found == &global_var_marker)
-        found = ht_find(fiz_global_callframe(F)->vars, name);
+        found = frame_get(fiz_global_callframe(F), name, -1);
     return found;
 }
 
-void fiz_set_var(Fiz *F, const char *name, const char *value) {
+const char *fiz_get_var(Fiz *F, const char *name) {
+    struct fiz_value *v = get_var_value(F, name, -1);
+    return v ? val_str(v) : NULL;
+}
+
+/*
+ * The number that expr reads a value as. A string is only parsed the
+ * first time; the number is then kept in 'd', which holds any int
+ * exactly. The cached integer of a string is atoi()'s, which would
+ * accept things like "3x", so it is only used for values that were
+ * created from integers.
+ */
+const char *fiz_get_var_number(Fiz *F, const char *name, Expr_Number *n) {
+    struct fiz_value *v = get_var_value(F, name, -1);
+    const char *err;
+    if(!v)
+        return "unknown variable";
+    if((v->flags & VAL_DOUBLE) && (Expr_Number)v->d == v->d) {
+        *n = (Expr_Number)v->d;
+        return NULL;
+    }
+    if(!v->str && (v->flags & VAL_INT)) {
+        *n = v->i;
+        return NULL;
+    }
+    if((err = expr_to_number(val_str(v), n)) != NULL)
+        return err;
+    v->d = *n;
+    v->flags |= VAL_DOUBLE;
+    return NULL;
+}
+
+static void set_var_value(Fiz *F, const char *name, int slot, struct fiz_value *value) {
     assert(F->callframe);
     /* Get the current value to check if it's not a global */
-    const char* current = ht_find(F->callframe->vars, name);
-    struct fiz_callframe* callframe;
+    struct fiz_value* current = frame_get(F->callframe, name, slot);
     if(current == &global_var_marker)
-    {
-        callframe = fiz_global_callframe(F);
-    }
+        frame_set(fiz_global_callframe(F), name, -1, value);
     else
-    {
-        /* Delete the var if it's already defined */
-        void* v = ht_delete(F->callframe->vars, name);
-        if(v) free_var(name, v);
-        callframe = F->callframe;
-    }
-    /* Insert the value into the variable list */
-    ht_insert(callframe->vars, name, strdup(value));
+        frame_set(F->callframe, name, slot, value);
+}
+
+void fiz_set_var(Fiz *F, const char *name, const char *value) {
+    set_var_value(F, name, -1, val_new(value));
+}
+
+/* Appends to the variable 'name', creating it if needed, and returns its new value */
+static struct fiz_value *append_var(Fiz *F, const char *name, int slot, const char *s, size_t len) {
+    struct fiz_value *v = get_var_value(F, name, slot), *n;
+    if(!v)
+        set_var_value(F, name, slot, v = val_new(""));
+    /* Commands like append return the string, but the return value
+     * doesn't need to hold on to it when the string is changed again */
+    if(v == F->return_val)
+        set_return_value(F, val_new(""));
+    n = val_append(v, s, len);
+    if(n != v)
+        set_var_value(F, name, slot, n);
+    return n;
+}
+
+void fiz_append_var(Fiz *F, const char *name, const char *s) {
+    append_var(F, name, -1, s, strlen(s));
 }
 
 void fiz_set_var_ex(Fiz *F, const char *name, const char *fmt, ...) {
@@ -595,6 +3244,30 @@ void fiz_set_var_ex(Fiz *F, const char *name, const char *fmt, ...) {
     fiz_set_var(F, name, buffer);
 }
 
+void fiz_set_var_list(Fiz *F, const char *name, int argc, const char **argv) {
+    struct fiz_list *l = list_new(argc);
+    int i;
+    for(i = 0; i < argc; i++)
+        list_append(l, val_new(argv[i]));
+    set_var_value(F, name, -1, val_new_list(l));
+}
+
+char *fiz_make_list(int argc, const char **argv) {
+    size_t len = 0;
+    char *s, *p;
+    int i;
+    for(i = 0; i < argc; i++)
+        len += list_quote(argv[i], NULL) + 1;
+    p = s = malloc(len + 1);
+    for(i = 0; i < argc; i++) {
+        if(i > 0)
+            *p++ = ' ';
+        p += list_quote(argv[i], p);
+    }
+    *p = '\0';
+    return s;
+}
+
 void fiz_add_func(Fiz *F, const char *name, fiz_func fun, void *data) {
     struct proc *p;
     p = malloc(sizeof *p);
@@ -602,35 +3275,52 @@ void fiz_add_func(Fiz *F, const char *name, fiz_func fun, void *data) {
     p->fun.cfun.fun = fun;
     p->fun.cfun.data = data;
     ht_insert(F->commands, name, p);
+    F->commands_epoch++;
+}
+
+static struct dict *new_dict(Fiz *F, const char *name) {
+    struct dict *d = malloc(sizeof *d);
+    d->hash = ht_create(16);
+    d->list = NULL;
+    ht_insert(F->dicts, name, d);
+    return d;
 }
 
 void fiz_dict_insert(Fiz *F, const char *dict, const char *key, const char *value) {
-    char *v;
-    struct hash_tbl *d = ht_find(F->dicts, dict);
-    if(!d) {
-        /* Create the dict if it doesn't exist */
-        d = ht_create(16);
-        ht_insert(F->dicts, dict, d);
+    struct fiz_value *v;
+    struct dict *d = ht_find(F->dicts, dict);
+    if(!d) /* Create the dict if it doesn't exist */
+        d = new_dict(F, dict);
+    if(d->list) {
+        v = sl_find(d->list, key);
+        sl_insert(d->list, key, val_new(value));
+    } else {
+        /* Replace the value in place, so that the key keeps its position */
+        v = ht_find(d->hash, key);
+        ht_insert(d->hash, key, val_new(value));
     }
-    /* Delete the key if it's already in the dict */
-    v = ht_delete(d, key);
-    if(v) free(v);
-    /* Insert the value into the dict */
-    ht_insert(d, key, strdup(value));
+    if(v) val_release(v);
 }
 
 char *fiz_substitute(Fiz *F, const char *s) {
     FizParser FI;
-    char *subs;
-    /* Misuse parse_quote to perform the substitution */
-    init_parser(&FI, s);
-    if(parse_quote(F, &FI, '\0') != FI_WORD) {
-        destroy_parser(&FI);
-        return NULL;
-    }
-    subs = strdup(FI.word);
+    struct fiz_word w = {NULL, 0, 0};
+    struct compile_ctx ctx = {0, 0, 0};
+    struct codegen G;
+    struct fiz_bytecode *C = new_code(&G, s);
+    char *result = NULL;
+    /* Misuse compile_quote to perform the substitution */
+    init_parser(&FI, s, &w, &ctx);
+    compile_quote(&FI, '\0');
+    flush_lit(&FI);
     destroy_parser(&FI);
-    return subs;
+    G.src = NULL;
+    gen_word(&G, &w);
+    free_word(&w);
+    if(vm_run(F, C, &result) != FIZ_OK)
+        result = NULL;
+    free_code(C);
+    return result;
 }
 
 /*====================================================================
@@ -647,26 +3337,151 @@ void fiz_dict_insert_ex(Fiz *F, const char *dict, const char *key, const char *f
 }
 
 const char *fiz_dict_find(Fiz *F, const char *dict, const char *key) {
-    struct hash_tbl *d = ht_find(F->dicts, dict);
+    struct fiz_value *v;
+    struct dict *d = ht_find(F->dicts, dict);
     if(!d) /* Undefined dictionary */
         return NULL;
-    return ht_find(d, key);
+    v = d->list ? sl_find(d->list, key) : ht_find(d->hash, key);
+    return v ? val_str(v) : NULL;
 }
 
 void fiz_dict_delete(Fiz *F, const char *dict, const char *key) {
-    char *v;
-    struct hash_tbl *d = ht_find(F->dicts, dict);
+    struct fiz_value *v;
+    struct dict *d = ht_find(F->dicts, dict);
     if(!d) /* Undefined dictionary */
         return;
-    v = ht_delete(d, key);
-    if(v) free(v);
+    v = d->list ? sl_delete(d->list, key) : ht_delete(d->hash, key);
+    if(v) val_release(v);
 }
 
 const char *fiz_dict_next(Fiz *F, const char *dict, const char *key) {
-    struct hash_tbl *d = ht_find(F->dicts, dict);
+    struct sl_node *n;
+    struct dict *d = ht_find(F->dicts, dict);
+    if(!d) /* Undefined dictionary */
+        return NULL;
+    if(!d->list)
+        return ht_next(d->hash, key);
+    n = sl_seek(d->list, key, 1);
+    return n ? n->key : NULL;
+}
+
+int fiz_dict_iterate(Fiz *F, const char *dict, Fiz_Dict_Cursor *cursor, const char **key, const char **value) {
+    void *v;
+    int found;
+    struct sl_cursor c;
+    struct dict *d = ht_find(F->dicts, dict);
     if(!d) /* Undefined dictionary */
+        return 0;
+    if(d->list) {
+        c.next = cursor->next;
+        c.version = cursor->version;
+        c.started = cursor->started;
+        c.key = cursor->key;
+        c.size = cursor->size;
+        found = sl_iterate(d->list, &c, key, &v);
+        cursor->next = c.next;
+        cursor->version = c.version;
+        cursor->started = c.started;
+        cursor->key = c.key;
+        cursor->size = c.size;
+    } else
+        found = ht_iterate(d->hash, &cursor->index, key, &v);
+    if(!found)
+        return 0;
+    if(value)
+        *value = val_str(v);
+    return 1;
+}
+
+void fiz_dict_cursor_done(Fiz_Dict_Cursor *cursor) {
+    free(cursor->key);
+    cursor->key = NULL;
+    cursor->size = 0;
+    cursor->next = NULL;
+}
+
+void fiz_dict_ordered(Fiz *F, const char *dict) {
+    const char *key;
+    void *v;
+    int cursor = 0;
+    struct dict *d = ht_find(F->dicts, dict);
+    if(!d)
+        d = new_dict(F, dict);
+    if(d->list)
+        return;
+    /* Move the entries into a skip list */
+    d->list = sl_create();
+    while(ht_iterate(d->hash, &cursor, &key, &v))
+        sl_insert(d->list, key, v);
+    ht_free(d->hash, NULL);
+    d->hash = NULL;
+}
+
+int fiz_dict_is_ordered(Fiz *F, const char *dict) {
+    struct dict *d = ht_find(F->dicts, dict);
+    return d && d->list;
+}
+
+const char *fiz_dict_min(Fiz *F, const char *dict) {
+    struct dict *d = ht_find(F->dicts, dict);
+    if(!d || !d->list || !d->list->head[0])
+        return NULL;
+    return d->list->head[0]->key;
+}
+
+const char *fiz_dict_max(Fiz *F, const char *dict) {
+    struct dict *d = ht_find(F->dicts, dict);
+    if(!d || !d->list || !d->list->last)
         return NULL;
-    return ht_next(d, key);
+    return d->list->last->key;
+}
+
+Fiz_Code fiz_dict_range(Fiz *F, const char *dict, const char *from, const char *to, fiz_dict_func fun, void *data) {
+    char lbuf[64], *buf = lbuf;
+    size_t len, size = sizeof lbuf;
+    unsigned int version;
+    struct sl_node *n;
+    Fiz_Code rc = FIZ_OK;
+    struct dict *d = ht_find(F->dicts, dict);
+    if(!d) /* Undefined dictionary */
+        return FIZ_OK;
+    if(!d->list) {
+        const char *k;
+        void *v;
+        int cursor = 0;
+        if(from || to) {
+            fiz_set_return_ex(F, "dict %s is not ordered", dict);
+            return FIZ_ERROR;
+        }
+        /* 'fun' might make the dict ordered */
+        while(d->hash && ht_iterate(d->hash, &cursor, &k, &v))
+            if((rc = fun(F, k, val_str(v), data)) != FIZ_OK)
+                break;
+        return rc;
+    }
+    n = sl_seek(d->list, from, 0);
+    while(n && (!to || strcmp(n->key, to) <= 0)) {
+        /* Remember the key, in case 'fun' deletes it */
+        len = strlen(n->key) + 1;
+        if(len > size) {
+            if(buf != lbuf)
+                free(buf);
+            size = len;
+            buf = malloc(size);
+        }
+        memcpy(buf, n->key, len);
+        version = d->list->version;
+        if((rc = fun(F, n->key, val_str(n->value), data)) != FIZ_OK)
+            break;
+        /* If keys were inserted or deleted, 'n' can't be trusted */
+        if(d->list->version == version)
+            n = n->next[0];
+        else
+            n = sl_seek(d->list, buf, 1);
+    }
+    if(buf != lbuf)
+        free(buf);
+    return rc;
 }
 
 /*====================================================================
@@ -703,24 +3518,58 @@ static Fiz_Code bif_set(Fiz *F, int argc, char **argv, void *data) {
     return FIZ_OK;
 }
 
+/* Compiles the body of 'p' and adds it as command 'name', replacing
+ * any command of that name */
+static void define_proc(Fiz *F, const char *name, struct proc *p) {
+    void *v = ht_delete(F->commands, name);
+    if(v) free_proc(name, v);
+    p->fun.proc.code = compile_proc(p);
+    ht_insert(F->commands, name, p);
+    F->commands_epoch++;
+}
+
 static Fiz_Code bif_proc(Fiz *F, int argc, char **argv, void *data) {
     struct proc *p;
+    const char *c, *n;
     if(argc != 4)
         return fiz_argc_error(F, argv[0], 4);
-    const char* const name = argv[1];
-    /* Delete the proc if it's already defined */
-    void* v = ht_delete(F->commands, name);
-    if(v) free_proc(name, v);
-    /* Insert the proc into the commands list */
     p = malloc(sizeof *p);
     p->type = FIZ_PROC;
-    p->fun.proc.params = strdup(argv[2]);
+    p->fun.proc.params = NULL;
+    p->fun.proc.nparams = 0;
+    for(n = argv[2]; *n;) {
+        while(n[0] && isspace((int)n[0])) n++;
+        if(!n[0]) break;
+        c = n;
+        while(n[0] && !isspace((int)n[0])) n++;
+        p->fun.proc.params = realloc(p->fun.proc.params, (p->fun.proc.nparams + 1) * sizeof *p->fun.proc.params);
+        p->fun.proc.params[p->fun.proc.nparams++] = strndup(c, n - c);
+    }
     p->fun.proc.body = strdup(argv[3]);
-    ht_insert(F->commands, name, p);
-    fiz_set_return(F, name);
+    define_proc(F, argv[1], p);
+    fiz_set_return(F, argv[1]);
     return FIZ_OK;
 }
 
+void fiz_copy_procs(Fiz *to, Fiz *from) {
+    const char *name;
+    void *v;
+    int cursor = 0, i;
+    while(ht_iterate(from->commands, &cursor, &name, &v)) {
+        struct proc *q = v, *p;
+        if(q->type != FIZ_PROC)
+            continue;
+        p = malloc(sizeof *p);
+        p->type = FIZ_PROC;
+        p->fun.proc.nparams = q->fun.proc.nparams;
+        p->fun.proc.params = malloc(q->fun.proc.nparams * sizeof *p->fun.proc.params);
+        for(i = 0; i < q->fun.proc.nparams; i++)
+            p->fun.proc.params[i] = strdup(q->fun.proc.params[i]);
+        p->fun.proc.body = strdup(q->fun.proc.body);
+        define_proc(to, name, p);
+    }
+}
+
 static Fiz_Code bif_return(Fiz *F, int argc, char **argv, void *data) {
     if(argc != 2)
         return fiz_argc_error(F, argv[0], 2);
@@ -737,7 +3586,7 @@ static Fiz_Code bif_if(Fiz *F, int argc, char **argv, void *data) {
     }
     if(fiz_exec(F, argv[1]) != FIZ_OK)
         return FIZ_ERROR;
-    if(atoi(fiz_get_return(F)))
+    if(fiz_get_return_int(F))
         return fiz_exec(F, argv[2]);
     if(argc == 5)
         return fiz_exec(F, argv[4]);
@@ -746,19 +3595,168 @@ static Fiz_Code bif_if(Fiz *F, int argc, char **argv, void *data) {
 
 static Fiz_Code bif_while(Fiz *F, int argc, char **argv, void *data) {
     Fiz_Code fc = FIZ_OK;
+    struct fiz_bytecode *cond, *body;
     if(argc != 3)
         return fiz_argc_error(F, argv[0], 3);
+    /* Compile the condition and body once for all the iterations */
+    cond = compile_code(argv[1]);
+    body = compile_code(argv[2]);
     for(;;) {
-        if(fiz_exec(F, argv[1]) != FIZ_OK)
+        if(vm_run(F, cond, NULL) != FIZ_OK) {
+            fc = FIZ_ERROR;
+            break;
+        }
+        if(!fiz_get_return_int(F)) break;
+        fc = vm_run(F, body, NULL);
+        if(fc == FIZ_BREAK) break;
+        else if(fc == FIZ_ERROR || fc == FIZ_OOM || fc == FIZ_RETURN) break;
+    }
+    free_code(cond);
+    free_code(body);
+    return (fc == FIZ_ERROR || fc == FIZ_OOM || fc == FIZ_RETURN) ? fc : FIZ_OK;
+}
+
+/* Parses a bound of for var from A to B, which must be a whole integer */
+static int for_bound(Fiz *F, const char *s, int *n) {
+    char *end;
+    long l = strtol(s, &end, 10);
+    if(end == s || *end || l < INT_MIN || l > INT_MAX) {
+        fiz_set_return_ex(F, "expected integer but got '%s'", s);
+        return 0;
+    }
+    *n = (int)l;
+    return 1;
+}
+
+/* Replaces the bound '*v' of a for loop with a value made from its
+ * integer, so that the next iterations don't have to check it again */
+static int for_bound_value(Fiz *F, struct fiz_value **v) {
+    int n;
+    if(!(*v)->str && ((*v)->flags & VAL_INT))
+        return 1;
+    if(!for_bound(F, val_str(*v), &n))
+        return 0;
+    val_release(*v);
+    *v = val_new_int(n);
+    return 1;
+}
+
+/* for var from A to B {body}, when it isn't compiled inline */
+static Fiz_Code for_count(Fiz *F, const char *name, int from, int to, const char *text) {
+    Fiz_Code fc = FIZ_OK;
+    struct fiz_bytecode *body = compile_code(text);
+    int i;
+    for(i = from; i <= to; i++) {
+        set_var_value(F, name, -1, val_new_int(i));
+        fc = vm_run(F, body, NULL);
+        if(fc == FIZ_BREAK) break;
+        else if(fc == FIZ_ERROR || fc == FIZ_OOM || fc == FIZ_RETURN) break;
+        if(i == INT_MAX) break;
+    }
+    free_code(body);
+    return (fc == FIZ_ERROR || fc == FIZ_OOM || fc == FIZ_RETURN) ? fc : FIZ_OK;
+}
+
+static Fiz_Code bif_for(Fiz *F, int argc, char **argv, void *data) {
+    Fiz_Code fc;
+    struct fiz_bytecode *init, *cond, *step, *body;
+    if(argc == 7 && !strcmp(argv[2], "from") && !strcmp(argv[4], "to")) {
+        int from, to;
+        if(!for_bound(F, argv[3], &from) || !for_bound(F, argv[5], &to))
             return FIZ_ERROR;
-        if(!atoi(fiz_get_return(F))) break;
-        fc = fiz_exec(F, argv[2]);
+        return for_count(F, argv[1], from, to, argv[6]);
+    }
+    if(argc != 5)
+        return fiz_argc_error(F, argv[0], 5);
+    init = compile_code(argv[1]);
+    fc = vm_run(F, init, NULL);
+    free_code(init);
+    if(fc != FIZ_OK)
+        return fc;
+    cond = compile_code(argv[2]);
+    step = compile_code(argv[3]);
+    body = compile_code(argv[4]);
+    for(;;) {
+        if(vm_run(F, cond, NULL) != FIZ_OK) {
+            fc = FIZ_ERROR;
+            break;
+        }
+        if(!fiz_get_return_int(F)) break;
+        fc = vm_run(F, body, NULL);
         if(fc == FIZ_BREAK) break;
-        else if(fc == FIZ_ERROR || fc == FIZ_OOM) return fc;
+        else if(fc == FIZ_ERROR || fc == FIZ_OOM || fc == FIZ_RETURN) break;
+        fc = vm_run(F, step, NULL);
+        if(fc != FIZ_OK && fc != FIZ_CONTINUE) break;
+    }
+    free_code(cond);
+    free_code(step);
+    free_code(body);
+    return (fc == FIZ_ERROR || fc == FIZ_OOM || fc == FIZ_RETURN) ? fc : FIZ_OK;
+}
+
+static Fiz_Code bif_switch(Fiz *F, int argc, char **argv, void *data) {
+    enum switch_mode mode = SWITCH_EXACT;
+    struct fiz_list *l;
+    const char *pattern;
+    Fiz_Code fc = FIZ_OK;
+    int i, k;
+    for(i = 1; i < argc - 2; i++) {
+        if(!(k = switch_option(argv[i], &mode))) {
+            fiz_set_return_ex(F, "bad switch option '%s'", argv[i]);
+            return FIZ_ERROR;
+        } else if(k == 2) {
+            i++;
+            break;
+        }
+    }
+    if(argc < 3 || i != argc - 2)
+        return fiz_argc_error(F, argv[0], i + 2);
+    if(!(l = list_parse(argv[argc - 1]))) {
+        fiz_set_return_ex(F, "malformed list '%s'", argv[argc - 1]);
+        return FIZ_ERROR;
+    }
+    if(l->len % 2) {
+        fiz_set_return(F, "extra switch pattern with no body");
+        list_free(l);
+        return FIZ_ERROR;
+    }
+    for(i = 0; i < l->len; i += 2) {
+        pattern = val_str(l->items[i]);
+        if((i == l->len - 2 && !strcmp(pattern, "default")) || switch_match(mode, pattern, argv[argc - 2]))
+            break;
+    }
+    /* Arms with a body of "-" use the body of the next arm */
+    while(i < l->len && !strcmp(val_str(l->items[i + 1]), "-"))
+        i += 2;
+    if(i < l->len)
+        fc = fiz_exec(F, val_str(l->items[i + 1]));
+    else if(l->len && !strcmp(val_str(l->items[l->len - 1]), "-")) {
+        fiz_set_return_ex(F, "no body specified for pattern '%s'", val_str(l->items[l->len - 2]));
+        fc = FIZ_ERROR;
+    } else
+        fiz_set_return(F, "");
+    list_free(l);
+    return fc;
+}
+
+static Fiz_Code incr_var(Fiz *F, const char *name, int slot, int by) {
+    struct fiz_value *val = get_var_value(F, name, slot);
+    if(!val) {
+        fiz_set_return_ex(F, "%s not found", name);
+        return FIZ_ERROR;
     }
+    val = val_new_int(val_int(val) + by);
+    set_var_value(F, name, slot, val_ref(val));
+    set_return_value(F, val);
     return FIZ_OK;
 }
 
+static Fiz_Code bif_incr(Fiz *F, int argc, char **argv, void *data) {
+    if(argc != 2)
+        return fiz_argc_error(F, argv[0], 2);
+    return incr_var(F, argv[1], -1, strcmp(argv[0], "decr") ? 1 : -1);
+}
+
 static Fiz_Code bif_cntrl(Fiz *F, int argc, char **argv, void *data) {
     if(argc != 1)
         return fiz_argc_error(F, argv[0], 1);
@@ -776,24 +3774,405 @@ static Fiz_Code bif_global(Fiz *F, int argc, char **argv, void *data) {
         fiz_set_return(F, "Cannot call global from global context");
         return FIZ_ERROR;
     }
-    /* Delete the var if it's already defined */
-    void* v = ht_delete(F->callframe->vars, name);
-    if(v) free_var(name, v);
-    /* Insert flag marking this as a global */
-    ht_insert(F->callframe->vars, name, &global_var_marker);
+    /* Mark the variable as a global, replacing it if it's already defined */
+    frame_set(F->callframe, name, -1, &global_var_marker);
     fiz_set_return_ex(F, "%d", 1);
     return FIZ_OK;
 }
 
+/*
+ * A coroutine runs a proc in a VM of its own, which yield stops and
+ * resume starts again. The callframes of the coroutine's procs sit on
+ * top of the global callframe.
+ */
+struct fiz_coroutine {
+    char *name;
+    struct fiz_vm *vm;
+    int running;
+    struct fiz_coroutine *next;
+};
+
+static Fiz_Code coroutine_cmd(Fiz *F, int argc, char **argv, void *data);
+
+/* The coroutine that command 'p' resumes, if it is one */
+static struct fiz_coroutine *coroutine_of(struct proc *p) {
+    if(p && p->type == FIZ_CFUN && p->fun.cfun.fun == coroutine_cmd)
+        return p->fun.cfun.data;
+    return NULL;
+}
+
+static struct fiz_coroutine *find_coroutine(Fiz *F, const char *name) {
+    return coroutine_of(ht_find(F->commands, name));
+}
+
+/* Discards coroutine 'co' along with the frames it still has */
+static void free_coroutine(Fiz *F, struct fiz_coroutine *co) {
+    struct fiz_coroutine **c;
+    for(c = &F->coroutines; *c != co; c = &(*c)->next)
+        ;
+    *c = co->next;
+    vm_discard(F, co->vm);
+    free(co->name);
+    free(co);
+}
+
+/* Deletes the command of a coroutine that has finished, then the coroutine */
+static void end_coroutine(Fiz *F, struct fiz_coroutine *co) {
+    struct proc *p = ht_find(F->commands, co->name);
+    if(coroutine_of(p) == co) {
+        ht_delete(F->commands, co->name);
+        free(p);
+        F->commands_epoch++;
+    }
+    free_coroutine(F, co);
+}
+
+static void free_coroutines(Fiz *F) {
+    while(F->coroutines)
+        free_coroutine(F, F->coroutines);
+}
+
+/*
+ * Runs coroutine 'co' until it yields or finishes. 'value' becomes the
+ * result of the yield it was suspended in.
+ */
+static Fiz_Code resume_coroutine(Fiz *F, struct fiz_coroutine *co, struct fiz_value *value) {
+    struct fiz_callframe *cf = F->callframe;
+    struct fiz_vm *outer = F->vm;
+    Fiz_Code rc;
+
+    if(co->running) {
+        fiz_set_return_ex(F, "coroutine '%s' is already running", co->name);
+        return FIZ_ERROR;
+    }
+    if(value)
+        set_return_value(F, val_ref(value));
+    F->callframe = co->vm->callframe;
+    co->vm->meter = outer ? outer->meter : NULL;
+    F->vm = co->vm;
+    co->running = 1;
+    rc = vm_exec(F, co->vm);
+    co->running = 0;
+    F->vm = outer;
+    if(rc == FIZ_YIELDED) {
+        co->vm->callframe = F->callframe;
+        F->callframe = cf;
+        return FIZ_OK;
+    }
+    rc = vm_pop(F, co->vm, rc);
+    F->callframe = cf;
+    end_coroutine(F, co);
+    return rc;
+}
+
+static Fiz_Code resume_with(Fiz *F, struct fiz_coroutine *co, const char *value) {
+    struct fiz_value *v = val_new(value);
+    Fiz_Code rc = resume_coroutine(F, co, v);
+    val_release(v);
+    return rc;
+}
+
+/* The command of a coroutine resumes it */
+static Fiz_Code coroutine_cmd(Fiz *F, int argc, char **argv, void *data) {
+    if(argc > 2)
+        return fiz_argc_error(F, argv[0], 2);
+    return resume_with(F, data, argc == 2 ? argv[1] : "");
+}
+
+static Fiz_Code bif_coroutine(Fiz *F, int argc, char **argv, void *data) {
+    struct fiz_value **vals;
+    struct fiz_callframe *cf = F->callframe;
+    struct fiz_coroutine *co;
+    struct proc *p;
+    Fiz_Code rc;
+    void *v;
+    int i;
+
+    if(argc < 3)
+        return fiz_argc_error(F, argv[0], 3);
+    p = ht_find(F->commands, argv[2]);
+    if(!p || p->type != FIZ_PROC) {
+        fiz_set_return_ex(F, "'%s' is not a proc", argv[2]);
+        return FIZ_ERROR;
+    }
+    if((co = find_coroutine(F, argv[1])) && co->running) {
+        fiz_set_return_ex(F, "coroutine '%s' is already running", co->name);
+        return FIZ_ERROR;
+    }
+
+    co = calloc(1, sizeof *co);
+    co->vm = vm_get(F);
+    co->vm->co = co;
+    /* The proc gets the arguments after its name */
+    vals = fiz_alloc_temp(F, (argc - 2) * sizeof *vals);
+    for(i = 2; i < argc; i++)
+        vals[i - 2] = val_new(argv[i]);
+    F->callframe = fiz_global_callframe(F);
+    rc = bind_args(F, p, argc - 2, vals);
+    for(i = 2; i < argc; i++)
+        val_release(vals[i - 2]);
+    if(rc != FIZ_OK) {
+        F->callframe = cf;
+        vm_put(F, co->vm);
+        free(co);
+        return rc;
+    }
+    vm_push(co->vm, p->fun.proc.code, FRAME_PROC);
+    co->vm->callframe = F->callframe;
+    F->callframe = cf;
+
+    /* A coroutine replaces the command with the same name */
+    if((v = ht_delete(F->commands, argv[1]))) {
+        struct fiz_coroutine *old = coroutine_of(v);
+        free_proc(argv[1], v);
+        if(old)
+            free_coroutine(F, old);
+    }
+    co->name = strdup(argv[1]);
+    co->next = F->coroutines;
+    F->coroutines = co;
+    fiz_add_func(F, co->name, coroutine_cmd, co);
+
+    /* Run it up to the first yield */
+    return resume_coroutine(F, co, NULL);
+}
+
+static Fiz_Code bif_yield(Fiz *F, int argc, char **argv, void *data) {
+    if(argc > 2)
+        return fiz_argc_error(F, argv[0], 2);
+    if(!F->vm || !F->vm->co) {
+        struct fiz_coroutine *co;
+        for(co = F->coroutines; co && !co->running; co = co->next)
+            ;
+        fiz_set_return(F, co ? "can't yield from inside a command implemented in C"
+                : "yield used outside of a coroutine");
+        return FIZ_ERROR;
+    }
+    fiz_set_return(F, argc == 2 ? argv[1] : "");
+    return FIZ_YIELDED;
+}
+
+static Fiz_Code bif_resume(Fiz *F, int argc, char **argv, void *data) {
+    struct fiz_coroutine *co;
+    if(argc != 2 && argc != 3)
+        return fiz_argc_error(F, argv[0], 3);
+    if(!(co = find_coroutine(F, argv[1]))) {
+        fiz_set_return_ex(F, "'%s' is not a coroutine", argv[1]);
+        return FIZ_ERROR;
+    }
+    return resume_with(F, co, argc == 3 ? argv[2] : "");
+}
+
+/* Runs a command that works on values with values made from 'argv' */
+static Fiz_Code bif_values(Fiz *F, int argc, char **argv, void *data) {
+    const struct bif *b = data;
+    struct arena_mark m = arena_mark(F->arena);
+    struct fiz_value **vals = arena_alloc(F->arena, argc * sizeof *vals);
+    Fiz_Code rc;
+    int i;
+    for(i = 0; i < argc; i++)
+        vals[i] = val_new(argv[i]);
+    rc = b->vfun(F, argc, vals, -1);
+    for(i = 0; i < argc; i++)
+        val_release(vals[i]);
+    arena_release(F->arena, m);
+    return rc;
+}
+
+/* The elements of a list argument, or NULL after setting an error */
+static struct fiz_list *list_arg(Fiz *F, struct fiz_value *v) {
+    struct fiz_list *l = val_list(v);
+    if(!l)
+        fiz_set_return_ex(F, "malformed list '%s'", val_str(v));
+    return l;
+}
+
+/* Gets an index into a list of 'len' elements from an argument */
+static int index_arg(Fiz *F, struct fiz_value *v, int len, int *index) {
+    /* The cached integer of a string is atoi()'s, which "end" would fool */
+    if(!v->str && (v->flags & VAL_INT)) {
+        *index = v->i;
+        return 1;
+    }
+    if(list_index(val_str(v), len, index))
+        return 1;
+    fiz_set_return_ex(F, "bad index '%s'", val_str(v));
+    return 0;
+}
+
+/*
+ * Returns the value of the variable 'name' so that its list can be
+ * changed in place, copying it first if anything else refers to it.
+ * A variable that doesn't exist is created if 'create' is set.
+ * Returns NULL after setting an error.
+ */
+static struct fiz_value *list_var(Fiz *F, const char *name, int slot, int create) {
+    struct fiz_value *v = get_var_value(F, name, slot), *copy;
+    struct fiz_list *l;
+    int i;
+    if(!v) {
+        if(!create) {
+            fiz_set_return_ex(F, "Unknown variable '%s'", name);
+            return NULL;
+        }
+        v = val_new_list(list_new(0));
+        set_var_value(F, name, slot, v);
+        return v;
+    }
+    if(!(l = list_arg(F, v)))
+        return NULL;
+    /* Commands like lappend return the list, but the return value
+     * doesn't need to hold on to it when the list is changed again */
+    if(v == F->return_val)
+        set_return_value(F, val_new(""));
+    if(v->refs > 1) {
+        copy = val_new_list(list_new(l->len));
+        for(i = 0; i < l->len; i++)
+            list_append(copy->list, val_ref(l->items[i]));
+        set_var_value(F, name, slot, copy);
+        v = copy;
+    }
+    return v;
+}
+
+static Fiz_Code vbif_list(Fiz *F, int argc, struct fiz_value **argv, int slot) {
+    struct fiz_list *l = list_new(argc - 1);
+    int i;
+    for(i = 1; i < argc; i++)
+        list_append(l, val_ref(argv[i]));
+    set_return_value(F, val_new_list(l));
+    return FIZ_OK;
+}
+
+static Fiz_Code vbif_lappend(Fiz *F, int argc, struct fiz_value **argv, int slot) {
+    struct fiz_value *v;
+    int i;
+    if(argc < 2)
+        return fiz_argc_error(F, val_str(argv[0]), 2);
+    if(!(v = list_var(F, val_str(argv[1]), slot, 1)))
+        return FIZ_ERROR;
+    for(i = 2; i < argc; i++)
+        list_append(v->list, val_ref(argv[i]));
+    val_list_changed(v);
+    set_return_value(F, val_ref(v));
+    return FIZ_OK;
+}
+
+static Fiz_Code vbif_lindex(Fiz *F, int argc, struct fiz_value **argv, int slot) {
+    struct fiz_list *l;
+    int i;
+    if(argc != 3)
+        return fiz_argc_error(F, val_str(argv[0]), 3);
+    if(!(l = list_arg(F, argv[1])) || !index_arg(F, argv[2], l->len, &i))
+        return FIZ_ERROR;
+    set_return_value(F, (i >= 0 && i < l->len) ? val_ref(l->items[i]) : val_new(""));
+    return FIZ_OK;
+}
+
+static Fiz_Code vbif_llength(Fiz *F, int argc, struct fiz_value **argv, int slot) {
+    struct fiz_list *l;
+    if(argc != 2)
+        return fiz_argc_error(F, val_str(argv[0]), 2);
+    if(!(l = list_arg(F, argv[1])))
+        return FIZ_ERROR;
+    set_return_value(F, val_new_int(l->len));
+    return FIZ_OK;
+}
+
+static Fiz_Code vbif_lrange(Fiz *F, int argc, struct fiz_value **argv, int slot) {
+    struct fiz_list *l, *r;
+    int first, last;
+    if(argc != 4)
+        return fiz_argc_error(F, val_str(argv[0]), 4);
+    if(!(l = list_arg(F, argv[1])) || !index_arg(F, argv[2], l->len, &first)
+            || !index_arg(F, argv[3], l->len, &last))
+        return FIZ_ERROR;
+    if(first < 0)
+        first = 0;
+    if(last >= l->len)
+        last = l->len - 1;
+    r = list_new(last >= first ? last - first + 1 : 0);
+    for(; first <= last; first++)
+        list_append(r, val_ref(l->items[first]));
+    set_return_value(F, val_new_list(r));
+    return FIZ_OK;
+}
+
+static Fiz_Code vbif_lset(Fiz *F, int argc, struct fiz_value **argv, int slot) {
+    struct fiz_value *v;
+    int i;
+    if(argc != 4)
+        return fiz_argc_error(F, val_str(argv[0]), 4);
+    if(!(v = list_var(F, val_str(argv[1]), slot, 0)) || !index_arg(F, argv[2], v->list->len, &i))
+        return FIZ_ERROR;
+    if(i < 0 || i >= v->list->len) {
+        fiz_set_return_ex(F, "list index '%s' out of range", val_str(argv[2]));
+        return FIZ_ERROR;
+    }
+    val_release(v->list->items[i]);
+    v->list->items[i] = val_ref(argv[3]);
+    val_list_changed(v);
+    set_return_value(F, val_ref(v));
+    return FIZ_OK;
+}
+
+static Fiz_Code vbif_foreach(Fiz *F, int argc, struct fiz_value **argv, int slot) {
+    Fiz_Code fc = FIZ_OK;
+    struct fiz_bytecode *body;
+    struct fiz_list *l;
+    const char *name;
+    int i;
+    if(argc != 4)
+        return fiz_argc_error(F, val_str(argv[0]), 4);
+    /* The caller holds on to the list, so the body can't change it */
+    if(!(l = list_arg(F, argv[2])))
+        return FIZ_ERROR;
+    name = val_str(argv[1]);
+    body = compile_code(val_str(argv[3]));
+    for(i = 0; i < l->len; i++) {
+        set_var_value(F, name, slot, val_ref(l->items[i]));
+        fc = vm_run(F, body, NULL);
+        if(fc == FIZ_BREAK) break;
+        else if(fc == FIZ_ERROR || fc == FIZ_OOM || fc == FIZ_RETURN) break;
+    }
+    free_code(body);
+    return (fc == FIZ_ERROR || fc == FIZ_OOM || fc == FIZ_RETURN) ? fc : FIZ_OK;
+}
+
+static Fiz_Code vbif_append(Fiz *F, int argc, struct fiz_value **argv, int slot) {
+    const char *name;
+    struct fiz_value *v;
+    int i;
+    if(argc < 2)
+        return fiz_argc_error(F, val_str(argv[0]), 2);
+    name = val_str(argv[1]);
+    v = append_var(F, name, slot, "", 0);
+    for(i = 2; i < argc; i++)
+        v = append_var(F, name, slot, val_str(argv[i]), strlen(val_str(argv[i])));
+    set_return_value(F, val_ref(v));
+    return FIZ_OK;
+}
+
 static void add_bifs(Fiz *F) {
+    int i;
     fiz_add_func(F, "set", bif_set, NULL);
     fiz_add_func(F, "proc", bif_proc, NULL);
     fiz_add_func(F, "return", bif_return, NULL);
     fiz_add_func(F, "if", bif_if, NULL);
     fiz_add_func(F, "while", bif_while, NULL);
+    fiz_add_func(F, "for", bif_for, NULL);
+    fiz_add_func(F, "switch", bif_switch, NULL);
     fiz_add_func(F, "break", bif_cntrl, NULL);
     fiz_add_func(F, "continue", bif_cntrl, NULL);
+    fiz_add_func(F, "incr", bif_incr, NULL);
+    fiz_add_func(F, "decr", bif_incr, NULL);
     fiz_add_func(F, "global", bif_global, NULL);
+    fiz_add_func(F, "coroutine", bif_coroutine, NULL);
+    fiz_add_func(F, "yield", bif_yield, NULL);
+    fiz_add_func(F, "resume", bif_resume, NULL);
+    for(i = 0; bifs[i].name; i++)
+        if(bifs[i].vfun)
+            fiz_add_func(F, bifs[i].name, bif_values, (void *)&bifs[i]);
 }
 
 
@@ -8,8 +8,21 @@
  *-
  */
 
+#ifndef FIZ_H
+#define FIZ_H
+
+#include <stddef.h>
+
 struct hash_tbl;
 struct fiz_callframe;
+struct fiz_value;
+struct fiz_bytecode;
+struct fiz_command;
+struct fiz_arena;
+struct expr;
+struct expr_cache;
+struct fiz_vm;
+struct fiz_coroutine;
 
 struct fiz;
 typedef void (*Fiz_Abort_func)(struct fiz* F, void* data);
@@ -25,24 +38,56 @@ typedef struct fiz {
 	struct hash_tbl *commands;
 	struct hash_tbl *dicts;
 	struct fiz_callframe *callframe;
-	char *return_val;
+	struct fiz_value *return_val;
 	char const* last_statement_begin;
 	char const* last_statement_end;
 	int abort;
 	Fiz_Abort_func abort_func;
 	void* abort_func_data;
+	unsigned int commands_epoch;
+	int max_depth;
+	int nesting;
+	struct fiz_arena *arena;
+	struct expr_cache *expr_cache;
+	struct fiz_vm *vm;
+	struct fiz_vm *free_vms;
+	struct fiz_coroutine *coroutines;
+	struct fiz_vm *suspended;
 } Fiz;
 
-/*@ typedef enum fiz_code {FIZ_OK, FIZ_ERROR, FIZ_OOM, FIZ_RETURN, FIZ_CONTINUE, FIZ_BREAK} Fiz_Code;
- *# Values that can be returned by functions implementing the various commands.
+/*@ typedef enum fiz_code {FIZ_OK, FIZ_ERROR, FIZ_OOM, FIZ_RETURN, FIZ_CONTINUE, FIZ_BREAK, FIZ_YIELDED} Fiz_Code;
+ *# Values that can be returned by functions implementing the various commands.\n
+ *# {{FIZ_YIELDED}} means that a script was stopped part of the way through
+ *# by {{fiz_exec_budget()}}, and can be carried on later.
  */
-typedef enum fiz_code {FIZ_OK, FIZ_ERROR, FIZ_OOM, FIZ_RETURN, FIZ_CONTINUE, FIZ_BREAK} Fiz_Code;
+typedef enum fiz_code {FIZ_OK, FIZ_ERROR, FIZ_OOM, FIZ_RETURN, FIZ_CONTINUE, FIZ_BREAK, FIZ_YIELDED} Fiz_Code;
 
 /*@ typedef Fiz_Code (*fiz_func)(Fiz *f, int argc, char **argv, void *data);
- *# Prototype for C-functions that can be added to the interpreter.
+ *# Prototype for C-functions that can be added to the interpreter.\n
+ *# The strings in {{argv}} belong to the interpreter and must not be modified.
  */
 typedef Fiz_Code (*fiz_func)(Fiz *f, int argc, char **argv, void *data);
 
+/*@ typedef Fiz_Code (*fiz_dict_func)(Fiz *F, const char *key, const char *value, void *data);
+ *# Prototype for the functions that {{fiz_dict_range()}} calls for each
+ *# entry of a dictionary.
+ */
+typedef Fiz_Code (*fiz_dict_func)(Fiz *F, const char *key, const char *value, void *data);
+
+/*@ typedef struct fiz_dict_cursor Fiz_Dict_Cursor;
+ *# Keeps track of the position of {{fiz_dict_iterate()}} in a dictionary.\n
+ *# Set all its fields to 0, as in {{Fiz_Dict_Cursor c = {0};}}, before the
+ *# first call. The fields are used by the interpreter only.
+ */
+typedef struct fiz_dict_cursor {
+	int index;
+	int started;
+	void *next;
+	unsigned int version;
+	char *key;
+	size_t size;
+} Fiz_Dict_Cursor;
+
 /*@ Fiz *fiz_create();
  *# Creates a new interpreter structure.
  */
@@ -76,12 +121,125 @@ void fiz_abort(Fiz *F);
  */
 Fiz_Code fiz_exec(Fiz *F, const char *str);
 
+/*@ typedef struct fiz_bytecode Fiz_Compiled
+ *# A script that has been compiled with {{fiz_compile()}}.
+ */
+typedef struct fiz_bytecode Fiz_Compiled;
+
+/*@ Fiz_Compiled *fiz_compile(Fiz *F, const char *str);
+ *# Compiles the script {{str}} so that it can be executed with
+ *# {{fiz_run()}} as many times as needed, without being parsed again.\n
+ *# The compiled script keeps its own copy of {{str}}.
+ *# Free it with {{fiz_free_compiled()}} when it is no longer needed.
+ */
+Fiz_Compiled *fiz_compile(Fiz *F, const char *str);
+
+/*@ Fiz_Code fiz_run(Fiz *F, Fiz_Compiled *code);
+ *# Executes a script compiled with {{fiz_compile()}} in the
+ *# interpreter {{F}}, as {{fiz_exec()}} would have executed it.
+ */
+Fiz_Code fiz_run(Fiz *F, Fiz_Compiled *code);
+
+/*@ void fiz_free_compiled(Fiz_Compiled *code);
+ *# Frees a script compiled with {{fiz_compile()}}.\n
+ *# It is safe to call this while the script is running: It is only
+ *# freed when it finishes. A run that {{fiz_exec_budget()}} stopped keeps
+ *# the script until it is discarded by {{fiz_destroy()}}.
+ */
+void fiz_free_compiled(Fiz_Compiled *code);
+
+/*@ Fiz_Code fiz_exec_budget(Fiz *F, Fiz_Compiled *code, int max_steps);
+ *# Executes a script compiled with {{fiz_compile()}}, like {{fiz_run()}},
+ *# but stops after {{max_steps}} commands and returns {{FIZ_YIELDED}}.\n
+ *# The next call of {{fiz_exec_budget()}} with the same {{code}} carries
+ *# on from the command where it stopped, with a new budget of steps.
+ *# Any other return value means that the script has finished.\n
+ *# If {{max_steps}} is less than 1, one step is executed.\n
+ *# Every command counts as a step, including the commands of scripts that
+ *# commands implemented in C run, like the bodies of {{catch}}, {{if}}, or
+ *# a {{while}} loop that isn't compiled inline. The script can only be
+ *# stopped between its own commands and those of its procs, though, so
+ *# such a command always runs to the end, even if it takes more steps than
+ *# the budget; the script then stops as soon as the command returns.
+ *# The time a call takes is only bounded if the scripts don't run long
+ *# loops inside such commands.\n
+ *# An interpreter keeps one stopped run of each {{code}}, so two tasks that
+ *# need to be stopped and carried on independently must each use their own
+ *# {{fiz_compile()}} of the script.\n
+ *# Use {{fiz_cancel()}} to discard a script that was stopped.
+ */
+Fiz_Code fiz_exec_budget(Fiz *F, Fiz_Compiled *code, int max_steps);
+
+/*@ void fiz_cancel(Fiz *F, Fiz_Compiled *code);
+ *# Discards the run of {{code}} that {{fiz_exec_budget()}} stopped, if
+ *# there is one. The next call of {{fiz_exec_budget()}} starts it over.\n
+ *# {{fiz_destroy()}} discards all of them.
+ */
+void fiz_cancel(Fiz *F, Fiz_Compiled *code);
+
+/*@ void fiz_set_max_depth(Fiz *F, int depth);
+ *# Sets how deeply procs can call each other. A call that goes deeper
+ *# fails with {{FIZ_ERROR}} and a "too many nested calls" message.\n
+ *# Procs called from a script run on a stack on the heap, so they don't
+ *# use up the C stack. Commands implemented in C that run scripts, like
+ *# {{catch}}, do, and the limit also applies to how deeply they are
+ *# nested. Lower it if the C stack is small.\n
+ *# The default is 10000, or {{FIZ_MAX_DEPTH}} if it is defined when Fiz
+ *# is compiled.\n
+ *# A call in the form {{return [proc ...]}} takes the place of the proc
+ *# it is made from, so it doesn't count towards the limit.
+ */
+void fiz_set_max_depth(Fiz *F, int depth);
+
+/*@ Fiz_Code fiz_call(Fiz *F, const char *name, int argc, const char **argv);
+ *# Calls the command {{name}} with the {{argc}} arguments in {{argv}}.\n
+ *# The arguments are passed to the command as they are, so unlike a
+ *# script given to {{fiz_exec()}}, they don't have to be quoted, and
+ *# nothing is parsed.\n
+ *# {{argv}} holds only the arguments, not the name of the command.
+ */
+Fiz_Code fiz_call(Fiz *F, const char *name, int argc, const char **argv);
+
+/*@ typedef struct fiz_command Fiz_Command
+ *# A handle for calling a command with {{fiz_call_command()}}.
+ */
+typedef struct fiz_command Fiz_Command;
+
+/*@ Fiz_Command *fiz_command(Fiz *F, const char *name);
+ *# Creates a handle for calling the command {{name}} with
+ *# {{fiz_call_command()}}, which saves looking the command up every time.\n
+ *# The command is looked up in {{F}} right away.
+ *# The handle refers to the command by its name, so it stays valid if the
+ *# command is redefined or deleted, and the command need not exist yet.
+ *# It can be used with other interpreters too, but it then looks the
+ *# command up again whenever the interpreter changes.
+ *# Free it with {{fiz_free_command()}}.
+ */
+Fiz_Command *fiz_command(Fiz *F, const char *name);
+
+/*@ Fiz_Code fiz_call_command(Fiz *F, Fiz_Command *cmd, int argc, const char **argv);
+ *# Calls the command of a handle from {{fiz_command()}} in the same way
+ *# as {{fiz_call()}}.
+ */
+Fiz_Code fiz_call_command(Fiz *F, Fiz_Command *cmd, int argc, const char **argv);
+
+/*@ void fiz_free_command(Fiz_Command *cmd);
+ *# Frees a handle created with {{fiz_command()}}.
+ */
+void fiz_free_command(Fiz_Command *cmd);
+
 /*@ void fiz_add_func(Fiz *F, const char *name, fiz_func fun, void *data);
  *# Adds a C-function matching the {{fiz_func}} prototype to the
  *# interpreter.
  */
 void fiz_add_func(Fiz *F, const char *name, fiz_func fun, void *data);
 
+/*@ void fiz_copy_procs(Fiz *to, Fiz *from);
+ *# Defines the procs of interpreter {{from}} in interpreter {{to}} as well,
+ *# replacing commands of the same names. C-functions aren't copied.
+ */
+void fiz_copy_procs(Fiz *to, Fiz *from);
+
 /*@ void fiz_set_return(Fiz *F, const char *s);
  *# Sets the return value of the command.
  */
@@ -94,11 +252,33 @@ void fiz_set_return(Fiz *F, const char *s);
  */
 void fiz_set_return_ex(Fiz *F, const char *fmt, ...);
 
+/*@ void fiz_append_return(Fiz *F, const char *s);
+ *# Appends the string {{s}} to the return value.\n
+ *# The return value is extended in place, in a buffer that doubles in
+ *# size as it fills up, so a command can build a large result from many
+ *# small pieces without copying it every time.
+ */
+void fiz_append_return(Fiz *F, const char *s);
+
+/*@ void fiz_set_return_int(Fiz *F, int i);
+ *# Sets the return value of the command to an integer.\n
+ *# The integer is only converted to a string if the string is needed.
+ */
+void fiz_set_return_int(Fiz *F, int i);
+
 /*@ const char *fiz_get_return(Fiz *F);
  *# Retrieves the return value of the last command.
  */
 const char *fiz_get_return(Fiz *F);
 
+/*@ int fiz_get_return_int(Fiz *F);
+ *# Retrieves the return value of the last command as an integer,
+ *# as {{atoi()}} would convert it.\n
+ *# The integer is cached with the value, so the string only gets
+ *# parsed once.
+ */
+int fiz_get_return_int(Fiz *F);
+
 /*@ void fiz_set_var(Fiz *F, const char *name, const char *value);
  *# Sets the value of a variable within the current callframe.
  */
@@ -111,6 +291,29 @@ void fiz_set_var(Fiz *F, const char *name, const char *value);
  */
 void fiz_set_var_ex(Fiz *F, const char *name, const char *fmt, ...);
 
+/*@ void fiz_set_var_list(Fiz *F, const char *name, int argc, const char **argv);
+ *# Sets a variable within the current callframe to a list of the {{argc}}
+ *# strings in {{argv}}. The strings don't have to be quoted.
+ */
+void fiz_set_var_list(Fiz *F, const char *name, int argc, const char **argv);
+
+/*@ char *fiz_make_list(int argc, const char **argv);
+ *# Returns a list of the {{argc}} strings in {{argv}}, quoted where needed
+ *# so that each string is one word of a command.\n
+ *# The caller has to {{free()}} the returned string.
+ */
+char *fiz_make_list(int argc, const char **argv);
+
+/*@ void fiz_append_var(Fiz *F, const char *name, const char *s);
+ *# Appends the string {{s}} to the value of a variable within the current
+ *# callframe, creating the variable if it doesn't exist.\n
+ *# Like the {{append}} command, it extends the variable's string in place
+ *# where it can, so building a large string this way takes linear time.
+ *# Strings previously returned by {{fiz_get_var()}} for the variable
+ *# may no longer be valid afterwards.
+ */
+void fiz_append_var(Fiz *F, const char *name, const char *s);
+
 /*@ const char *fiz_get_var(Fiz *F, const char *name);
  *# Gets the value of a variable in the current callframe.
  */
@@ -126,17 +329,90 @@ const char *fiz_get_var(Fiz *F, const char *name);
 char *fiz_readfile(const char *filename);
 
 #ifdef FIZ_INTEGER_EXPR
-/*@ int expr(const char *str, const char **err);
- *# The expression evaluator used with the {{expr}} command.
- *# See {{expr.c}} for details */
-int expr(const char *str, const char **err);
+typedef int Expr_Number;
 #else
-/*@ double expr(const char *str, const char **err);
- *# The expression evaluator used with the {{expr}} command.
- *# See {{expr.c}} for details */
-double expr(const char *str, const char **err);
+typedef double Expr_Number;
 #endif
 
+/*@ Expr_Number expr(const char *str, const char **err);
+ *# The expression evaluator used with the {{expr}} command.
+ *# See {{expr.c}} for details.\n
+ *# {{Expr_Number}} is a {{double}}, or an {{int}} if {{FIZ_INTEGER_EXPR}}
+ *# is defined.\n
+ *# Expressions evaluated with this function can't refer to variables.
+ */
+Expr_Number expr(const char *str, const char **err);
+
+/*@ typedef const char *(*Expr_Lookup)(const char *name, Expr_Number *value, void *data);
+ *# Prototype for functions that look up the values of the variables
+ *# in an expression for {{expr_eval()}}.\n
+ *# It should store the value of {{name}} in {{value}} and return {{NULL}},
+ *# or return an error message if there is no such variable.
+ */
+typedef const char *(*Expr_Lookup)(const char *name, Expr_Number *value, void *data);
+
+/*@ struct expr *expr_compile(const char *str, const char **err);
+ *# Compiles an expression so that it can be evaluated repeatedly with
+ *# {{expr_eval()}}.\n
+ *# In compiled expressions variables can be referred to as {{$name}}.\n
+ *# It returns {{NULL}} and points {{err}} to an error message if the
+ *# expression could not be compiled. Deallocate the result with
+ *# {{expr_free()}}.
+ */
+struct expr *expr_compile(const char *str, const char **err);
+
+/*@ Expr_Number expr_eval(struct expr *e, Expr_Lookup lookup, void *data, const char **err);
+ *# Evaluates a compiled expression.\n
+ *# {{lookup}} is called with {{data}} to get the value of every variable
+ *# when it is used, so the same compiled expression can be evaluated as
+ *# the variables change.\n
+ *# On an error {{err}} is pointed to an error message.
+ */
+Expr_Number expr_eval(struct expr *e, Expr_Lookup lookup, void *data, const char **err);
+
+/*@ void expr_free(struct expr *e);
+ *# Deallocates an expression compiled with {{expr_compile()}}.
+ */
+void expr_free(struct expr *e);
+
+/*@ const char *expr_to_number(const char *str, Expr_Number *n);
+ *# Converts the text {{str}} to a number the way {{expr}} reads numbers,
+ *# for use in {{Expr_Lookup}} functions.\n
+ *# Returns {{NULL}} on success, or an error message.
+ */
+const char *expr_to_number(const char *str, Expr_Number *n);
+
+/*@ const char *fiz_get_var_number(Fiz *F, const char *name, Expr_Number *n);
+ *# Gets the value of a variable in the current callframe as a number,
+ *# the way {{expr_to_number()}} reads it.\n
+ *# Numbers that were computed are used as they are, and a string is only
+ *# converted the first time, so reading the same value over and over
+ *# is cheap.\n
+ *# It returns {{NULL}} on success, or an error message if the variable
+ *# doesn't exist or isn't a number.
+ */
+const char *fiz_get_var_number(Fiz *F, const char *name, Expr_Number *n);
+
+/*@ struct expr_cache *expr_cache_create(int size);
+ *# Creates a cache of compiled expressions, that holds up to {{size}}
+ *# expressions. When it is full the expression that was least recently
+ *# used is discarded. A {{size}} of 0 specifies a default value.
+ */
+struct expr_cache *expr_cache_create(int size);
+
+/*@ struct expr *expr_cache_get(struct expr_cache *c, const char *str, const char **err);
+ *# Returns the compiled form of the expression {{str}} from the cache {{c}},
+ *# compiling it if it is not in the cache yet.\n
+ *# The result belongs to the cache, and may only be used until the next call
+ *# to {{expr_cache_get()}}.
+ */
+struct expr *expr_cache_get(struct expr_cache *c, const char *str, const char **err);
+
+/*@ void expr_cache_free(struct expr_cache *c);
+ *# Deallocates a cache of compiled expressions.
+ */
+void expr_cache_free(struct expr_cache *c);
+
 /*@ char *fiz_substitute(Fiz *F, const char *s);
  *# Performs $variable substitution on a string. It also evaluates
  *# statements within {{[angle brackets]}}.
@@ -158,6 +434,25 @@ Fiz_Code fiz_argc_error(Fiz *F, const char *cmd, int exp);
  */
 Fiz_Code fiz_oom_error(Fiz *F);
 
+/*@ void *fiz_alloc_temp(Fiz *F, size_t size);
+ *# Allocates {{size}} bytes of temporary memory for a C-function.\n
+ *# The memory is released automatically when the command that
+ *# allocated it returns, so it must not be {{free()}}d, and must
+ *# not be used after the command returns.\n
+ *# It returns {{NULL}} if the memory could not be allocated.
+ */
+void *fiz_alloc_temp(Fiz *F, size_t size);
+
+/*@ void fiz_temp_stats(Fiz *F, unsigned long *allocs, unsigned long *mallocs);
+ *# Retrieves counters for the interpreter's temporary memory:
+ *# {{allocs}} is the number of temporary allocations made and
+ *# {{mallocs}} is the number of times that memory had to be
+ *# {{malloc()}}ed for them. The difference is the number of
+ *# allocations that were served from memory that was reused.\n
+ *# Either pointer may be {{NULL}}.
+ */
+void fiz_temp_stats(Fiz *F, unsigned long *allocs, unsigned long *mallocs);
+
 /*2 Functions for Manipulating Dictionaries
  */
  
@@ -186,6 +481,65 @@ void fiz_dict_delete(Fiz *F, const char *dict, const char *key);
  */
 const char *fiz_dict_next(Fiz *F, const char *dict, const char *key);
 
+/*@ int fiz_dict_iterate(Fiz *F, const char *dict, Fiz_Dict_Cursor *cursor, const char **key, const char **value);
+ *# Retrieves the next {{key}} and its {{value}} from a dictionary.
+ *# {{cursor}} keeps track of the position in the dictionary.\n
+ *# It returns 0 if there are no more entries, or if the dictionary doesn't exist.\n
+ *# Each step takes constant time. It is safe to delete the key that was
+ *# just retrieved, but the strings are then no longer valid. In an ordered
+ *# dictionary the step after keys were inserted or deleted takes O(log n) time.
+ *# Several iterations of the same dictionary may run at the same time.
+ */
+int fiz_dict_iterate(Fiz *F, const char *dict, Fiz_Dict_Cursor *cursor, const char **key, const char **value);
+
+/*@ void fiz_dict_cursor_done(Fiz_Dict_Cursor *cursor);
+ *# Releases the memory held by {{cursor}}. {{fiz_dict_iterate()}} does this
+ *# itself when it returns 0, so it is only needed if an iteration is stopped
+ *# before the end.
+ */
+void fiz_dict_cursor_done(Fiz_Dict_Cursor *cursor);
+
+/*@ void fiz_dict_ordered(Fiz *F, const char *dict);
+ *# Makes a dictionary ordered, creating it if it doesn't exist.\n
+ *# Ordered dictionaries keep their keys sorted (as by {{strcmp()}})
+ *# instead of in a hash table, so looking up a key takes O(log n) time,
+ *# and entries are visited in the order of their keys.
+ *# {{fiz_dict_next()}} then returns the smallest key larger than
+ *# the given key, which need not be in the dictionary.
+ */
+void fiz_dict_ordered(Fiz *F, const char *dict);
+
+/*@ int fiz_dict_is_ordered(Fiz *F, const char *dict);
+ *# Returns 1 if the dictionary exists and is ordered.
+ */
+int fiz_dict_is_ordered(Fiz *F, const char *dict);
+
+/*@ const char *fiz_dict_min(Fiz *F, const char *dict);
+ *# Returns the smallest key of an ordered dictionary.\n
+ *# It returns {{NULL}} if the dictionary is empty, doesn't exist or isn't ordered.
+ */
+const char *fiz_dict_min(Fiz *F, const char *dict);
+
+/*@ const char *fiz_dict_max(Fiz *F, const char *dict);
+ *# Returns the largest key of an ordered dictionary.\n
+ *# It returns {{NULL}} if the dictionary is empty, doesn't exist or isn't ordered.
+ */
+const char *fiz_dict_max(Fiz *F, const char *dict);
+
+/*@ Fiz_Code fiz_dict_range(Fiz *F, const char *dict, const char *from, const char *to, fiz_dict_func fun, void *data);
+ *# Calls {{fun}} for the entries of an ordered dictionary with keys from
+ *# {{from}} up to and including {{to}}, in order. If {{from}} or {{to}}
+ *# is {{NULL}} the range is unbounded on that side. {{data}} is passed to
+ *# {{fun}} unmodified.\n
+ *# Finding the first key takes O(log n) time, after which each step
+ *# takes constant time.\n
+ *# If {{fun}} returns anything other than {{FIZ_OK}} the iteration stops
+ *# and that value is returned. {{fun}} may insert and delete keys.\n
+ *# If the dictionary isn't ordered, {{from}} and {{to}} must be {{NULL}},
+ *# and all the entries are visited in the order in which they were inserted.
+ */
+Fiz_Code fiz_dict_range(Fiz *F, const char *dict, const char *from, const char *to, fiz_dict_func fun, void *data);
+
 /*@ char *fiz_get_last_statement(Fiz *F, const char* body);
  *# Returns last statement that was executed by the engine,
  *# good for diagnostics or error reporting
@@ -204,6 +558,9 @@ int fiz_get_location_of_last_statement(Fiz* F, const char** proc_name, const cha
 
 /*@ void fiz_set_return_normalized_double(Fiz* F, const double result);
  *# Sets the return value to double floating point number, 
- *# removing not needed trailing zeroes.
+ *# removing not needed trailing zeroes.\n
+ *# The number is only converted to a string if the string is needed.
  */
 void fiz_set_return_normalized_double(Fiz* F, const double result);
+
+#endif /* FIZ_H */
@@ -1,296 +1,870 @@
-/*
- * A quick and dirty hash table implementation.
- *
- * See hash.h for more info
- *
- * This is free and unencumbered software released into the public domain.
- * http://unlicense.org/
- */
-
-#include <stdlib.h>
-#include <string.h>
-#include <ctype.h>
-#include <assert.h>
-
-#include "hash.h"
-
-#ifdef FIZ_OVERRIDE_HASH_DEFAULT_SIZE
-#define DEFAULT_SIZE	 FIZ_OVERRIDE_HASH_DEFAULT_SIZE
-#else
-#define DEFAULT_SIZE	 512
-#endif
-#define MAX_SIZE		 100000
-#define FILL_FACTOR(x)	 ((x)/2)
-#define RESIZE_FACTOR(x) ((x)*2)
-
-/* The internal hash function.
- *
- * It uses the function described in section 7.6
- * of the "Dragon Book", see page 435 in particular.
- *
- * It computes the modulus through the bitwise AND
- * of the sum and (size-1), therefore the size of 
- * the table must be a power of two.
- */
-static int
-hash (const char *str, int size)
-{
-  int x = 0;
-  assert (str);
-
-  while (str[0])
-    {
-      x = (x * 65599) + str[0];
-      str++;
-    }
-
-  return x & (size - 1);
-}
-
-/* Allocates memory for a hash table */
-struct hash_tbl *
-ht_create (int size)
-{
-  struct hash_tbl *h;
-  int i;
-
-  if (size == 0)
-    size = DEFAULT_SIZE;        /*default */
-  h = malloc (sizeof *h);
-  if (!h)
-    return 0;
-  h->cnt = 0;
-  h->size = size;
-  h->buckets = calloc (size, sizeof *h->buckets);
-  if (!h->buckets)
-    {
-      free (h);
-      return NULL;
-    }
-  for (i = 0; i < size; i++)
-    h->buckets[i] = NULL;
-  return h;
-}
-
-int
-ht_rehash (struct hash_tbl *ht, int new_size)
-{
-  struct hash_el **buckets, *j, *e, *k;
-  int i, h;
-
-  if (new_size >= MAX_SIZE)
-    {
-      if (ht->size < MAX_SIZE)
-        new_size = MAX_SIZE;
-      else
-        return 0;
-    }
-
-  buckets = calloc (new_size, sizeof *buckets);
-  if (!buckets)
-    return 0;
-
-  for (i = 0; i < ht->size; i++)
-    for (j = ht->buckets[i]; j;)
-      {
-        h = hash (j->key, new_size);
-        e = j;
-        j = j->next;
-        e->next = NULL;
-
-        if (buckets[h])
-          {
-            for (k = buckets[h]; k->next; k = k->next);
-            k->next = e;
-          }
-        else
-          buckets[h] = e;
-      }
-
-  free (ht->buckets);
-  ht->buckets = buckets;
-  ht->size = new_size;
-  return 1;
-}
-
-void *
-ht_insert (struct hash_tbl *h, const char *key, void *value)
-{
-  struct hash_el *e;
-  int f;
-  size_t len;
-
-  if (h->cnt > FILL_FACTOR (h->size))
-    ht_rehash (h, RESIZE_FACTOR (h->size));
-
-  e = malloc (sizeof *e);
-  if (!e)
-    return NULL;
-
-  len = strlen (key);
-  e->key = malloc (len + 1);
-  if (!e->key)
-    {
-      free (e);
-      return NULL;
-    }
-  memcpy (e->key, key, len + 1);
-
-  e->value = value;
-  e->next = NULL;
-
-  f = hash (key, h->size);
-
-  /* new element in the front of the bucket, for locality of reference, etc. */
-  e->next = h->buckets[f];
-  h->buckets[f] = e;
-
-  h->cnt++;
-  return value;
-}
-
-/* Used internally to search the table for a specific key 
- * f will contain the hash table bucket
- */
-static struct hash_el *
-search (struct hash_tbl *h, const char *key, int *f)
-{
-  struct hash_el *i;
-
-  *f = hash (key, h->size);
-  if (h->buckets[*f])
-    {
-      for (i = h->buckets[*f]; i; i = i->next)
-        if (!strcmp (i->key, key))
-          return i;
-    }
-  return NULL;
-}
-
-/* Returns the value associated with a specific key */
-void *
-ht_find (struct hash_tbl *h, const char *key)
-{
-  int f;
-  struct hash_el *i = search (h, key, &f);
-  if (i)
-    return i->value;
-  return NULL;
-}
-
-/* Finds the next element in the table given a specific key */
-const char *
-ht_next (struct hash_tbl *h, const char *key)
-{
-  int f;
-  struct hash_el *i;
-
-  if (key == NULL)
-    {
-      for (f = 0; f < h->size && !h->buckets[f]; f++);
-      if (f >= h->size)
-        return NULL;
-
-      assert (h->buckets[f]);
-      return h->buckets[f]->key;
-    }
-  i = search (h, key, &f);
-  if (!i)
-    return NULL;
-  if (i->next)
-    return i->next->key;
-  else
-    {
-      f++;
-      while (f < h->size && !h->buckets[f])
-        f++;
-
-      if (f >= h->size)
-        return NULL;
-
-      assert (h->buckets[f]);
-
-      return h->buckets[f]->key;
-    }
-}
-
-/* Deletes an element from the hash table */
-void *
-ht_delete (struct hash_tbl *h, const char *key)
-{
-  struct hash_el *i, *p = NULL;
-  void *d = NULL;
-  int f;
-
-  f = hash (key, h->size);
-  if (h->buckets[f])
-    {
-      for (i = h->buckets[f]; i; i = i->next)
-        {
-          if (!strcmp (i->key, key))
-            {
-              if (p)
-                p->next = i->next;
-              else
-                h->buckets[f] = i->next;
-
-              d = i->value;
-              free (i->key);
-              free (i);
-              h->cnt--;
-              break;
-            }
-
-          p = i;
-        }
-    }
-  return d;
-}
-
-/* Deallocates an entire hash table */
-void
-ht_free (struct hash_tbl *h, clear_all_dtor dtor)
-{
-  struct hash_el *e;
-  int i;
-
-  for (i = 0; i < h->size; i++)
-    if (h->buckets[i])
-      {
-        e = h->buckets[i];
-        while (e)
-          {
-            h->buckets[i] = e->next;
-            if (dtor)
-              dtor (e->key, e->value);
-            free (e->key);
-            free (e);
-            e = h->buckets[i];
-          }
-      }
-  free (h->buckets);
-  free (h);
-}
-
-/* Perform the function f() for each key-value pair in the hashtable h
- */
-void
-ht_foreach (struct hash_tbl *h,
-            int (*f) (const char *key, void *value, void *data), void *data)
-{
-  struct hash_el *e;
-  int i;
-
-  for (i = 0; i < h->size; i++)
-    if (h->buckets[i])
-      {
-        e = h->buckets[i];
-        while (e)
-          {
-            if (!f (e->key, e->value, data))
-              return;
-            e = e->next;
-          }
-      }
-}
-
+/*
+ * A hash table implementation using open addressing, that keeps its
+ * entries in the order they were inserted.
+ *
+ * The entries are appended to a dense array, like the dicts of CPython
+ * 3.6 and later. A deleted entry leaves a hole that is removed when the
+ * table is resized. The entries are found through a separate index: an
+ * array of slots that hold the positions of the entries.
+ *
+ * The index follows the "Swiss table" design: Next to the slots is an
+ * array of control bytes, one per slot, that tells whether the slot is
+ * empty, deleted or full. For full slots the control byte holds 7 bits
+ * of the key's hash. Lookups compare the control bytes of a group of 16
+ * slots at once (with SSE2 where available), so only the slots whose
+ * hash bits match need to have their entries compared. The full hash of
+ * each key is kept in its entry, which rules out most of the remaining
+ * string compares, and means keys never have to be hashed again when
+ * the table is resized.
+ *
+ * Large tables are resized incrementally: The old entries and index are
+ * kept next to the new ones, and every insert moves a few of the old
+ * entries over, so that no single insert has to move the whole table.
+ * Until they have all been moved, keys are searched for in both indexes.
+ * Keys inserted in the meantime are appended to the old entries, so that
+ * they stay behind the entries that were there before.
+ *
+ * See hash.h for more info
+ *
+ * Compile the collision flood benchmark like so:
+ * $ gcc -o hash -Wall -Werror -pedantic -O2 -DHASH_BENCH hash.c
+ *
+ * This is free and unencumbered software released into the public domain.
+ * http://unlicense.org/
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__SSE2__) && !defined(FIZ_DISABLE_SSE2)
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
+
+#include "hash.h"
+
+#ifdef FIZ_OVERRIDE_HASH_DEFAULT_SIZE
+#define DEFAULT_SIZE	 FIZ_OVERRIDE_HASH_DEFAULT_SIZE
+#else
+#define DEFAULT_SIZE	 512
+#endif
+#define MAX_LOAD(x)	 ((x) - (x)/8)
+
+/* The index is resized when this many of its slots are used. The slots
+ * above it are for the keys inserted while the table is being resized */
+#define GROW_AT(x)	 (MAX_LOAD (x) - (x)/32)
+
+/* Tables smaller than this are resized in one go. Larger tables
+ * move MIGRATE_STEP of the old entries for every key inserted */
+#define INCREMENTAL_SIZE 1024
+#define MIGRATE_STEP	 64
+
+/* Entries are kept in blocks of this many, so that the array of entries
+ * can grow without being copied, and so that the old entries can be
+ * released a block at a time while they are moved. The first block
+ * starts with space for FIRST_BLOCK entries and doubles until it is full.
+ */
+#define BLOCK_SIZE	 4096
+#define FIRST_BLOCK	 8
+#define ENTRY(s, i)	 (&(s)->blocks[(i) / BLOCK_SIZE][(i) % BLOCK_SIZE])
+
+/* Number of slots whose control bytes are examined together */
+#define GROUP_SIZE	 16
+
+/* Control bytes. Full slots have the high bit set, and the low 7 bits
+ * of the hash in the other bits. Empty is 0 so that new arrays of control
+ * bytes can come from calloc(), which doesn't have to touch the memory
+ */
+#define CTRL_EMPTY	 ((signed char) 0)
+#define CTRL_DELETED	 ((signed char) 1)
+#define IS_FULL(c)	 ((c) < 0)
+
+#define H1(hash)	 ((hash) >> 7)
+#define H2(hash)	 ((signed char) (0x80 | ((hash) & 0x7F)))
+
+/* The internal hash function.
+ *
+ * It is based on wyhash (final version 4) by Wang Yi, which reads the key
+ * 8 bytes at a time and mixes them with 64x64 to 128 bit multiplications.
+ * Every table has its own random seed, so that keys can't be chosen to
+ * make them collide, which would make the lookups slow.
+ */
+static const uint64_t wyp[4] = {
+  0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+  0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+
+/* Multiplies '*a' and '*b' into a 128 bit result,
+ * and stores the low half in '*a' and the high half in '*b' */
+static void
+mum (uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t) *a * *b;
+  *a = (uint64_t) r;
+  *b = (uint64_t) (r >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t) *a, lb = (uint32_t) *b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32), c = t < rl, lo;
+  lo = t + (rm1 << 32);
+  c += lo < t;
+  *a = lo;
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static uint64_t
+mix (uint64_t a, uint64_t b)
+{
+  mum (&a, &b);
+  return a ^ b;
+}
+
+static uint64_t
+read8 (const unsigned char *p)
+{
+  uint64_t v;
+  memcpy (&v, p, 8);
+  return v;
+}
+
+static uint64_t
+read4 (const unsigned char *p)
+{
+  uint32_t v;
+  memcpy (&v, p, 4);
+  return v;
+}
+
+#ifdef HASH_BENCH
+/* The benchmark below can switch back to the old hash for comparison */
+static int use_old_hash;
+static unsigned int old_hash (const char *str);
+#endif
+
+static unsigned int
+hash (const struct hash_tbl *h, const char *str)
+{
+  const unsigned char *p = (const unsigned char *) str;
+  size_t len, i;
+  uint64_t a, b, seed;
+  assert (str);
+#ifdef HASH_BENCH
+  if (use_old_hash)
+    return old_hash (str);
+#endif
+
+  len = strlen (str);
+  seed = h->seed ^ mix (h->seed ^ wyp[0], wyp[1]);
+  if (len <= 16)
+    {
+      if (len >= 4)
+        {
+          a = (read4 (p) << 32) | read4 (p + ((len >> 3) << 2));
+          b = (read4 (p + len - 4) << 32) | read4 (p + len - 4 - ((len >> 3) << 2));
+        }
+      else if (len > 0)
+        {
+          a = ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8) | p[len - 1];
+          b = 0;
+        }
+      else
+        a = b = 0;
+    }
+  else
+    {
+      i = len;
+      if (i >= 48)
+        {
+          uint64_t see1 = seed, see2 = seed;
+          do
+            {
+              seed = mix (read8 (p) ^ wyp[1], read8 (p + 8) ^ seed);
+              see1 = mix (read8 (p + 16) ^ wyp[2], read8 (p + 24) ^ see1);
+              see2 = mix (read8 (p + 32) ^ wyp[3], read8 (p + 40) ^ see2);
+              p += 48;
+              i -= 48;
+            }
+          while (i >= 48);
+          seed ^= see1 ^ see2;
+        }
+      while (i > 16)
+        {
+          seed = mix (read8 (p) ^ wyp[1], read8 (p + 8) ^ seed);
+          i -= 16;
+          p += 16;
+        }
+      a = read8 (p + i - 16);
+      b = read8 (p + i - 8);
+    }
+  a ^= wyp[1];
+  b ^= seed;
+  mum (&a, &b);
+  a = mix (a ^ wyp[0] ^ len, b ^ wyp[1]);
+  return (unsigned int) (a ^ (a >> 32));
+}
+
+/* Chooses the seed of a new table. The addresses of the table and
+ * of a local variable differ from run to run on systems with address
+ * space randomization, and the time is mixed in for the others. */
+static uint64_t
+make_seed (const struct hash_tbl *h)
+{
+  uint64_t x = (uint64_t) (uintptr_t) h;
+  x = mix (x ^ wyp[0], (uint64_t) (uintptr_t) &x ^ wyp[1]);
+  return mix (x ^ wyp[2], (uint64_t) time (NULL) ^ wyp[3]);
+}
+
+/* Returns a bitmask of the slots in the group starting at 'g'
+ * whose control byte is 'c'
+ */
+static unsigned int
+match_byte (const signed char *g, signed char c)
+{
+#ifdef USE_SSE2
+  __m128i ctrl = _mm_loadu_si128 ((const __m128i *) g);
+  return _mm_movemask_epi8 (_mm_cmpeq_epi8 (_mm_set1_epi8 (c), ctrl));
+#else
+  unsigned int bits = 0;
+  int i;
+  for (i = 0; i < GROUP_SIZE; i++)
+    if (g[i] == c)
+      bits |= 1u << i;
+  return bits;
+#endif
+}
+
+/* Returns a bitmask of the slots in the group starting at 'g'
+ * that are empty or deleted
+ */
+static unsigned int
+match_free (const signed char *g)
+{
+#ifdef USE_SSE2
+  return ~_mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *) g)) & 0xFFFF;
+#else
+  unsigned int bits = 0;
+  int i;
+  for (i = 0; i < GROUP_SIZE; i++)
+    if (!IS_FULL (g[i]))
+      bits |= 1u << i;
+  return bits;
+#endif
+}
+
+/* Index of the lowest and highest set bits in a non-zero bitmask */
+static int
+lowest_bit (unsigned int bits)
+{
+#ifdef __GNUC__
+  return __builtin_ctz (bits);
+#else
+  int i = 0;
+  while (!(bits & 1))
+    {
+      bits >>= 1;
+      i++;
+    }
+  return i;
+#endif
+}
+
+static int
+highest_bit (unsigned int bits)
+{
+#ifdef __GNUC__
+  return 31 - __builtin_clz (bits);
+#else
+  int i = 0;
+  while (bits >>= 1)
+    i++;
+  return i;
+#endif
+}
+
+/* Sets the control byte of slot 'i'. The control bytes of the first
+ * group are repeated after the last slot so that a group can be read
+ * from any slot without wrapping around.
+ */
+static void
+set_ctrl (struct hash_store *s, int i, signed char c)
+{
+  s->ctrl[i] = c;
+  s->ctrl[((i - GROUP_SIZE) & (s->size - 1)) + GROUP_SIZE] = c;
+}
+
+/* Allocates an empty index of 'size' slots */
+static int
+alloc_store (struct hash_store *s, int size)
+{
+  s->ctrl = calloc (size + GROUP_SIZE, 1);
+  s->index = malloc (size * sizeof *s->index);
+  if (!s->ctrl || !s->index)
+    {
+      free (s->ctrl);
+      free (s->index);
+      return 0;
+    }
+  s->blocks = NULL;
+  s->nentries = 0;
+  s->size = size;
+  s->used = 0;
+  return 1;
+}
+
+static void
+free_store (struct hash_store *s)
+{
+  int i;
+  for (i = 0; i < (s->nentries + BLOCK_SIZE - 1) / BLOCK_SIZE; i++)
+    free (s->blocks[i]);
+  free (s->blocks);
+  free (s->ctrl);
+  free (s->index);
+  s->ctrl = NULL;
+}
+
+/* Appends an entry to the array of entries */
+static struct hash_el *
+append (struct hash_store *s)
+{
+  int i = s->nentries, b = i / BLOCK_SIZE, o = i % BLOCK_SIZE;
+  struct hash_el *block;
+
+  if (o == 0)
+    {
+      struct hash_el **blocks = realloc (s->blocks, (b + 1) * sizeof *blocks);
+      if (!blocks)
+        return NULL;
+      s->blocks = blocks;
+      block = malloc ((b ? BLOCK_SIZE : FIRST_BLOCK) * sizeof *block);
+      if (!block)
+        return NULL;
+      s->blocks[b] = block;
+    }
+  else if (b == 0 && o >= FIRST_BLOCK && !(o & (o - 1)))
+    {
+      block = realloc (s->blocks[0], 2 * o * sizeof *block);
+      if (!block)
+        return NULL;
+      s->blocks[0] = block;
+    }
+  s->nentries++;
+  return ENTRY (s, i);
+}
+
+/* Used internally to search an index for a specific key.
+ * Returns the slot of its entry, or -1 if it isn't in the table.
+ * Entries before 'from' are ignored.
+ *
+ * Groups are probed at triangular offsets from the key's home slot,
+ * which visits every group because the size is a power of two.
+ */
+static int
+search (const struct hash_store *s, const char *key, unsigned int x, int from)
+{
+  int mask = s->size - 1, pos = H1 (x) & mask, step = 0, i;
+  unsigned int bits;
+  const struct hash_el *e;
+
+  for (;;)
+    {
+      const signed char *g = s->ctrl + pos;
+      for (bits = match_byte (g, H2 (x)); bits; bits &= bits - 1)
+        {
+          i = (pos + lowest_bit (bits)) & mask;
+          if (s->index[i] < from)
+            continue;
+          e = ENTRY (s, s->index[i]);
+          if (e->hash == x && !strcmp (e->key, key))
+            return i;
+        }
+      if (match_byte (g, CTRL_EMPTY))
+        return -1;
+      step += GROUP_SIZE;
+      pos = (pos + step) & mask;
+    }
+}
+
+/* Finds the first empty or deleted slot on the probe sequence of 'x' */
+static int
+find_free (const struct hash_store *s, unsigned int x)
+{
+  int mask = s->size - 1, pos = H1 (x) & mask, step = 0;
+  unsigned int bits;
+
+  for (;;)
+    {
+      bits = match_free (s->ctrl + pos);
+      if (bits)
+        return (pos + lowest_bit (bits)) & mask;
+      step += GROUP_SIZE;
+      pos = (pos + step) & mask;
+    }
+}
+
+/* Appends an entry that isn't in the table yet, and adds it to the index */
+static int
+place (struct hash_store *s, const struct hash_el *e)
+{
+  int i, n = s->nentries;
+  struct hash_el *ne = append (s);
+  if (!ne)
+    return 0;
+  *ne = *e;
+  i = find_free (s, e->hash);
+  if (s->ctrl[i] == CTRL_EMPTY)
+    s->used++;
+  set_ctrl (s, i, H2 (e->hash));
+  s->index[i] = n;
+  return 1;
+}
+
+/* Finds the slot of a key in either index.
+ * Sets 'old' if the key is in the old entries that are being moved.
+ */
+static int
+lookup (struct hash_tbl *h, const char *key, unsigned int x, int *old)
+{
+  int i = search (&h->cur, key, x, 0);
+  *old = 0;
+  if (i < 0 && h->old.ctrl)
+    {
+      i = search (&h->old, key, x, h->moved);
+      *old = (i >= 0);
+    }
+  return i;
+}
+
+/* Moves up to 'n' of the old entries to the current array.
+ * Entries are moved in order, and blocks are freed as soon as they
+ * have been moved, so that their memory is returned a bit at a time.
+ */
+static void
+migrate (struct hash_tbl *h, int n)
+{
+  struct hash_store *o = &h->old;
+  struct hash_el *e;
+  for (; n > 0 && h->moved < o->nentries; n--)
+    {
+      e = ENTRY (o, h->moved);
+      if (e->key)
+        place (&h->cur, e);
+      if (++h->moved % BLOCK_SIZE == 0)
+        {
+          free (o->blocks[h->moved / BLOCK_SIZE - 1]);
+          o->blocks[h->moved / BLOCK_SIZE - 1] = NULL;
+        }
+    }
+  if (h->moved == o->nentries)
+    free_store (o);
+}
+
+/* Allocates memory for a hash table */
+struct hash_tbl *
+ht_create (int size)
+{
+  struct hash_tbl *h;
+
+  if (size == 0)
+    size = DEFAULT_SIZE;        /*default */
+  if (size < GROUP_SIZE)
+    size = GROUP_SIZE;
+  assert ((size & (size - 1)) == 0);
+  h = malloc (sizeof *h);
+  if (!h)
+    return 0;
+  if (!alloc_store (&h->cur, size))
+    {
+      free (h);
+      return NULL;
+    }
+  h->cnt = 0;
+  h->old.ctrl = NULL;
+  h->moved = 0;
+  h->seed = make_seed (h);
+  return h;
+}
+
+/* Starts moving the entries to a new index of 'new_size' slots.
+ * Small tables are moved at once.
+ */
+static int
+start_rehash (struct hash_tbl *ht, int new_size)
+{
+  struct hash_store s;
+
+  assert (!ht->old.ctrl);
+  if (ht->cnt >= GROW_AT (new_size))
+    return 0;
+  if (!alloc_store (&s, new_size))
+    return 0;
+  ht->old = ht->cur;
+  ht->cur = s;
+  ht->moved = 0;
+  if (ht->old.size < INCREMENTAL_SIZE)
+    migrate (ht, ht->old.nentries);
+  else
+    migrate (ht, MIGRATE_STEP);
+  return 1;
+}
+
+int
+ht_rehash (struct hash_tbl *ht, int new_size)
+{
+  assert ((new_size & (new_size - 1)) == 0);
+  if (new_size < GROUP_SIZE)
+    new_size = GROUP_SIZE;
+  if (ht->old.ctrl)
+    migrate (ht, ht->old.nentries);
+  if (!start_rehash (ht, new_size))
+    return 0;
+  if (ht->old.ctrl)
+    migrate (ht, ht->old.nentries);
+  return 1;
+}
+
+void *
+ht_insert (struct hash_tbl *h, const char *key, void *value)
+{
+  struct hash_el e;
+  struct hash_store *s;
+  int i, old;
+  size_t len;
+
+  e.hash = hash (h, key);
+  i = lookup (h, key, e.hash, &old);
+  if (i >= 0)
+    {
+      s = old ? &h->old : &h->cur;
+      ENTRY (s, s->index[i])->value = value;
+      return value;
+    }
+
+  if (h->old.ctrl)
+    migrate (h, MIGRATE_STEP);
+  if (!h->old.ctrl && h->cur.used >= GROW_AT (h->cur.size))
+    {
+      /* Grow the table if it is filling up with entries, otherwise
+       * it is filling up with deleted entries that can be cleared out */
+      if (h->cnt >= GROW_AT (h->cur.size) / 2)
+        start_rehash (h, h->cur.size * 2);
+      else
+        start_rehash (h, h->cur.size);
+    }
+
+  /* Keys inserted while the table is being resized go after the
+   * entries that haven't been moved yet */
+  s = h->old.ctrl ? &h->old : &h->cur;
+  if (s->used >= MAX_LOAD (s->size))
+    return NULL;
+
+  len = strlen (key);
+  e.key = malloc (len + 1);
+  if (!e.key)
+    return NULL;
+  memcpy (e.key, key, len + 1);
+  e.value = value;
+  if (!place (s, &e))
+    {
+      free (e.key);
+      return NULL;
+    }
+
+  h->cnt++;
+  return value;
+}
+
+/* Returns the value associated with a specific key */
+void *
+ht_find (struct hash_tbl *h, const char *key)
+{
+  int old, i = lookup (h, key, hash (h, key), &old);
+  struct hash_store *s = old ? &h->old : &h->cur;
+  if (i >= 0)
+    return ENTRY (s, s->index[i])->value;
+  return NULL;
+}
+
+/* Finds the entry at position 'i' or after it, in the order of the table.
+ * The positions of the old entries follow those of the current ones.
+ */
+static struct hash_el *
+entry_from (struct hash_tbl *h, int *i)
+{
+  struct hash_el *e;
+  for (; *i < h->cur.nentries; ++*i)
+    if ((e = ENTRY (&h->cur, *i))->key)
+      return e;
+  if (!h->old.ctrl)
+    return NULL;
+  if (*i < h->cur.nentries + h->moved)
+    *i = h->cur.nentries + h->moved;
+  for (; *i < h->cur.nentries + h->old.nentries; ++*i)
+    if ((e = ENTRY (&h->old, *i - h->cur.nentries))->key)
+      return e;
+  return NULL;
+}
+
+/* Finds the next element in the table given a specific key */
+const char *
+ht_next (struct hash_tbl *h, const char *key)
+{
+  int i = 0, old;
+  struct hash_el *e;
+
+  if (key != NULL)
+    {
+      i = lookup (h, key, hash (h, key), &old);
+      if (i < 0)
+        return NULL;
+      if (old)
+        i = h->cur.nentries + h->old.index[i] + 1;
+      else
+        i = h->cur.index[i] + 1;
+    }
+  e = entry_from (h, &i);
+  return e ? e->key : NULL;
+}
+
+/* Iterates through the table. *cursor is the position at which to look
+ * for the next entry.
+ */
+int
+ht_iterate (struct hash_tbl *h, int *cursor, const char **key, void **value)
+{
+  struct hash_el *e = entry_from (h, cursor);
+
+  if (!e)
+    return 0;
+  ++*cursor;
+  if (key)
+    *key = e->key;
+  if (value)
+    *value = e->value;
+  return 1;
+}
+
+/* Deletes an element from the hash table */
+void *
+ht_delete (struct hash_tbl *h, const char *key)
+{
+  int i, mask, old;
+  unsigned int before, after;
+  struct hash_store *s;
+  struct hash_el *e;
+  void *d;
+
+  i = lookup (h, key, hash (h, key), &old);
+  if (i < 0)
+    return NULL;
+
+  s = old ? &h->old : &h->cur;
+  e = ENTRY (s, s->index[i]);
+  d = e->value;
+  free (e->key);
+  e->key = NULL;
+  h->cnt--;
+
+  /* The slot can be marked as empty again if no probe could have
+   * passed over it while looking for another key, which is the case
+   * if there is no run of GROUP_SIZE full or deleted slots around it.
+   */
+  mask = s->size - 1;
+  before = match_byte (s->ctrl + ((i - GROUP_SIZE) & mask), CTRL_EMPTY);
+  after = match_byte (s->ctrl + i, CTRL_EMPTY);
+  if (before && after
+      && (GROUP_SIZE - 1 - highest_bit (before)) + lowest_bit (after) < GROUP_SIZE)
+    {
+      set_ctrl (s, i, CTRL_EMPTY);
+      s->used--;
+    }
+  else
+    set_ctrl (s, i, CTRL_DELETED);
+  return d;
+}
+
+/* Deallocates an entire hash table */
+void
+ht_free (struct hash_tbl *h, clear_all_dtor dtor)
+{
+  struct hash_el *e;
+  int i = 0;
+
+  while ((e = entry_from (h, &i)))
+    {
+      if (dtor)
+        dtor (e->key, e->value);
+      free (e->key);
+      i++;
+    }
+  free_store (&h->cur);
+  if (h->old.ctrl)
+    free_store (&h->old);
+  free (h);
+}
+
+/* Perform the function f() for each key-value pair in the hashtable h
+ */
+void
+ht_foreach (struct hash_tbl *h,
+            int (*f) (const char *key, void *value, void *data), void *data)
+{
+  struct hash_el *e;
+  int i = 0;
+
+  while ((e = entry_from (h, &i)))
+    {
+      if (!f (e->key, e->value, data))
+        return;
+      i++;
+    }
+}
+
+#ifdef HASH_BENCH
+/*
+ * Collision flood benchmark: Builds keys that all have the same hash
+ * under the multiplicative hash that this file used to use, x * 65599 + c,
+ * and compares the lookup times for them with those for ordinary keys,
+ * first with the hash the tables use now and then with the old one.
+ */
+#include <stdio.h>
+
+#define BLOCK_LEN	 8
+#define NBLOCKS		 14
+#define NKEYS		 (1 << NBLOCKS)
+
+static unsigned int
+old_hash (const char *str)
+{
+  unsigned int x = 0;
+  while (*str)
+    x = x * 65599 + (unsigned char) *str++;
+  return x;
+}
+
+static int
+cmp_u64 (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Two different blocks with the same old hash */
+static char blocks[2][BLOCK_LEN + 1];
+
+static void
+make_block (char *b, uint64_t i)
+{
+  int j;
+  for (j = 0; j < BLOCK_LEN; j++, i /= 62)
+    b[j] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"[i % 62];
+  b[BLOCK_LEN] = '\0';
+}
+
+/* Birthday search for two blocks that collide */
+static int
+find_blocks (void)
+{
+  int n = 1 << 20, i;
+  uint64_t *v = malloc (n * sizeof *v);
+  for (i = 0; i < n; i++)
+    {
+      make_block (blocks[0], i * 0x9E3779B97F4A7C15ull);
+      v[i] = ((uint64_t) old_hash (blocks[0]) << 32) | i;
+    }
+  qsort (v, n, sizeof *v, cmp_u64);
+  for (i = 1; i < n; i++)
+    if (v[i] >> 32 == v[i - 1] >> 32)
+      {
+        make_block (blocks[0], (uint32_t) v[i - 1] * 0x9E3779B97F4A7C15ull);
+        make_block (blocks[1], (uint32_t) v[i] * 0x9E3779B97F4A7C15ull);
+        if (strcmp (blocks[0], blocks[1]))
+          break;
+      }
+  free (v);
+  return i < n;
+}
+
+/* Since the blocks have the same length, any string of them
+ * has the same old hash as any other string of as many of them */
+static void
+flood_key (char *key, int i)
+{
+  int j;
+  for (j = 0; j < NBLOCKS; j++)
+    memcpy (key + j * BLOCK_LEN, blocks[(i >> j) & 1], BLOCK_LEN);
+  key[NBLOCKS * BLOCK_LEN] = '\0';
+}
+
+static void
+plain_key (char *key, int i)
+{
+  int j;
+  for (j = 0; j < NBLOCKS; j++)
+    make_block (key + j * BLOCK_LEN, (uint64_t) i * 7919 + j);
+}
+
+static double
+bench (void (*make_key) (char *, int), const char *name, int reps)
+{
+  static char keys[NKEYS][NBLOCKS * BLOCK_LEN + 1];
+  static uint64_t old[NKEYS];
+  struct hash_tbl *h = ht_create (16);
+  clock_t start;
+  double ns;
+  int i, r, found = 0, distinct = 1;
+
+  for (i = 0; i < NKEYS; i++)
+    {
+      make_key (keys[i], i);
+      ht_insert (h, keys[i], keys[i]);
+      old[i] = old_hash (keys[i]);
+    }
+  qsort (old, NKEYS, sizeof *old, cmp_u64);
+  for (i = 1; i < NKEYS; i++)
+    distinct += old[i] != old[i - 1];
+
+  start = clock ();
+  for (r = 0; r < reps; r++)
+    for (i = 0; i < NKEYS; i++)
+      found += ht_find (h, keys[i]) == keys[i];
+  ns = (double) (clock () - start) / CLOCKS_PER_SEC * 1e9 / ((double) reps * NKEYS);
+  printf ("%-6s keys: %5d distinct old hashes, %5.1f ns per lookup\n", name,
+          distinct, ns);
+  ht_free (h, NULL);
+  return found == reps * NKEYS ? ns : -1;
+}
+
+int
+main (void)
+{
+  double plain, flood;
+  if (!find_blocks ())
+    {
+      fprintf (stderr, "no colliding blocks found\n");
+      return 1;
+    }
+  printf ("\"%s\" and \"%s\" collide\n", blocks[0], blocks[1]);
+  for (use_old_hash = 0; use_old_hash < 2; use_old_hash++)
+    {
+      printf ("%s hash:\n", use_old_hash ? "old" : "new");
+      plain = bench (plain_key, "plain", 100);
+      /* Every lookup of the old hash's flood goes through all the keys */
+      flood = bench (flood_key, "flood", use_old_hash ? 1 : 100);
+      if (plain < 0 || flood < 0)
+        {
+          fprintf (stderr, "lookups failed\n");
+          return 1;
+        }
+      printf ("flood/plain: %.2f\n", flood / plain);
+    }
+  return 0;
+}
+
+#endif /* HASH_BENCH */
@@ -1,5 +1,6 @@
 /*1 Hash.h
- *# A quick and dirty hash table implementation.\n
+ *# A hash table implementation using open addressing, that keeps its
+ *# entries in the order in which they were inserted.\n
  *{
  ** {{struct hash_tbl}} is created with {{~~ht_create()}}
  ** {{struct hash_tbl}} is destroyed with {{~~ht_free()}}
@@ -7,7 +8,7 @@
  ** Insert entries into the table with {{~~ht_insert()}}
  ** Search for entries with {{~~ht_find()}}
  ** Remove entries with {{~~ht_delete()}}
- ** Iterate through the table with {{~~ht_next()}}
+ ** Iterate through the table with {{~~ht_iterate()}} or {{~~ht_next()}}
  *}
  *2 License
  *[
@@ -21,6 +22,8 @@
 #ifndef HASH_H
 #define HASH_H
 
+#include <stdint.h>
+
 #if defined(__cplusplus) || defined(c_plusplus)
 extern "C"
 {
@@ -36,48 +39,83 @@ extern "C"
   typedef void (*clear_all_dtor) (const char *key, void *val);
 
 /*@ struct hash_el
- *# Element stored within the hash table 
+ *# An entry in the hash table.\n
+ *# {{hash}} is the full hash of the {{key}}, so that it doesn't have to be
+ *# computed again, and so that most keys that don't match can be skipped
+ *# without comparing the strings. The {{key}} of a deleted entry is {{NULL}}.
  */
   struct hash_el
   {
     char *key;
     void *value;
-    struct hash_el *next;
+    unsigned int hash;
+  };
+
+/*@ struct hash_store
+ *# The entries of a hash table and the index used to find them.\n
+ *# The {{nentries}} entries are kept in the order in which they were inserted,
+ *# in {{blocks}} of a fixed size.\n
+ *# The index has {{size}} slots, which hold the positions of the entries in
+ *# {{index}}. {{ctrl}} has a control byte for each slot that tells whether
+ *# the slot is empty, deleted or in use. {{used}} is the number of slots
+ *# that are in use or deleted.
+ */
+  struct hash_store
+  {
+    struct hash_el **blocks;
+    int nentries;
+    signed char *ctrl;
+    int *index;
+    int size;
+    int used;
   };
 
 /*@ struct ##hash_tbl
  *# Structure for managing tha hash table.\n
  *# Allocate this structure through {{~~ht_create()}}
- *# and deallocate it with {{~~ht_free()}}
+ *# and deallocate it with {{~~ht_free()}}\n
+ *# {{cnt}} is the number of entries in the table.\n
+ *# While a large table is being resized, the entries that have not been
+ *# moved to {{cur}} yet remain in {{old}}, from position {{moved}} on.
+ *# {{old.ctrl}} is {{NULL}} if the table isn't being resized.\n
+ *# {{seed}} is chosen at random for each table and is mixed into the
+ *# hashes of the keys, so that the positions of the keys can't be predicted.
  */
   struct hash_tbl
   {
-    struct hash_el **buckets;
-    int size;
+    struct hash_store cur;
+    struct hash_store old;
     int cnt;
+    int moved;
+    uint64_t seed;
   };
 
 /*@ struct hash_tbl *##ht_create (int size)
  *# Allocates memory for a hash table.\n
  *# The hash table size must be a power of two, because
  *# the mod operation is performed by the bitwise AND of
- *# the sum and (size - 1).\n
+ *# the sum and (size - 1). Sizes smaller than 16 are rounded up to 16.\n
  *# Setting size to 0 specifies a default value.
  */
   struct hash_tbl *ht_create (int size);
 
 /*@ int ##ht_rehash (struct hash_tbl *ht, int new_size)
- *# Resizes the hashtable {{ht}} to the {{new_size}}, by rehashing 
- *# each key in the table.\n
- *# The new size must be a power of two.\n
- *# This function is normally called automatically in {{~~ht_insert()}}
- *# if the table reaches a certain size.
+ *# Resizes the hashtable {{ht}} to the {{new_size}}, by moving
+ *# each key in the table to its place in the new table.\n
+ *# The new size must be a power of two, and large enough to hold
+ *# the entries in the table. It returns 0 on failure.\n
+ *# {{~~ht_insert()}} resizes the table automatically when it reaches a
+ *# certain size. It does so incrementally for large tables, moving a few
+ *# entries to the new slots with each insert, so that no single insert
+ *# has to wait for the whole table to be moved. This function moves all
+ *# the entries at once.
  */
   int ht_rehash (struct hash_tbl *ht, int new_size);
 
 /*@ void *##ht_insert (struct hash_tbl *h, const char *key, void *value)
  *# Inserts a {{value}} referenced by the string {{key}} 
  *# into the hash table {{h}}.\n
+ *# If {{key}} is already in the table, its value is replaced.\n
  *# It returns {{value}} on success, or {{NULL}} if an internal {{malloc()}}
  *# failed.
  */
@@ -95,10 +133,28 @@ extern "C"
  *# the table.\n
  *# Specifying a value of {{NULL}} as the key retrieves the first key.\n
  *# It returns {{NULL}} if there are no more entries in the table.\n
- *# Keys in the table are not sorted.
+ *# Keys are returned in the order in which they were inserted. Inserting
+ *# new keys while iterating may cause the table to be resized, which can
+ *# cause keys to be skipped or visited twice.
  */
   const char *ht_next (struct hash_tbl *h, const char *key);
 
+/*@ int ##ht_iterate (struct hash_tbl *h, int *cursor, const char **key, void **value)
+ *# Iterates through the hash table {{h}}, retrieving the {{key}} and {{value}}
+ *# of the next element. Either of {{key}} and {{value}} may be {{NULL}}.\n
+ *# {{cursor}} keeps track of the position in the table. Set it to 0 before
+ *# the first call.\n
+ *# It returns 0 if there are no more entries in the table.\n
+ *# Keys are returned in the order in which they were inserted.
+ *# Every step takes constant time, unlike {{~~ht_next()}} which has to search
+ *# for the previous key first. Deleting the key that was just retrieved, or
+ *# changing the values of keys, does not disturb the iteration. Inserting
+ *# new keys may cause the table to be resized, which can cause keys to be
+ *# skipped or visited twice.
+ */
+  int ht_iterate (struct hash_tbl *h, int *cursor, const char **key,
+                  void **value);
+
 /*@ void *##ht_delete (struct hash_tbl *h, const char *key)
  *# Deletes an element indexed by {{key}} from the hash table {{h}}\n
  *# It returns the value associated with the key.
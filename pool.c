@@ -0,0 +1,921 @@
+/*
+ * A pool of worker threads that each run scripts in an interpreter of
+ * their own, and the thread and chan commands for scripts.
+ *
+ * Jobs go to the workers through a bounded queue that many threads
+ * can add to and take from at the same time without a lock. It is an
+ * array of cells that each have a sequence number, which tells the
+ * threads whether the cell is waiting to be filled or to be emptied
+ * in the current pass through the array (see Dmitry Vyukov's bounded
+ * MPMC queue). Two semaphores count the empty cells and the queued
+ * jobs, so that threads only sleep when they have to wait.
+ *
+ * See pool.h for more info
+ *
+ * This is free and unencumbered software released into the public domain.
+ * http://unlicense.org/
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+
+#include "fiz.h"
+#include "hash.h"
+#include "pool.h"
+
+/* Number of jobs that can be queued; must be a power of 2 */
+#ifdef FIZ_POOL_QUEUE_SIZE
+#define QUEUE_SIZE FIZ_POOL_QUEUE_SIZE
+#else
+#define QUEUE_SIZE 1024
+#endif
+
+/* Number of different scripts that a worker keeps compiled */
+#define SCRIPT_CACHE_SIZE 64
+
+/*
+ * A job is the future of its result. It is shared by the thread that
+ * submitted it and the worker that executes it, and is freed when both
+ * are done with it.
+ */
+struct fiz_future {
+    char *script;
+    int argc;
+    char **argv;
+    fiz_pool_done done;
+    void *data;
+
+    Fiz_Code rc;
+    char *result;
+    int finished;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    atomic_int refs;
+};
+
+struct queue_cell {
+    atomic_size_t seq;
+    struct fiz_future *job;
+};
+
+struct worker {
+    Fiz_Pool *pool;
+    pthread_t thread;
+    /* Compiled scripts, by their text */
+    struct hash_tbl *scripts;
+    /* Set if the setup script failed */
+    int failed;
+};
+
+struct fiz_pool {
+    struct queue_cell cells[QUEUE_SIZE];
+    atomic_size_t head, tail;
+    sem_t slots, jobs, ready;
+
+    const char *setup;
+    fiz_pool_init init;
+    void *data;
+
+    int nworkers;
+    struct worker *workers;
+};
+
+/* Adds 'job' to the queue; there has to be space for it */
+static void enqueue(Fiz_Pool *pool, struct fiz_future *job) {
+    size_t pos = atomic_load_explicit(&pool->head, memory_order_relaxed);
+    struct queue_cell *c;
+    for(;;) {
+        size_t seq;
+        c = &pool->cells[pos & (QUEUE_SIZE - 1)];
+        seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        if(seq == pos) {
+            if(atomic_compare_exchange_weak_explicit(&pool->head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if(seq < pos) {
+            /* A thread that took the cell's last job hasn't let go of it */
+            sched_yield();
+            pos = atomic_load_explicit(&pool->head, memory_order_relaxed);
+        } else
+            pos = atomic_load_explicit(&pool->head, memory_order_relaxed);
+    }
+    c->job = job;
+    atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+}
+
+/* Takes the next job from the queue; there has to be one */
+static struct fiz_future *dequeue(Fiz_Pool *pool) {
+    size_t pos = atomic_load_explicit(&pool->tail, memory_order_relaxed);
+    struct queue_cell *c;
+    struct fiz_future *job;
+    for(;;) {
+        size_t seq;
+        c = &pool->cells[pos & (QUEUE_SIZE - 1)];
+        seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        if(seq == pos + 1) {
+            if(atomic_compare_exchange_weak_explicit(&pool->tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if(seq < pos + 1) {
+            /* The thread that is adding the job hasn't finished yet */
+            sched_yield();
+            pos = atomic_load_explicit(&pool->tail, memory_order_relaxed);
+        } else
+            pos = atomic_load_explicit(&pool->tail, memory_order_relaxed);
+    }
+    job = c->job;
+    atomic_store_explicit(&c->seq, pos + QUEUE_SIZE, memory_order_release);
+    return job;
+}
+
+static void push_job(Fiz_Pool *pool, struct fiz_future *job) {
+    while(sem_wait(&pool->slots))
+        ;
+    enqueue(pool, job);
+    sem_post(&pool->jobs);
+}
+
+static struct fiz_future *pop_job(Fiz_Pool *pool) {
+    struct fiz_future *job;
+    while(sem_wait(&pool->jobs))
+        ;
+    job = dequeue(pool);
+    sem_post(&pool->slots);
+    return job;
+}
+
+static void release_future(struct fiz_future *f) {
+    int i;
+    if(atomic_fetch_sub(&f->refs, 1) != 1)
+        return;
+    for(i = 0; i < f->argc; i++)
+        free(f->argv[i]);
+    free(f->argv);
+    free(f->script);
+    free(f->result);
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->cond);
+    free(f);
+}
+
+static void free_script(const char *key, void *code) {
+    fiz_free_compiled(code);
+}
+
+/* Executes 'job' in the interpreter of worker 'w' */
+static void run_job(struct worker *w, Fiz *F, struct fiz_future *job) {
+    Fiz_Compiled *code = ht_find(w->scripts, job->script);
+    Fiz_Code rc;
+
+    fiz_set_var_list(F, "args", job->argc, (const char **)job->argv);
+    if(code)
+        rc = fiz_run(F, code);
+    else if(w->scripts->cnt < SCRIPT_CACHE_SIZE) {
+        code = fiz_compile(F, job->script);
+        ht_insert(w->scripts, job->script, code);
+        rc = fiz_run(F, code);
+    } else
+        rc = fiz_exec(F, job->script);
+
+    pthread_mutex_lock(&job->lock);
+    job->rc = rc;
+    job->result = strdup(fiz_get_return(F));
+    pthread_mutex_unlock(&job->lock);
+    if(job->done)
+        job->done(job->rc, job->result, job->data);
+    pthread_mutex_lock(&job->lock);
+    job->finished = 1;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    release_future(job);
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    Fiz_Pool *pool = w->pool;
+    struct fiz_future *job;
+    Fiz *F = fiz_create();
+
+    fiz_add_aux(F);
+    if(pool->init)
+        pool->init(F, pool->data);
+    if(pool->setup && fiz_exec(F, pool->setup) != FIZ_OK)
+        w->failed = 1;
+    w->scripts = ht_create(16);
+    sem_post(&pool->ready);
+
+    /* A NULL job tells the worker to stop */
+    while((job = pop_job(pool)) != NULL)
+        run_job(w, F, job);
+
+    ht_free(w->scripts, free_script);
+    fiz_destroy(F);
+    return NULL;
+}
+
+/* Stops the first 'n' workers and frees the pool */
+static void stop_pool(Fiz_Pool *pool, int n) {
+    int i;
+    for(i = 0; i < n; i++)
+        push_job(pool, NULL);
+    for(i = 0; i < n; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+    sem_destroy(&pool->slots);
+    sem_destroy(&pool->jobs);
+    sem_destroy(&pool->ready);
+    free(pool->workers);
+    free(pool);
+}
+
+Fiz_Pool *fiz_pool_create(int nworkers, const char *setup, fiz_pool_init init, void *data) {
+    Fiz_Pool *pool;
+    int i, failed = 0;
+    size_t j;
+
+    /* Without workers, jobs would wait in the queue forever */
+    if(nworkers < 1)
+        return NULL;
+    pool = malloc(sizeof *pool);
+    for(j = 0; j < QUEUE_SIZE; j++)
+        atomic_init(&pool->cells[j].seq, j);
+    atomic_init(&pool->head, 0);
+    atomic_init(&pool->tail, 0);
+    sem_init(&pool->slots, 0, QUEUE_SIZE);
+    sem_init(&pool->jobs, 0, 0);
+    sem_init(&pool->ready, 0, 0);
+    pool->setup = setup;
+    pool->init = init;
+    pool->data = data;
+    pool->nworkers = nworkers;
+    pool->workers = calloc(nworkers, sizeof *pool->workers);
+
+    for(i = 0; i < nworkers; i++) {
+        pool->workers[i].pool = pool;
+        if(pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i])) {
+            failed = 1;
+            break;
+        }
+    }
+    /* Wait for the workers to be set up */
+    nworkers = i;
+    for(i = 0; i < nworkers; i++) {
+        while(sem_wait(&pool->ready))
+            ;
+    }
+    for(i = 0; i < nworkers; i++)
+        failed |= pool->workers[i].failed;
+    pool->setup = NULL;
+    if(failed) {
+        stop_pool(pool, nworkers);
+        return NULL;
+    }
+    return pool;
+}
+
+Fiz_Future *fiz_pool_submit(Fiz_Pool *pool, const char *script, int argc, const char **argv, fiz_pool_done done, void *data) {
+    struct fiz_future *f = malloc(sizeof *f);
+    int i;
+
+    f->script = strdup(script);
+    f->argc = argc;
+    f->argv = malloc((argc + 1) * sizeof *f->argv);
+    for(i = 0; i < argc; i++)
+        f->argv[i] = strdup(argv[i]);
+    f->done = done;
+    f->data = data;
+    f->rc = FIZ_OK;
+    f->result = NULL;
+    f->finished = 0;
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    /* One for the caller and one for the worker */
+    atomic_init(&f->refs, 2);
+    push_job(pool, f);
+    return f;
+}
+
+Fiz_Code fiz_future_wait(Fiz_Future *f) {
+    Fiz_Code rc;
+    pthread_mutex_lock(&f->lock);
+    while(!f->finished)
+        pthread_cond_wait(&f->cond, &f->lock);
+    rc = f->rc;
+    pthread_mutex_unlock(&f->lock);
+    return rc;
+}
+
+int fiz_future_done(Fiz_Future *f) {
+    int finished;
+    pthread_mutex_lock(&f->lock);
+    finished = f->finished;
+    pthread_mutex_unlock(&f->lock);
+    return finished;
+}
+
+const char *fiz_future_result(Fiz_Future *f) {
+    fiz_future_wait(f);
+    return f->result;
+}
+
+void fiz_future_free(Fiz_Future *f) {
+    if(f)
+        release_future(f);
+}
+
+void fiz_pool_destroy(Fiz_Pool *pool) {
+    if(pool)
+        stop_pool(pool, pool->nworkers);
+}
+
+/*
+ * Threads and channels for scripts.
+ *
+ * Channels and threads are known by their names in all the
+ * interpreters, so they are kept in tables that are shared by all the
+ * threads. A channel is bounded: 'send' waits while it is full and
+ * 'recv' waits while it is empty. Values are passed as strings, which
+ * is how Fiz keeps them anyway, so a list that is sent isn't rebuilt;
+ * the receiver gets the same string and parses it only if it needs to.
+ */
+
+/* Number of values a channel holds if its size isn't given */
+#define CHANNEL_SIZE 16
+
+struct channel {
+    char name[24];
+    char **values;
+    int size, count, first;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t readable, writable;
+    /* Guarded by handles_lock */
+    int refs;
+    int retired;
+};
+
+struct fiz_thread {
+    char name[24];
+    pthread_t thread;
+    Fiz *F;
+    char *body;
+    Fiz_Code rc;
+    char *result;
+};
+
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hash_tbl *channels, *threads;
+static unsigned long last_channel, last_thread;
+
+static void free_channel(struct channel *c) {
+    int i;
+    for(i = 0; i < c->count; i++)
+        free(c->values[(c->first + i) % c->size]);
+    free(c->values);
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->readable);
+    pthread_cond_destroy(&c->writable);
+    free(c);
+}
+
+/*
+ * Finds the channel called 'name' and holds on to it until
+ * release_channel() is called. Sets 'ended' if the channel existed
+ * but was closed and emptied since.
+ */
+static struct channel *find_channel(const char *name, int *ended) {
+    struct channel *c = NULL;
+    unsigned long id;
+    char end;
+    *ended = 0;
+    pthread_mutex_lock(&handles_lock);
+    if(channels)
+        c = ht_find(channels, name);
+    if(c)
+        c->refs++;
+    else if(sscanf(name, "chan%lu%c", &id, &end) == 1 && id > 0 && id <= last_channel)
+        *ended = 1;
+    pthread_mutex_unlock(&handles_lock);
+    return c;
+}
+
+static void release_channel(struct channel *c) {
+    int unused;
+    pthread_mutex_lock(&handles_lock);
+    unused = --c->refs == 0 && c->retired;
+    pthread_mutex_unlock(&handles_lock);
+    if(unused)
+        free_channel(c);
+}
+
+/* Forgets a channel that is closed and empty */
+static void retire_channel(struct channel *c) {
+    pthread_mutex_lock(&handles_lock);
+    if(!c->retired) {
+        ht_delete(channels, c->name);
+        c->retired = 1;
+    }
+    pthread_mutex_unlock(&handles_lock);
+}
+
+static Fiz_Code chan_create(Fiz *F, int argc, char **argv) {
+    struct channel *c;
+    int size = CHANNEL_SIZE;
+    if(argc > 3)
+        return fiz_argc_error(F, argv[0], 3);
+    if(argc == 3 && (size = atoi(argv[2])) <= 0) {
+        fiz_set_return_ex(F, "invalid channel size '%s'", argv[2]);
+        return FIZ_ERROR;
+    }
+    c = malloc(sizeof *c);
+    c->values = malloc(size * sizeof *c->values);
+    c->size = size;
+    c->count = 0;
+    c->first = 0;
+    c->closed = 0;
+    c->refs = 0;
+    c->retired = 0;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->readable, NULL);
+    pthread_cond_init(&c->writable, NULL);
+
+    pthread_mutex_lock(&handles_lock);
+    if(!channels)
+        channels = ht_create(16);
+    snprintf(c->name, sizeof c->name, "chan%lu", ++last_channel);
+    ht_insert(channels, c->name, c);
+    pthread_mutex_unlock(&handles_lock);
+    fiz_set_return(F, c->name);
+    return FIZ_OK;
+}
+
+static Fiz_Code chan_send(Fiz *F, struct channel *c, int argc, char **argv) {
+    if(argc != 4)
+        return fiz_argc_error(F, argv[0], 4);
+    pthread_mutex_lock(&c->lock);
+    while(c->count == c->size && !c->closed)
+        pthread_cond_wait(&c->writable, &c->lock);
+    if(c->closed) {
+        pthread_mutex_unlock(&c->lock);
+        fiz_set_return_ex(F, "channel %s is closed", c->name);
+        return FIZ_ERROR;
+    }
+    c->values[(c->first + c->count++) % c->size] = strdup(argv[3]);
+    pthread_cond_signal(&c->readable);
+    pthread_mutex_unlock(&c->lock);
+    fiz_set_return(F, "");
+    return FIZ_OK;
+}
+
+/* Takes the next value from 'c', or returns NULL if it is closed and empty */
+static char *chan_take(struct channel *c) {
+    char *value = NULL;
+    int ended;
+    pthread_mutex_lock(&c->lock);
+    while(!c->count && !c->closed)
+        pthread_cond_wait(&c->readable, &c->lock);
+    if(c->count) {
+        value = c->values[c->first];
+        c->first = (c->first + 1) % c->size;
+        c->count--;
+        pthread_cond_signal(&c->writable);
+    }
+    ended = c->closed && !c->count;
+    pthread_mutex_unlock(&c->lock);
+    if(ended)
+        retire_channel(c);
+    return value;
+}
+
+static Fiz_Code chan_close(Fiz *F, struct channel *c) {
+    int ended;
+    pthread_mutex_lock(&c->lock);
+    c->closed = 1;
+    ended = !c->count;
+    pthread_cond_broadcast(&c->readable);
+    pthread_cond_broadcast(&c->writable);
+    pthread_mutex_unlock(&c->lock);
+    if(ended)
+        retire_channel(c);
+    fiz_set_return(F, "");
+    return FIZ_OK;
+}
+
+static Fiz_Code thread_chan(Fiz *F, int argc, char **argv, void *data) {
+    struct channel *c;
+    char *value = NULL;
+    int ended;
+    Fiz_Code rc;
+    if(argc < 2)
+        return fiz_argc_error(F, argv[0], 2);
+    if(!strcmp(argv[1], "create"))
+        return chan_create(F, argc, argv);
+    if(strcmp(argv[1], "send") && strcmp(argv[1], "recv") && strcmp(argv[1], "close")) {
+        fiz_set_return_ex(F, "unknown command %s to %s", argv[1], argv[0]);
+        return FIZ_ERROR;
+    }
+    if(argc < 3)
+        return fiz_argc_error(F, argv[0], 3);
+
+    c = find_channel(argv[2], &ended);
+    if(!c && !ended) {
+        fiz_set_return_ex(F, "unknown channel %s", argv[2]);
+        return FIZ_ERROR;
+    }
+    if(!strcmp(argv[1], "send")) {
+        if(c)
+            rc = chan_send(F, c, argc, argv);
+        else {
+            fiz_set_return_ex(F, "channel %s is closed", argv[2]);
+            rc = FIZ_ERROR;
+        }
+    } else if(!strcmp(argv[1], "recv")) {
+        if(argc > 4) {
+            rc = fiz_argc_error(F, argv[0], 4);
+        } else {
+            if(c)
+                value = chan_take(c);
+            rc = FIZ_OK;
+            if(argc == 4) {
+                /* With a variable, the result says whether there was a value */
+                if(value)
+                    fiz_set_var(F, argv[3], value);
+                fiz_set_return(F, value ? "1" : "0");
+            } else if(value) {
+                fiz_set_return(F, value);
+            } else {
+                fiz_set_return_ex(F, "channel %s is closed", argv[2]);
+                rc = FIZ_ERROR;
+            }
+            free(value);
+        }
+    } else {
+        if(c)
+            rc = chan_close(F, c);
+        else {
+            fiz_set_return(F, "");
+            rc = FIZ_OK;
+        }
+    }
+    if(c)
+        release_channel(c);
+    return rc;
+}
+
+static void *thread_main(void *arg) {
+    struct fiz_thread *t = arg;
+    t->rc = fiz_exec(t->F, t->body);
+    t->result = strdup(fiz_get_return(t->F));
+    fiz_destroy(t->F);
+    t->F = NULL;
+    return NULL;
+}
+
+static void free_thread(struct fiz_thread *t) {
+    if(t->F)
+        fiz_destroy(t->F);
+    free(t->body);
+    free(t->result);
+    free(t);
+}
+
+static Fiz_Code thread_spawn(Fiz *F, int argc, char **argv) {
+    struct fiz_thread *t;
+    if(argc < 3)
+        return fiz_argc_error(F, argv[0], 3);
+    t = malloc(sizeof *t);
+    t->rc = FIZ_OK;
+    t->result = NULL;
+
+    /* The new interpreter is set up here, while 'F' can't change */
+    t->F = fiz_create();
+    fiz_add_aux(t->F);
+    fiz_add_threads(t->F);
+    fiz_copy_procs(t->F, F);
+    if(argc > 3) {
+        /* The arguments are added to the body as words, like 'eval' would */
+        char *args = fiz_make_list(argc - 3, (const char **)argv + 3);
+        t->body = malloc(strlen(argv[2]) + strlen(args) + 2);
+        sprintf(t->body, "%s %s", argv[2], args);
+        free(args);
+    } else
+        t->body = strdup(argv[2]);
+
+    pthread_mutex_lock(&handles_lock);
+    if(!threads)
+        threads = ht_create(16);
+    snprintf(t->name, sizeof t->name, "thread%lu", ++last_thread);
+    if(pthread_create(&t->thread, NULL, thread_main, t)) {
+        pthread_mutex_unlock(&handles_lock);
+        free_thread(t);
+        fiz_set_return(F, "unable to start a thread");
+        return FIZ_ERROR;
+    }
+    ht_insert(threads, t->name, t);
+    pthread_mutex_unlock(&handles_lock);
+    fiz_set_return(F, t->name);
+    return FIZ_OK;
+}
+
+static Fiz_Code thread_join(Fiz *F, int argc, char **argv) {
+    struct fiz_thread *t = NULL;
+    Fiz_Code rc;
+    if(argc != 3)
+        return fiz_argc_error(F, argv[0], 3);
+    pthread_mutex_lock(&handles_lock);
+    if(threads)
+        t = ht_delete(threads, argv[2]);
+    pthread_mutex_unlock(&handles_lock);
+    if(!t) {
+        fiz_set_return_ex(F, "unknown thread %s", argv[2]);
+        return FIZ_ERROR;
+    }
+    pthread_join(t->thread, NULL);
+    fiz_set_return(F, t->result);
+    rc = t->rc == FIZ_OK || t->rc == FIZ_RETURN ? FIZ_OK : FIZ_ERROR;
+    free_thread(t);
+    return rc;
+}
+
+static Fiz_Code thread_thread(Fiz *F, int argc, char **argv, void *data) {
+    if(argc < 2)
+        return fiz_argc_error(F, argv[0], 2);
+    if(!strcmp(argv[1], "spawn"))
+        return thread_spawn(F, argc, argv);
+    if(!strcmp(argv[1], "join"))
+        return thread_join(F, argc, argv);
+    fiz_set_return_ex(F, "unknown command %s to %s", argv[1], argv[0]);
+    return FIZ_ERROR;
+}
+
+void fiz_add_threads(Fiz *F) {
+    fiz_add_func(F, "thread", thread_thread, NULL);
+    fiz_add_func(F, "chan", thread_chan, NULL);
+}
+
+#ifdef TEST
+/*
+ * Tests for the pool, the futures and the interpreter API that the
+ * workers and hosts use. Compile the test program like so:
+ * $ gcc -o pooltest -Wall -Werror -pedantic -O2 -pthread -DTEST pool.c libfiz.a -lm
+ */
+#include <stdio.h>
+
+static int failures;
+
+#define CHECK(c) do { if(!(c)) { fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #c); failures++; } } while(0)
+
+#define SUBMITTERS  4
+#define JOBS        3000
+
+static Fiz_Pool *sq_pool;
+
+/* Submits jobs from one of several threads and checks their results */
+static void *submitter(void *arg) {
+    int base = *(int *)arg, i;
+    char num[16];
+    const char *argv[] = {num};
+    Fiz_Future **f = malloc(JOBS * sizeof *f);
+    for(i = 0; i < JOBS; i++) {
+        snprintf(num, sizeof num, "%d", base + i);
+        f[i] = fiz_pool_submit(sq_pool, "sq [lindex $args 0]", 1, argv, NULL, NULL);
+    }
+    for(i = 0; i < JOBS; i++) {
+        CHECK(fiz_future_wait(f[i]) == FIZ_OK);
+        CHECK(atol(fiz_future_result(f[i])) == (long)(base + i) * (base + i));
+        fiz_future_free(f[i]);
+    }
+    free(f);
+    return NULL;
+}
+
+static atomic_int inits, calls, sum;
+
+static void count_init(Fiz *F, void *data) {
+    atomic_fetch_add(&inits, 1);
+}
+
+static void count_done(Fiz_Code rc, const char *result, void *data) {
+    atomic_fetch_add(&calls, 1);
+    if(rc == FIZ_OK)
+        atomic_fetch_add(&sum, atoi(result));
+}
+
+static void test_pool(void) {
+    pthread_t threads[SUBMITTERS];
+    int bases[SUBMITTERS], i;
+    Fiz_Future *f;
+
+    CHECK(fiz_pool_create(0, NULL, NULL, NULL) == NULL);
+    CHECK(fiz_pool_create(-1, NULL, NULL, NULL) == NULL);
+    CHECK(fiz_pool_create(2, "proc ok {} {}; no_such_command", NULL, NULL) == NULL);
+
+    sq_pool = fiz_pool_create(4, "proc sq {x} {expr $x*$x}", count_init, NULL);
+    CHECK(sq_pool != NULL);
+    if(!sq_pool)
+        return;
+    CHECK(atomic_load(&inits) == 4);
+
+    /* More jobs than the queue holds, from several threads at once */
+    for(i = 0; i < SUBMITTERS; i++) {
+        bases[i] = i * JOBS;
+        pthread_create(&threads[i], NULL, submitter, &bases[i]);
+    }
+    for(i = 0; i < SUBMITTERS; i++)
+        pthread_join(threads[i], NULL);
+
+    /* The callback gets every result before the future is done */
+    for(i = 1; i <= 100; i++) {
+        char num[16];
+        const char *argv[] = {num};
+        snprintf(num, sizeof num, "%d", i);
+        fiz_future_free(fiz_pool_submit(sq_pool, "lindex $args 0", 1, argv, count_done, NULL));
+    }
+    f = fiz_pool_submit(sq_pool, "return last", 0, NULL, count_done, NULL);
+    CHECK(fiz_future_wait(f) == FIZ_RETURN);
+    fiz_future_free(f);
+
+    /* A script that fails */
+    f = fiz_pool_submit(sq_pool, "no_such_command", 0, NULL, NULL, NULL);
+    CHECK(fiz_future_wait(f) == FIZ_ERROR);
+    CHECK(strstr(fiz_future_result(f), "no_such_command") != NULL);
+    CHECK(fiz_future_done(f));
+    fiz_future_free(f);
+
+    /* A future freed before its job is done; the job still runs */
+    fiz_future_free(fiz_pool_submit(sq_pool, "for i from 1 to 100000 {}; return 0", 0, NULL, count_done, NULL));
+
+    fiz_pool_destroy(sq_pool);
+    CHECK(atomic_load(&calls) == 102);
+    CHECK(atomic_load(&sum) == 5050);
+}
+
+/* Runs 'code' in slices of 'steps' until it is done, and returns how many
+ * slices it took. 'between' is executed after every slice that stopped */
+static int run_slices(Fiz *F, Fiz_Compiled *code, int steps, const char *between, Fiz_Code *rc) {
+    int n = 1;
+    while((*rc = fiz_exec_budget(F, code, steps)) == FIZ_YIELDED) {
+        if(between)
+            CHECK(fiz_exec(F, between) == FIZ_OK);
+        n++;
+    }
+    return n;
+}
+
+static void test_budget(void) {
+    Fiz *F = fiz_create();
+    Fiz_Compiled *code;
+    Fiz_Code rc;
+    const char *v;
+    int n, last;
+
+    fiz_add_aux(F);
+
+    /* Stops inside a proc and the counted loop in it */
+    code = fiz_compile(F, "proc sum {n} {set s 0; for i from 1 to $n {set s [expr $s + $i]}; return $s}\n"
+        "set r [sum 100]");
+    n = run_slices(F, code, 7, "set between 1", &rc);
+    CHECK(rc == FIZ_OK);
+    CHECK(n > 20);
+    CHECK((v = fiz_get_var(F, "r")) && !strcmp(v, "5050"));
+    /* The proc's locals stayed in its own callframe */
+    CHECK(fiz_get_var(F, "s") == NULL);
+    fiz_free_compiled(code);
+
+    /* The interpreter can be used between the slices of a loop */
+    code = fiz_compile(F, "set t 0; set seen {}; for i from 1 to 50 {incr t; lappend seen $other}");
+    fiz_set_var(F, "other", "0");
+    n = run_slices(F, code, 5, "incr other", &rc);
+    CHECK(rc == FIZ_OK);
+    CHECK((v = fiz_get_var(F, "t")) && !strcmp(v, "50"));
+    CHECK((v = fiz_get_var(F, "other")) && atoi(v) == n - 1);
+    fiz_free_compiled(code);
+
+    /* A cancelled run starts over */
+    code = fiz_compile(F, "set c 0; incr c; incr c; incr c; incr c");
+    CHECK(fiz_exec_budget(F, code, 2) == FIZ_YIELDED);
+    CHECK((v = fiz_get_var(F, "c")) && !strcmp(v, "1"));
+    fiz_cancel(F, code);
+    fiz_set_var(F, "c", "100");
+    CHECK(fiz_exec_budget(F, code, 100) == FIZ_OK);
+    CHECK((v = fiz_get_var(F, "c")) && !strcmp(v, "4"));
+    /* Cancelling when nothing is stopped does nothing */
+    fiz_cancel(F, code);
+
+    /* A budget of 0 or less still executes one command per call */
+    for(last = 0; last >= -3; last -= 3) {
+        n = run_slices(F, code, last, NULL, &rc);
+        CHECK(rc == FIZ_OK);
+        CHECK(n == 5);
+    }
+
+    /* Freeing a stopped script leaves the run to fiz_destroy() */
+    CHECK(fiz_exec_budget(F, code, 1) == FIZ_YIELDED);
+    fiz_free_compiled(code);
+    CHECK(fiz_exec(F, "set after 1") == FIZ_OK);
+
+    fiz_destroy(F);
+}
+
+/* Checks that the return value of 'F' is 's' */
+#define CHECK_RETURN(F, s) CHECK(!strcmp(fiz_get_return(F), s))
+
+static void test_call(void) {
+    Fiz *F = fiz_create();
+    Fiz_Compiled *code;
+    Fiz_Command *cmd;
+    const char *args[] = {"{x y", "a [b] $c"};
+    const char *five[] = {"5"}, *resume[] = {"add", "5"};
+    const char *v;
+
+    fiz_add_aux(F);
+    CHECK(fiz_exec(F, "proc pair {a b} {return \"$a|$b\"}") == FIZ_OK);
+
+    /* The arguments are passed as they are, to procs and C commands */
+    CHECK(fiz_call(F, "pair", 2, args) == FIZ_OK);
+    CHECK_RETURN(F, "{x y|a [b] $c");
+    CHECK(fiz_call(F, "set", 2, args) == FIZ_OK);
+    CHECK((v = fiz_get_var(F, "{x y")) && !strcmp(v, "a [b] $c"));
+
+    CHECK(fiz_call(F, "no_such_command", 0, NULL) == FIZ_ERROR);
+    CHECK_RETURN(F, "undefined command 'no_such_command'");
+    CHECK(fiz_call(F, "pair", 1, args) == FIZ_ERROR);
+    CHECK_RETURN(F, "'pair' wanted 2 parameters, but got 1");
+
+    /* A handle to a command that doesn't exist yet, and is then redefined */
+    cmd = fiz_command(F, "later");
+    CHECK(fiz_call_command(F, cmd, 0, NULL) == FIZ_ERROR);
+    CHECK(fiz_exec(F, "proc later {} {return one}") == FIZ_OK);
+    CHECK(fiz_call_command(F, cmd, 0, NULL) == FIZ_OK);
+    CHECK_RETURN(F, "one");
+    CHECK(fiz_exec(F, "proc later {x} {return \"two $x\"}") == FIZ_OK);
+    CHECK(fiz_call_command(F, cmd, 1, five) == FIZ_OK);
+    CHECK_RETURN(F, "two 5");
+    fiz_free_command(cmd);
+
+    /* A compiled script sees the variables as they are when it runs */
+    code = fiz_compile(F, "pair $x [expr $x * 2]");
+    fiz_set_var(F, "x", "3");
+    CHECK(fiz_run(F, code) == FIZ_OK);
+    CHECK_RETURN(F, "3|6");
+    fiz_set_var(F, "x", "4");
+    CHECK(fiz_run(F, code) == FIZ_OK);
+    CHECK_RETURN(F, "4|8");
+    fiz_free_compiled(code);
+
+    /* Resuming coroutines */
+    CHECK(fiz_exec(F, "proc counter {n} {for i from 1 to $n {yield $i}; return done}") == FIZ_OK);
+    CHECK(fiz_exec(F, "coroutine next counter 2") == FIZ_OK);
+    CHECK_RETURN(F, "1");
+    CHECK(fiz_call(F, "next", 0, NULL) == FIZ_OK);
+    CHECK_RETURN(F, "2");
+    CHECK(fiz_call(F, "next", 0, NULL) == FIZ_OK);
+    CHECK_RETURN(F, "done");
+    CHECK(fiz_call(F, "next", 0, NULL) == FIZ_ERROR);
+
+    CHECK(fiz_exec(F, "proc total {} {set t 0; while {expr 1} {set t [expr $t + [yield $t]]}}") == FIZ_OK);
+    CHECK(fiz_exec(F, "coroutine add total") == FIZ_OK);
+    cmd = fiz_command(F, "add");
+    CHECK(fiz_call_command(F, cmd, 1, five) == FIZ_OK);
+    CHECK(fiz_call(F, "resume", 2, resume) == FIZ_OK);
+    CHECK_RETURN(F, "10");
+    fiz_free_command(cmd);
+
+    fiz_destroy(F);
+}
+
+/* expr reads variables through the numbers cached in their values */
+static void test_expr_vars(void) {
+    Fiz *F = fiz_create();
+    fiz_add_aux(F);
+    CHECK(fiz_exec(F, "set b 2.5; set r [expr {$b * 2}]; set r [expr {$b * $r}]") == FIZ_OK);
+    CHECK_RETURN(F, "12.5");
+    /* Changing the string in place forgets the number */
+    CHECK(fiz_exec(F, "append b 1; expr {$b * 2}") == FIZ_OK);
+    CHECK_RETURN(F, "5.02");
+    CHECK(fiz_exec(F, "set i 0; while {expr {$i < 100}} {incr i}; expr {$i + 0}") == FIZ_OK);
+    CHECK_RETURN(F, "100");
+    CHECK(fiz_exec(F, "set a 3x; expr {$a + 1}") == FIZ_ERROR);
+    CHECK_RETURN(F, "expr: variable 'a' is not a number in '$a + 1'");
+    CHECK(fiz_exec(F, "expr {$nope + 1}") == FIZ_ERROR);
+    CHECK_RETURN(F, "expr: unknown variable 'nope' in '$nope + 1'");
+    fiz_destroy(F);
+}
+
+int main(int argc, char *argv[]) {
+    test_pool();
+    test_budget();
+    test_call();
+    test_expr_vars();
+    if(failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}
+
+#endif /* TEST */
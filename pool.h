@@ -0,0 +1,131 @@
+/*1 Fiz threads
+ *# Runs scripts on a number of threads, each of which has an
+ *# interpreter of its own.\n
+ *{
+ ** A pool is created with {{fiz_pool_create()}} and destroyed with
+ *# {{fiz_pool_destroy()}}
+ ** Scripts are handed to the workers with {{fiz_pool_submit()}}
+ ** The result of a script is waited for with {{fiz_future_wait()}}, or
+ *# passed to a callback when the script is done
+ ** Scripts can start threads and pass values between them themselves
+ *# through the commands added by {{fiz_add_threads()}}
+ *}
+ *# Jobs are passed to the workers through a lock-free queue, so
+ *# threads that submit jobs don't get in each other's way.\n
+ *# Programs that use the pool have to be linked with {{-pthread}}.
+ *2 License
+ *[
+ *# Author: Werner Stoop
+ *# This is free and unencumbered software released into the public domain.
+ *# http://unlicense.org/
+ *]
+ *2 API
+ */
+
+#ifndef FIZ_POOL_H
+#define FIZ_POOL_H
+
+#include "fiz.h"
+
+/*@ typedef struct fiz_pool Fiz_Pool
+ *# A pool of worker threads.
+ */
+typedef struct fiz_pool Fiz_Pool;
+
+/*@ typedef struct fiz_future Fiz_Future
+ *# The result of a script that was submitted to a pool, once the
+ *# script is done.
+ */
+typedef struct fiz_future Fiz_Future;
+
+/*@ typedef void (*fiz_pool_init)(Fiz *F, void *data);
+ *# A function that prepares the interpreter of a worker, for example by
+ *# adding C-functions to it with {{fiz_add_func()}}.
+ */
+typedef void (*fiz_pool_init)(Fiz *F, void *data);
+
+/*@ typedef void (*fiz_pool_done)(Fiz_Code rc, const char *result, void *data);
+ *# A function that is called with the result of a script when it is done.
+ */
+typedef void (*fiz_pool_done)(Fiz_Code rc, const char *result, void *data);
+
+/*@ Fiz_Pool *fiz_pool_create(int nworkers, const char *setup, fiz_pool_init init, void *data);
+ *# Starts {{nworkers}} worker threads.\n
+ *# Each worker creates an interpreter, adds the auxiliary functions
+ *# with {{fiz_add_aux()}}, calls {{init}} if it isn't {{NULL}}, and then
+ *# executes the script {{setup}} if it isn't {{NULL}}. Use {{setup}} to
+ *# define the procs that the jobs call. The workers compile them once,
+ *# rather than for every job.\n
+ *# It returns {{NULL}} if {{nworkers}} is less than 1, or if {{setup}}
+ *# fails in any of the workers.
+ */
+Fiz_Pool *fiz_pool_create(int nworkers, const char *setup, fiz_pool_init init, void *data);
+
+/*@ Fiz_Future *fiz_pool_submit(Fiz_Pool *pool, const char *script, int argc, const char **argv, fiz_pool_done done, void *data);
+ *# Queues {{script}} to be executed by the next worker that is free.\n
+ *# The script sees the {{argc}} strings in {{argv}} as a list in the
+ *# variable {{args}}. Each worker compiles a script the first time it
+ *# executes it, so submitting the same script over and over with
+ *# different arguments is cheaper than building a new script each time.\n
+ *# If {{done}} isn't {{NULL}}, it is called with the result on the
+ *# worker's thread when the script is done.\n
+ *# If the queue is full, it waits until there is space.\n
+ *# The returned future has to be freed with {{fiz_future_free()}}.
+ */
+Fiz_Future *fiz_pool_submit(Fiz_Pool *pool, const char *script, int argc, const char **argv, fiz_pool_done done, void *data);
+
+/*@ Fiz_Code fiz_future_wait(Fiz_Future *f);
+ *# Waits for the script of {{f}} to be done, and returns its result code.
+ */
+Fiz_Code fiz_future_wait(Fiz_Future *f);
+
+/*@ int fiz_future_done(Fiz_Future *f);
+ *# Returns nonzero if the script of {{f}} is done, without waiting.
+ */
+int fiz_future_done(Fiz_Future *f);
+
+/*@ const char *fiz_future_result(Fiz_Future *f);
+ *# Returns the result of the script of {{f}}, or the error message if
+ *# it failed. It waits for the script to be done first.
+ */
+const char *fiz_future_result(Fiz_Future *f);
+
+/*@ void fiz_future_free(Fiz_Future *f);
+ *# Frees a future. It is safe to free it before the script is done;
+ *# the script still runs.
+ */
+void fiz_future_free(Fiz_Future *f);
+
+/*@ void fiz_pool_destroy(Fiz_Pool *pool);
+ *# Waits for the workers to execute the scripts that are still queued,
+ *# then stops them and frees the pool.
+ */
+void fiz_pool_destroy(Fiz_Pool *pool);
+
+/*@ void fiz_add_threads(Fiz *F);
+ *# Adds the {{thread}} and {{chan}} commands to the interpreter:
+ *{
+ ** {{thread spawn BODY ?ARG ...?}} executes {{BODY}} on a new thread,
+ *# in a new interpreter that has the auxiliary functions, these commands
+ *# and copies of the procs of the interpreter that started it. The
+ *# {{ARG}}s are added to the end of {{BODY}} as words, as {{eval}} would,
+ *# so {{BODY}} is usually a command such as a proc name. It returns the
+ *# name of the thread.
+ ** {{thread join THREAD}} waits for the thread to finish and returns the
+ *# result of its body, or fails with its error.
+ ** {{chan create ?SIZE?}} returns the name of a new channel that holds up
+ *# to {{SIZE}} values (16 by default).
+ ** {{chan send CHAN VALUE}} adds {{VALUE}} to the channel, and waits if it
+ *# is full.
+ ** {{chan recv CHAN ?VAR?}} takes the oldest value from the channel, and
+ *# waits if it is empty. It fails if the channel is closed and empty.
+ *# With {{VAR}}, it stores the value in {{VAR}} and returns 1, or returns 0
+ *# if the channel is closed and empty.
+ ** {{chan close CHAN}} closes the channel. Values that were already sent
+ *# can still be received.
+ *}
+ *# Channels and threads can be used from any of the interpreters.
+ */
+void fiz_add_threads(Fiz *F);
+
+#endif /* FIZ_POOL_H */
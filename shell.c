@@ -11,6 +11,7 @@
 #include <time.h>
 
 #include "fiz.h"
+#include "pool.h"
 
 Fiz *F;
 int sigint_called = 0;
@@ -55,6 +56,7 @@ int main(int argc, char *argv[]) {
     F = fiz_create();
 
     fiz_add_aux(F);
+    fiz_add_threads(F);
 
     signal(SIGINT, handle_sigint); 
     fiz_add_func(F, "delay", shellfunc_delay, NULL);
@@ -0,0 +1,245 @@
+/*
+ * A skip list of string keys, kept in the order of strcmp().
+ *
+ * Every entry is on the bottom level, a sorted linked list, and each
+ * level above holds about a quarter of the entries of the level below
+ * it. Searches start on the top level and drop down a level whenever
+ * the next entry's key is too large, so they take O(log n) steps.
+ * Once an entry has been found, the entries after it are a walk along
+ * the bottom level, which is what makes range queries cheap.
+ *
+ * The heights of the entries come from a pseudo-random generator with
+ * a fixed seed, so that a list is built the same way every time.
+ *
+ * See skiplist.h for more info
+ *
+ * This is free and unencumbered software released into the public domain.
+ * http://unlicense.org/
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "skiplist.h"
+
+/* Allocates memory for a skip list */
+struct skiplist *
+sl_create (void)
+{
+  struct skiplist *l = malloc (sizeof *l);
+  int i;
+
+  if (!l)
+    return NULL;
+  for (i = 0; i < SL_MAX_HEIGHT; i++)
+    l->head[i] = NULL;
+  l->last = NULL;
+  l->height = 1;
+  l->cnt = 0;
+  l->version = 0;
+  l->seed = 2463534242u;
+  return l;
+}
+
+/* Chooses the height of a new node: Each level above the first
+ * has a chance of 1 in 4. Uses a xorshift generator. */
+static int
+random_height (struct skiplist *l)
+{
+  unsigned int x = l->seed;
+  int h = 1;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  l->seed = x;
+  while (h < SL_MAX_HEIGHT && (x & 3) == 0)
+    {
+      h++;
+      x >>= 2;
+    }
+  return h;
+}
+
+/* Finds the last node on each level whose key is smaller than 'key',
+ * or not larger than 'key' if 'after' is set, and stores them in
+ * 'prev'. NULL in 'prev' stands for the head of the list.
+ * Returns the next node on the bottom level.
+ */
+static struct sl_node *
+search (struct skiplist *l, const char *key, int after,
+        struct sl_node **prev)
+{
+  struct sl_node *p = NULL, *n;
+  int i, c;
+
+  for (i = l->height - 1; i >= 0; i--)
+    {
+      for (;;)
+        {
+          n = p ? p->next[i] : l->head[i];
+          if (!n)
+            break;
+          c = strcmp (n->key, key);
+          if (c > 0 || (c == 0 && !after))
+            break;
+          p = n;
+        }
+      if (prev)
+        prev[i] = p;
+    }
+  return p ? p->next[0] : l->head[0];
+}
+
+#define NEXT(l, p, i)	 ((p) ? &(p)->next[i] : &(l)->head[i])
+
+void *
+sl_insert (struct skiplist *l, const char *key, void *value)
+{
+  struct sl_node *prev[SL_MAX_HEIGHT], *n;
+  size_t len;
+  int i, h;
+
+  n = search (l, key, 0, prev);
+  if (n && !strcmp (n->key, key))
+    {
+      n->value = value;
+      return value;
+    }
+
+  h = random_height (l);
+  len = strlen (key);
+  /* The key is stored after the node's pointers */
+  n = malloc (sizeof *n + h * sizeof n->next[0] + len + 1);
+  if (!n)
+    return NULL;
+  n->key = (char *) &n->next[h];
+  memcpy (n->key, key, len + 1);
+  n->value = value;
+  n->height = h;
+
+  for (i = l->height; i < h; i++)
+    prev[i] = NULL;
+  if (h > l->height)
+    l->height = h;
+  for (i = 0; i < h; i++)
+    {
+      n->next[i] = *NEXT (l, prev[i], i);
+      *NEXT (l, prev[i], i) = n;
+    }
+  if (!n->next[0])
+    l->last = n;
+  l->cnt++;
+  l->version++;
+  return value;
+}
+
+void *
+sl_find (struct skiplist *l, const char *key)
+{
+  struct sl_node *n = search (l, key, 0, NULL);
+  if (n && !strcmp (n->key, key))
+    return n->value;
+  return NULL;
+}
+
+struct sl_node *
+sl_seek (struct skiplist *l, const char *key, int after)
+{
+  if (!key)
+    return l->head[0];
+  return search (l, key, after, NULL);
+}
+
+int
+sl_iterate (struct skiplist *l, struct sl_cursor *c, const char **key,
+            void **value)
+{
+  struct sl_node *n;
+  size_t len;
+  char *k;
+
+  if (!c->started)
+    n = l->head[0];
+  else if (!c->key)
+    return 0;
+  else if (c->version == l->version)
+    n = c->next;
+  else
+    /* Entries were inserted or deleted: 'next' can't be trusted */
+    n = search (l, c->key, 1, NULL);
+  c->started = 1;
+  if (!n)
+    {
+      sl_cursor_done (c);
+      return 0;
+    }
+  len = strlen (n->key) + 1;
+  if (len > c->size)
+    {
+      k = realloc (c->key, len);
+      if (!k)
+        {
+          sl_cursor_done (c);
+          return 0;
+        }
+      c->key = k;
+      c->size = len;
+    }
+  memcpy (c->key, n->key, len);
+  c->next = n->next[0];
+  c->version = l->version;
+  if (key)
+    *key = n->key;
+  if (value)
+    *value = n->value;
+  return 1;
+}
+
+void
+sl_cursor_done (struct sl_cursor *c)
+{
+  free (c->key);
+  c->key = NULL;
+  c->size = 0;
+  c->next = NULL;
+}
+
+void *
+sl_delete (struct skiplist *l, const char *key)
+{
+  struct sl_node *prev[SL_MAX_HEIGHT], *n;
+  void *value;
+  int i;
+
+  n = search (l, key, 0, prev);
+  if (!n || strcmp (n->key, key))
+    return NULL;
+  for (i = 0; i < n->height; i++)
+    *NEXT (l, prev[i], i) = n->next[i];
+  while (l->height > 1 && !l->head[l->height - 1])
+    l->height--;
+  if (l->last == n)
+    l->last = prev[0];
+  l->cnt--;
+  l->version++;
+  value = n->value;
+  free (n);
+  return value;
+}
+
+/* Deallocates an entire skip list */
+void
+sl_free (struct skiplist *l, sl_dtor dtor)
+{
+  struct sl_node *n, *next;
+
+  for (n = l->head[0]; n; n = next)
+    {
+      next = n->next[0];
+      if (dtor)
+        dtor (n->key, n->value);
+      free (n);
+    }
+  free (l);
+}
@@ -0,0 +1,160 @@
+/*1 Skiplist.h
+ *# A skip list that keeps string keys in sorted order, for looking up
+ *# keys in order and ranges of keys.\n
+ *{
+ ** {{struct skiplist}} is created with {{~~sl_create()}}
+ ** {{struct skiplist}} is destroyed with {{~~sl_free()}}
+ ** Insert entries into the list with {{~~sl_insert()}}
+ ** Search for entries with {{~~sl_find()}} and {{~~sl_seek()}}
+ ** Remove entries with {{~~sl_delete()}}
+ ** Iterate through the list with {{~~sl_iterate()}}, or by following
+ *# the {{next}} pointers of the nodes
+ *}
+ *# Keys are compared with {{strcmp()}}.
+ *2 License
+ *[
+ *# Author: Werner Stoop
+ *# This software is provided under the terms of the unlicense.
+ *# See http://unlicense.org/ for more details.
+ *]
+ *2 API
+ */
+
+#ifndef SKIPLIST_H
+#define SKIPLIST_H
+
+#include <stddef.h>
+
+#if defined(__cplusplus) || defined(c_plusplus)
+extern "C"
+{
+#endif
+
+/*@ SL_MAX_HEIGHT
+ *# The maximum number of levels of a skip list. Each level has a
+ *# quarter of the nodes of the level below it.
+ */
+#define SL_MAX_HEIGHT 16
+
+/*@ typedef void (*sl_dtor) (const char *key, void *val)
+ *# A pointer to a function that can clean up the values in a skip list.
+ */
+  typedef void (*sl_dtor) (const char *key, void *val);
+
+/*@ struct sl_node
+ *# An entry in the skip list.\n
+ *# {{next[0]}} is the entry with the next key, or {{NULL}} for the last
+ *# entry. The higher levels skip over more and more of the entries.
+ */
+  struct sl_node
+  {
+    char *key;
+    void *value;
+    int height;
+    struct sl_node *next[];
+  };
+
+/*@ struct ##skiplist
+ *# Structure for managing the skip list.\n
+ *# Allocate this structure through {{~~sl_create()}}
+ *# and deallocate it with {{~~sl_free()}}\n
+ *# {{cnt}} is the number of entries in the list and {{last}} is the entry
+ *# with the largest key.\n
+ *# {{version}} changes whenever entries are inserted or deleted, so that
+ *# code that holds on to a node can tell whether it may have been deleted.
+ */
+  struct skiplist
+  {
+    struct sl_node *head[SL_MAX_HEIGHT];
+    struct sl_node *last;
+    int height;
+    int cnt;
+    unsigned int version;
+    unsigned int seed;
+  };
+
+/*@ struct ##sl_cursor
+ *# Keeps the position of an iteration through a skip list with
+ *# {{~~sl_iterate()}}. Set all its fields to 0 before the first call.\n
+ *# {{next}} is the next entry to visit, which can be trusted as long as the
+ *# list's {{version}} hasn't changed. {{key}} is a copy of the last key
+ *# retrieved, to find the position again if it has.
+ */
+  struct sl_cursor
+  {
+    struct sl_node *next;
+    unsigned int version;
+    int started;
+    char *key;
+    size_t size;
+  };
+
+/*@ struct skiplist *##sl_create (void)
+ *# Allocates memory for a skip list.
+ */
+  struct skiplist *sl_create (void);
+
+/*@ void *##sl_insert (struct skiplist *l, const char *key, void *value)
+ *# Inserts a {{value}} referenced by the string {{key}}
+ *# into the skip list {{l}}.\n
+ *# If {{key}} is already in the list, its value is replaced.\n
+ *# It returns {{value}} on success, or {{NULL}} if {{malloc()}} failed.
+ */
+  void *sl_insert (struct skiplist *l, const char *key, void *value);
+
+/*@ void *##sl_find (struct skiplist *l, const char *key)
+ *# Finds the value of the {{key}} in the list {{l}}.\n
+ *# It returns {{NULL}} if the key is not in the list.
+ */
+  void *sl_find (struct skiplist *l, const char *key);
+
+/*@ struct sl_node *##sl_seek (struct skiplist *l, const char *key, int after)
+ *# Finds the entry with the smallest key that is not smaller than {{key}}
+ *# or, if {{after}} is set, the smallest key that is larger than {{key}}.
+ *# {{key}} need not be in the list.\n
+ *# If {{key}} is {{NULL}} the first entry is returned.\n
+ *# It returns {{NULL}} if there is no such entry.
+ */
+  struct sl_node *sl_seek (struct skiplist *l, const char *key, int after);
+
+/*@ int ##sl_iterate (struct skiplist *l, struct sl_cursor *c, const char **key, void **value)
+ *# Iterates through the skip list {{l}} in order, retrieving the {{key}}
+ *# and {{value}} of the next entry. Either of {{key}} and {{value}} may be
+ *# {{NULL}}.\n
+ *# {{c}} keeps track of the position in the list.\n
+ *# It returns 0 if there are no more entries in the list, or if
+ *# {{malloc()}} failed.\n
+ *# Each step takes constant time while the list is not changed. If entries
+ *# were inserted or deleted since the last step, the next entry is searched
+ *# for in O(log n) time, so deleting the key that was just retrieved does not
+ *# disturb the iteration. Any number of iterations may run at the same time.
+ */
+  int sl_iterate (struct skiplist *l, struct sl_cursor *c, const char **key,
+                  void **value);
+
+/*@ void ##sl_cursor_done (struct sl_cursor *c)
+ *# Releases the memory held by the cursor {{c}}. {{~~sl_iterate()}} does
+ *# this itself when it reaches the end of the list, so this is only needed
+ *# if an iteration is stopped early.
+ */
+  void sl_cursor_done (struct sl_cursor *c);
+
+/*@ void *##sl_delete (struct skiplist *l, const char *key)
+ *# Deletes the entry with the {{key}} from the list {{l}}.\n
+ *# It returns the value associated with the key.
+ */
+  void *sl_delete (struct skiplist *l, const char *key);
+
+/*@ void ##sl_free (struct skiplist *l, sl_dtor dtor)
+ *# Deletes a skip list {{l}}.\n
+ *# The parameter {{dtor}} can point to a function that will free
+ *# resources allocated to the values in the list.
+ *# This function will be called for each value in the list.
+ */
+  void sl_free (struct skiplist *l, sl_dtor dtor);
+
+#if defined(__cplusplus) || defined(c_plusplus)
+}                               /* extern "C" */
+#endif
+
+#endif                          /* SKIPLIST_H */